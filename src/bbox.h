@@ -45,7 +45,12 @@ struct RRay: Ray {
 	// Ray with rdir; used for quicker intersection tests
 	Vector rdir;
 	RRay() {}
-	explicit RRay(const Ray& r): Ray(r) {}
+	explicit RRay(const Ray& r): Ray(r.start, r.dir) // (ray differentials aren't needed here)
+	{
+		depth = r.depth;
+		flags = r.flags & ~RF_DIFFERENTIALS;
+	}
+	/// computes rdir. The reciprocals are kept finite, so that the slab tests never produce NaNs
 	void prepareForTracing()
 	{
 		rdir.x = fabs(dir.x) > 1e-12 ? 1.0 / dir.x : 1e12;
@@ -75,6 +80,11 @@ struct BBox {
 		vmin.y = min(vmin.y, vec.y); vmax.y = max(vmax.y, vec.y);
 		vmin.z = min(vmin.z, vec.z); vmax.z = max(vmax.z, vec.z);
 	}
+	/// is the box empty (e.g. the result of intersecting two disjoint boxes)?
+	inline bool isEmpty() const
+	{
+		return vmin.x > vmax.x || vmin.y > vmax.y || vmin.z > vmax.z;
+	}
 	/// Checks if a point is inside the bounding box (borders-inclusive)
 	inline bool inside(const Vector& v) const
 	{
@@ -82,120 +92,74 @@ struct BBox {
 		        vmin.y - 1e-6 <= v.y && v.y <= vmax.y + 1e-6 &&
 		        vmin.z - 1e-6 <= v.z && v.z <= vmax.z + 1e-6);
 	}
+	/// Slab test: finds the interval [tmin, tmax], where the ray (ray.start + ray.dir * t) is inside the box.
+	/// It's branch-free (min/max only), and uses ray.rdir, so the ray must be prepared with prepareForTracing().
+	/// @returns true if the interval is non-empty and not entirely behind the ray start (tmin may be negative,
+	///          if the ray starts inside the box)
+	inline bool intersectSlabs(const RRay& ray, double& tmin, double& tmax) const
+	{
+		// the box is padded by the same tolerance as in inside(), so that flat boxes and grazing rays are handled:
+		double tx0 = (vmin.x - 1e-6 - ray.start.x) * ray.rdir.x, tx1 = (vmax.x + 1e-6 - ray.start.x) * ray.rdir.x;
+		double ty0 = (vmin.y - 1e-6 - ray.start.y) * ray.rdir.y, ty1 = (vmax.y + 1e-6 - ray.start.y) * ray.rdir.y;
+		double tz0 = (vmin.z - 1e-6 - ray.start.z) * ray.rdir.z, tz1 = (vmax.z + 1e-6 - ray.start.z) * ray.rdir.z;
+		tmin = max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1));
+		tmax = min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1));
+		return tmin <= tmax && tmax >= 0;
+	}
 	/// Test for ray-box intersection
 	/// @returns true if an intersection exists; false otherwise.
 	inline bool testIntersect(const RRay& ray) const
 	{
-		if (inside(ray.start)) return true;
-		for (int dim = 0; dim < 3; dim++) {
-			if ((ray.dir[dim] < 0 && ray.start[dim] < vmin[dim]) || (ray.dir[dim] > 0 && ray.start[dim] > vmax[dim])) return false;
-			if (fabs(ray.dir[dim]) < 1e-9) continue;
-			double mul = ray.rdir[dim];
-			int u = (dim == 0) ? 1 : 0;
-			int v = (dim == 2) ? 1 : 2;
-			double dist, x, y;
-			dist = (vmin[dim] - ray.start[dim]) * mul;
-			if (dist < 0) continue; //*
-			/* (*) this is a good optimization I found out by chance. Consider the following scenario
-			 *
-			 *   ---+  ^  (ray)
-			 *      |   \
-			 * bbox |    \
-			 *      |     \
-			 *      |      * (camera)
-			 * -----+
-			 *
-			 * if we're considering the walls up and down of the bbox (which belong to the same axis),
-			 * the optimization in (*) says that we can skip testing with the "up" wall, if the "down"
-			 * wall is behind us. The rationale for that is, that we can never intersect the "down" wall,
-			 * and even if we have the chance to intersect the "up" wall, we'd be intersection the "right"
-			 * wall first. So we can just skip any further intersection tests for this axis.
-			 * This may seem bogus at first, as it doesn't work if the camera is inside the BBox, but then we would
-			 * have quitted the function because of the inside(ray.start) condition in the first line of the function.
-			 */
-			x = ray.start[u] + ray.dir[u] * dist;
-			if (vmin[u] <= x && x <= vmax[u]) {
-				y = ray.start[v] + ray.dir[v] * dist;
-				if (vmin[v] <= y && y <= vmax[v]) {
-					return true;
-				}
-			}
-			dist = (vmax[dim] - ray.start[dim]) * mul;
-			if (dist < 0) continue;
-			x = ray.start[u] + ray.dir[u] * dist;
-			if (vmin[u] <= x && x <= vmax[u]) {
-				y = ray.start[v] + ray.dir[v] * dist;
-				if (vmin[v] <= y && y <= vmax[v]) {
-					return true;
-				}
-			}
-		}
-		return false;
+		double tmin, tmax;
+		return intersectSlabs(ray, tmin, tmax);
 	}
-	/// returns the distance to the closest intersection of the ray and the BBox, or +INF if such an intersection doesn't exist.
-	/// please note that this is heavier than using just testIntersect() - testIntersect needs only to consider *ANY* intersection,
-	/// whereas closestIntersection() also needs to find the nearest one.
+	/// returns the distance to the closest intersection of the ray and the BBox (0 if the ray starts inside it),
+	/// or +INF if such an intersection doesn't exist.
 	inline double closestIntersection(const RRay& ray) const
 	{
-		if (inside(ray.start)) return 0;
-		double minDist = INF;
-		for (int dim = 0; dim < 3; dim++) {
-			if ((ray.dir[dim] < 0 && ray.start[dim] < vmin[dim]) || (ray.dir[dim] > 0 && ray.start[dim] > vmax[dim])) return INF;
-			if (fabs(ray.dir[dim]) < 1e-9) continue;
-			double mul = ray.rdir[dim];
-			double xs[2] = { vmin[dim], vmax[dim] };
-			int u = (dim == 0) ? 1 : 0;
-			int v = (dim == 2) ? 1 : 2;
-			for (int j = 0; j < 2; j++) {
-				double dist = (xs[j] - ray.start[dim]) * mul;
-				if (dist < 0) continue;
-				double x = ray.start[u] + ray.dir[u] * dist;
-				if (vmin[u] <= x && x <= vmax[u]) {
-					double y = ray.start[v] + ray.dir[v] * dist;
-					if (vmin[v] <= y && y <= vmax[v]) {
-						minDist = min(minDist, dist);
-					}
-				}
-			}
-		}
-		return minDist;
+		double tmin, tmax;
+		if (!intersectSlabs(ray, tmin, tmax)) return INF;
+		return max(tmin, 0.0);
 	}
-	/// Check whether the box intersects a triangle (all three cases)
-	inline bool intersectTriangle(const Vector& A, const Vector& B, const Vector& C) const
+	/// Clips the triangle to the box, and finds the bounds of the remaining part (a convex polygon).
+	/// @param clipped - output: the bounds of the part of ABC inside the box
+	/// @returns false if the triangle lies entirely outside the box
+	inline bool clipTriangle(const Vector& A, const Vector& B, const Vector& C, BBox& clipped) const
 	{
-		if (inside(A) || inside(B) || inside(C)) return true;
-		RRay ray;
-		Vector t[3] = { A, B, C };
-		for (int i = 0; i < 3; i++) for (int j = i + 1; j < 3; j++) {
-			ray.start = t[i];
-			ray.dir = t[j] - t[i];
-			ray.prepareForTracing();
-			if (testIntersect(ray)) {
-				ray.start = t[j];
-				ray.dir = t[i] - t[j];
-				ray.prepareForTracing();
-				if (testIntersect(ray)) return true;
-			}
-		}
-		Vector AB = B - A;
-		Vector AC = C - A;
-		Vector ABcrossAC = AB ^ AC;
-		double D = A * ABcrossAC;
-		for (int mask = 0; mask < 7; mask++) {
-			for (int j = 0; j < 3; j++) {
-				if (mask & (1 << j)) continue;
-				ray.start.set((mask & 1) ? vmax.x : vmin.x, (mask & 2) ? vmax.y : vmin.y, (mask & 4) ? vmax.z : vmin.z);
-				Vector rayEnd = ray.start;
-				rayEnd[j] = vmax[j];
-				if (signOf(ray.start * ABcrossAC - D) != signOf(rayEnd * ABcrossAC - D)) {
-					ray.dir = rayEnd - ray.start;
-					double gamma = 1.0000001;
-					double l1, l2;
-					if (Triangle::intersect(ray, A, B, C, gamma, l1, l2)) return true;
+		// each of the 6 planes can add at most one vertex:
+		Vector poly[9], temp[9];
+		int n = 3;
+		poly[0] = A; poly[1] = B; poly[2] = C;
+		for (int axis = 0; axis < 3; axis++) {
+			for (int side = 0; side < 2; side++) {
+				double bound = side ? vmax[axis] : vmin[axis];
+				int m = 0;
+				for (int i = 0; i < n; i++) {
+					const Vector& cur = poly[i];
+					const Vector& next = poly[(i + 1) % n];
+					bool curIn  = side ? cur[axis]  <= bound : cur[axis]  >= bound;
+					bool nextIn = side ? next[axis] <= bound : next[axis] >= bound;
+					if (curIn) temp[m++] = cur;
+					if (curIn != nextIn) {
+						double t = (bound - cur[axis]) / (next[axis] - cur[axis]);
+						Vector p = cur + (next - cur) * t;
+						p[axis] = bound;
+						temp[m++] = p;
+					}
 				}
+				n = m;
+				if (n == 0) return false;
+				for (int i = 0; i < n; i++) poly[i] = temp[i];
 			}
 		}
-		return false;
+		clipped.makeEmpty();
+		for (int i = 0; i < n; i++) clipped.add(poly[i]);
+		// guard against roundoff in the intersection points:
+		for (int i = 0; i < 3; i++) {
+			clipped.vmin[i] = max(clipped.vmin[i], vmin[i]);
+			clipped.vmax[i] = min(clipped.vmax[i], vmax[i]);
+		}
+		return true;
 	}
 	/// Split a bounding box along an given axis at a given position, yielding a two child bboxen
 	/// @param axis - an axis to use for splitting (AXIS_X, AXIS_Y or AXIS_Z)
@@ -0,0 +1,364 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File bench.cpp
+ * @Brief fray-bench: renders a list of scenes headlessly, with fixed settings, and reports timings
+ *
+ * Each scene is rendered in a separate process (fray-bench runs itself with --run-one), so that the scenes
+ * don't share any global state, and the peak memory usage is per scene.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#	include <psapi.h>
+#	include <process.h>
+#else
+#	include <sys/resource.h>
+#	include <unistd.h>
+#endif
+#include "util.h"
+#include "sdl.h"
+#include "scene.h"
+#include "bitmap.h"
+#include "random_generator.h"
+#include "texture_cache.h"
+#include "render_stats.h"
+#include "render.h"
+using namespace std;
+
+/// the scenes, which are benchmarked if none are given on the command line (relative to the repository root)
+static const char* defaultScenes[] = {
+	"data/forest.fray",
+	"data/cornell_box.fray",
+	"data/smallpt.fray",
+	"data/zaphod.fray",
+	"data/hw9/dragon.fray",
+};
+
+struct BenchOptions {
+	int width = 640, height = 480;
+	int threads = 1;
+	unsigned seed = 42;
+	string refsDir;       //!< where the reference images are (empty = don't compare)
+	bool updateRefs = false;
+	bool countRays = true;  //!< render each scene a second time, with the statistics on, for the Mrays/s
+	string csvFile, jsonFile;
+	vector<string> scenes;
+};
+
+struct BenchResult {
+	string scene;
+	bool ok = false;
+	double setupSeconds = 0;  //!< parsing and beginRender() (e.g. KD tree building): the time to first pixel
+	double renderSeconds = 0;
+	double totalSeconds = 0;
+	double mraysPerSec = 0;   //!< the rays of the counting render, over the time of the timed one (0 if not counted)
+	double peakMB = 0;
+	double rmse = -1;         //!< against the reference image; -1 if not compared
+};
+
+/// @returns the peak resident memory of this process, in megabytes (0 if unknown)
+static double getPeakMemoryMB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+	return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#	ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0); // in bytes
+#	else
+	return usage.ru_maxrss / 1024.0; // in kilobytes
+#	endif
+#endif
+}
+
+/// the name of a scene (the file name without the path and the extension), used for the reference images
+static string sceneName(const string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	string name = slash == string::npos ? path : path.substr(slash + 1);
+	size_t dot = name.rfind('.');
+	return dot == string::npos ? name : name.substr(0, dot);
+}
+
+/// root-mean-square difference of the rendered frame and an image, in [0..1] units (colors are clamped)
+static double compareWithVFB(const Bitmap& ref)
+{
+	int W = frameWidth(), H = frameHeight();
+	if (ref.getWidth() != W || ref.getHeight() != H) return -1;
+	double sum = 0;
+	for (int y = 0; y < H; y++)
+		for (int x = 0; x < W; x++) {
+			Color a = vfb[y][x], b = ref.getPixel(x, y);
+			for (int i = 0; i < 3; i++) {
+				double d = min(1.0f, max(0.0f, a[i])) - min(1.0f, max(0.0f, b[i]));
+				sum += d * d;
+			}
+		}
+	return sqrt(sum / (3.0 * W * H));
+}
+
+/// renders a single scene in this process, and writes the results to `resultFile'
+static int runOne(const char* sceneFile, const BenchOptions& opt, const char* resultFile)
+{
+	double start = getPreciseTime();
+	initRandom(opt.seed);
+	if (!scene.parseScene(sceneFile)) return 1;
+	
+	GlobalSettings& settings = scene.settings;
+	settings.frameWidth = opt.width;
+	settings.frameHeight = opt.height;
+	settings.numThreads = opt.threads;
+	settings.interactive = false;
+	settings.wantPrepass = false;
+	settings.collectStats = false; // (the timed render runs the same code as a normal one)
+	settings.statsFile[0] = settings.statsHeatmap[0] = 0;
+	initHeadless(opt.width, opt.height);
+	
+	textureCache.setBudget(settings.textureCacheSize);
+	renderStats.enabled = false;
+	scene.beginRender();
+	
+	BenchResult result;
+	result.setupSeconds = getPreciseTime() - start;
+	double renderStart = getPreciseTime();
+	render();
+	result.renderSeconds = getPreciseTime() - renderStart;
+	result.totalSeconds = getPreciseTime() - start;
+	result.peakMB = getPeakMemoryMB();
+	
+	if (!opt.refsDir.empty()) {
+		string refFile = opt.refsDir + "/" + sceneName(sceneFile) + ".exr";
+		if (opt.updateRefs) {
+			Bitmap image;
+			image.generateEmptyImage(opt.width, opt.height);
+			for (int y = 0; y < opt.height; y++)
+				for (int x = 0; x < opt.width; x++)
+					image.setPixel(x, y, vfb[y][x]);
+			if (!image.saveImage(refFile.c_str()))
+				fprintf(stderr, "fray-bench: cannot save the reference image `%s'\n", refFile.c_str());
+		} else {
+			Bitmap ref;
+			if (ref.loadImage(refFile.c_str()))
+				result.rmse = compareWithVFB(ref);
+			else
+				fprintf(stderr, "fray-bench: no reference image `%s'\n", refFile.c_str());
+		}
+	}
+	
+	// the ray counters slow the rendering down, so the rays are counted in a second, untimed render of the same
+	// frame (with the random generators reset, so that it traces the same rays, at least with a single thread):
+	if (opt.countRays) {
+		initRandom(opt.seed);
+		renderStats.enabled = true;
+		render();
+		if (result.renderSeconds > 0)
+			result.mraysPerSec = renderStats.getTotalRays() / result.renderSeconds * 1e-6;
+	}
+	
+	FILE* f = fopen(resultFile, "wt");
+	if (!f) return 1;
+	fprintf(f, "%.6f %.6f %.6f %.6f %.3f %.6f\n", result.setupSeconds, result.renderSeconds, result.totalSeconds,
+		result.mraysPerSec, result.peakMB, result.rmse);
+	fclose(f);
+	return 0;
+}
+
+/// the file, where a child process writes its results. It's unique to this process, so that benchmarks running at
+/// the same time (in the same directory) don't read each other's results
+static string resultFileName()
+{
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = int(getpid());
+#endif
+	return "fray-bench-result." + to_string(pid) + ".tmp";
+}
+
+/// runs `self --run-one scene ...' in a child process, and reads its results
+static BenchResult runChild(const char* self, const string& sceneFile, const BenchOptions& opt)
+{
+	BenchResult result;
+	result.scene = sceneFile;
+	string resultFile = resultFileName();
+	remove(resultFile.c_str());
+	
+	string cmd = string("\"") + self + "\" --run-one \"" + sceneFile + "\"";
+	cmd += " --width " + to_string(opt.width) + " --height " + to_string(opt.height);
+	cmd += " --threads " + to_string(opt.threads) + " --seed " + to_string(opt.seed);
+	if (!opt.refsDir.empty()) cmd += " --refs \"" + opt.refsDir + "\"";
+	if (opt.updateRefs) cmd += " --update-refs";
+	if (!opt.countRays) cmd += " --no-ray-counts";
+	cmd += " --result \"" + resultFile + "\"";
+#ifdef _WIN32
+	cmd = "\"" + cmd + "\""; // cmd.exe strips the outer quotes
+#endif
+	
+	FILE* f = system(cmd.c_str()) == 0 ? fopen(resultFile.c_str(), "rt") : nullptr;
+	if (f) {
+		result.ok = 6 == fscanf(f, "%lf%lf%lf%lf%lf%lf", &result.setupSeconds, &result.renderSeconds,
+			&result.totalSeconds, &result.mraysPerSec, &result.peakMB, &result.rmse);
+		fclose(f);
+	}
+	remove(resultFile.c_str()); // (also if the child failed halfway)
+	return result;
+}
+
+static bool writeCSV(const char* filename, const vector<BenchResult>& results, const BenchOptions& opt)
+{
+	FILE* f = fopen(filename, "wt");
+	if (!f) return false;
+	fprintf(f, "scene,ok,width,height,threads,seed,setup_s,render_s,total_s,mrays_per_s,peak_mb,rmse\n");
+	for (auto& r: results)
+		fprintf(f, "%s,%d,%d,%d,%d,%u,%.4f,%.4f,%.4f,%.4f,%.1f,%.6f\n", r.scene.c_str(), int(r.ok),
+			opt.width, opt.height, opt.threads, opt.seed,
+			r.setupSeconds, r.renderSeconds, r.totalSeconds, r.mraysPerSec, r.peakMB, r.rmse);
+	fclose(f);
+	return true;
+}
+
+static bool writeJSON(const char* filename, const vector<BenchResult>& results, const BenchOptions& opt)
+{
+	FILE* f = fopen(filename, "wt");
+	if (!f) return false;
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"width\": %d,\n\t\"height\": %d,\n\t\"threads\": %d,\n\t\"seed\": %u,\n",
+		opt.width, opt.height, opt.threads, opt.seed);
+	fprintf(f, "\t\"scenes\": [");
+	for (int i = 0; i < int(results.size()); i++) {
+		const BenchResult& r = results[i];
+		fprintf(f, "%s\n\t\t{ \"scene\": \"%s\", \"ok\": %s, \"setupSeconds\": %.4f, \"renderSeconds\": %.4f, "
+			"\"totalSeconds\": %.4f, \"mraysPerSec\": %.4f, \"peakMB\": %.1f, \"rmse\": %.6f }",
+			i ? "," : "", r.scene.c_str(), r.ok ? "true" : "false", r.setupSeconds, r.renderSeconds,
+			r.totalSeconds, r.mraysPerSec, r.peakMB, r.rmse);
+	}
+	fprintf(f, "\n\t]\n}\n");
+	fclose(f);
+	return true;
+}
+
+/// reads scene file names from a text file (one per line; empty lines and lines, starting with '#', are skipped)
+static bool readSceneList(const char* filename, vector<string>& scenes)
+{
+	FILE* f = fopen(filename, "rt");
+	if (!f) return false;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		string s = line;
+		while (!s.empty() && isspace((unsigned char) s.back())) s.pop_back();
+		if (s.empty() || s[0] == '#') continue;
+		scenes.push_back(s);
+	}
+	fclose(f);
+	return true;
+}
+
+static void printUsage()
+{
+	fprintf(stderr,
+		"Usage: fray-bench [options] [scene.fray...]\n"
+		"Options:\n"
+		"  --width W, --height H   frame size (default 640x480)\n"
+		"  --threads N             render threads (default 1)\n"
+		"  --seed S                random seed (default 42)\n"
+		"  --list FILE             read the scenes from FILE, one per line\n"
+		"  --refs DIR              compare with the reference images DIR/<scene>.exr\n"
+		"  --update-refs           (re)create the reference images instead\n"
+		"  --no-ray-counts         skip the second render of each scene, which counts the rays (no Mrays/s)\n"
+		"  --csv FILE, --json FILE save the results\n"
+		"Without scenes, a default set of the bundled ones is used.\n");
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions opt;
+	const char* runOneScene = nullptr;
+	const char* resultFile = nullptr;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--width" && hasValue) opt.width = atoi(argv[++i]);
+		else if (arg == "--height" && hasValue) opt.height = atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue) opt.threads = atoi(argv[++i]);
+		else if (arg == "--seed" && hasValue) opt.seed = unsigned(atol(argv[++i]));
+		else if (arg == "--refs" && hasValue) opt.refsDir = argv[++i];
+		else if (arg == "--update-refs") opt.updateRefs = true;
+		else if (arg == "--no-ray-counts") opt.countRays = false;
+		else if (arg == "--csv" && hasValue) opt.csvFile = argv[++i];
+		else if (arg == "--json" && hasValue) opt.jsonFile = argv[++i];
+		else if (arg == "--run-one" && hasValue) runOneScene = argv[++i];
+		else if (arg == "--result" && hasValue) resultFile = argv[++i];
+		else if (arg == "--list" && hasValue) {
+			if (!readSceneList(argv[++i], opt.scenes)) {
+				fprintf(stderr, "fray-bench: cannot read the scene list `%s'\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (arg[0] != '-') opt.scenes.push_back(arg);
+		else {
+			printUsage();
+			return -1;
+		}
+	}
+	if (opt.width < 1 || opt.height < 1 || opt.width > VFB_MAX_SIZE || opt.height > VFB_MAX_SIZE || opt.threads < 1) {
+		fprintf(stderr, "fray-bench: invalid frame size or thread count\n");
+		return -1;
+	}
+	
+	if (runOneScene)
+		return runOne(runOneScene, opt, resultFile ? resultFile : resultFileName().c_str());
+	
+	if (opt.scenes.empty())
+		for (auto s: defaultScenes) opt.scenes.push_back(s);
+	
+	vector<BenchResult> results;
+	printf("%-28s %9s %9s %9s %9s %9s %9s\n", "scene", "setup(s)", "render(s)", "total(s)", "Mrays/s", "peak(MB)", "RMSE");
+	for (auto& sceneFile: opt.scenes) {
+		BenchResult r = runChild(argv[0], sceneFile, opt);
+		if (r.ok)
+			printf("%-28s %9.3f %9.3f %9.3f %9.3f %9.1f %9.5f\n", sceneName(sceneFile).c_str(), r.setupSeconds,
+				r.renderSeconds, r.totalSeconds, r.mraysPerSec, r.peakMB, r.rmse);
+		else
+			printf("%-28s    FAILED\n", sceneName(sceneFile).c_str());
+		fflush(stdout);
+		results.push_back(r);
+	}
+	
+	if (!opt.csvFile.empty() && !writeCSV(opt.csvFile.c_str(), results, opt))
+		fprintf(stderr, "fray-bench: cannot write `%s'\n", opt.csvFile.c_str());
+	if (!opt.jsonFile.empty() && !writeJSON(opt.jsonFile.c_str(), results, opt))
+		fprintf(stderr, "fray-bench: cannot write `%s'\n", opt.jsonFile.c_str());
+	
+	for (auto& r: results) if (!r.ok) return 1;
+	return 0;
+}
@@ -32,9 +32,29 @@
 #include <Iex.h>
 #include <vector>
 
+static int bytesPerPixel(PixelFormat format)
+{
+	switch (format) {
+		case PIXEL_RGB8: return 3;
+		case PIXEL_RGBA8: return 4;
+		case PIXEL_RGB16F: return 3 * sizeof(half);
+		default: return sizeof(Color);
+	}
+}
+
+/// 8-bit channel value -> float
+static struct ByteToFloat {
+	float table[256];
+	ByteToFloat()
+	{
+		for (int i = 0; i < 256; i++) table[i] = i / 255.0f;
+	}
+} byteToFloat;
+
 Bitmap::Bitmap()
 {
 	width = height = -1;
+	format = PIXEL_RGB32F;
 	data = NULL;
 }
 
@@ -54,26 +74,72 @@ int Bitmap::getWidth(void) const { return width; }
 int Bitmap::getHeight(void) const { return height; }
 bool Bitmap::isOK(void) const { return (data != NULL); }
 
-void Bitmap::generateEmptyImage(int w, int h)
+void Bitmap::generateEmptyImage(int w, int h, PixelFormat fmt)
 {
 	freeMem();
 	if (w <= 0 || h <= 0) return;
 	width = w;
 	height = h;
-	data = new Color[w * h];
-	memset(data, 0, sizeof(data[0]) * w * h);
+	format = fmt;
+	size_t size = size_t(w) * h * bytesPerPixel(fmt);
+	data = new unsigned char[size];
+	memset(data, 0, size);
 }
 
 Color Bitmap::getPixel(int x, int y) const
 {
 	if (!data || x < 0 || x >= width || y < 0 || y >= height) return Color(0.0f, 0.0f, 0.0f);
-	return data[x + y * width];
+	int idx = x + y * width;
+	switch (format) {
+		case PIXEL_RGB8:
+		{
+			const unsigned char* p = data + idx * 3;
+			return Color(byteToFloat.table[p[0]], byteToFloat.table[p[1]], byteToFloat.table[p[2]]);
+		}
+		case PIXEL_RGBA8:
+		{
+			const unsigned char* p = data + idx * 4;
+			return Color(byteToFloat.table[p[0]], byteToFloat.table[p[1]], byteToFloat.table[p[2]]);
+		}
+		case PIXEL_RGB16F:
+		{
+			const half* p = reinterpret_cast<const half*>(data) + idx * 3;
+			return Color(p[0], p[1], p[2]);
+		}
+		default:
+			return reinterpret_cast<const Color*>(data)[idx];
+	}
+}
+
+float Bitmap::getAlpha(int x, int y) const
+{
+	if (!data || x < 0 || x >= width || y < 0 || y >= height) return 0.0f;
+	if (format != PIXEL_RGBA8) return 1.0f;
+	return byteToFloat.table[data[(x + y * width) * 4 + 3]];
 }
 
 void Bitmap::setPixel(int x, int y, const Color& color)
 {
 	if (!data || x < 0 || x >= width || y < 0 || y >= height) return;
-	data[x + y * width] = color;
+	int idx = x + y * width;
+	switch (format) {
+		case PIXEL_RGB8:
+		case PIXEL_RGBA8:
+		{
+			unsigned char* p = data + idx * bytesPerPixel(format);
+			for (int i = 0; i < 3; i++) p[i] = (unsigned char) convertTo8bit(color[i]);
+			if (format == PIXEL_RGBA8) p[3] = 255;
+			break;
+		}
+		case PIXEL_RGB16F:
+		{
+			half* p = reinterpret_cast<half*>(data) + idx * 3;
+			for (int i = 0; i < 3; i++) p[i] = color[i];
+			break;
+		}
+		default:
+			reinterpret_cast<Color*>(data)[idx] = color;
+	}
 }
 
 class ImageOpenRAII {
@@ -121,7 +187,7 @@ bool Bitmap::loadBMP(const char* filename)
 	
 	BmpHeader hd;
 	BmpInfoHeader hi;
-	Color palette[256];
+	unsigned char palette[256][4];
 	int toread = 0;
 	unsigned char *xx;
 	int rowsz;
@@ -157,9 +223,7 @@ bool Bitmap::loadBMP(const char* filename)
 		toread = (1 << hi.bitsperpixel);
 		if (hi.colors) toread = hi.colors;
 		for (int i = 0; i < toread; i++) {
-			unsigned temp;
-			if (!fread(&temp, 1, 4, fp)) return false;
-			palette[i] = Color(temp);
+			if (!fread(palette[i], 1, 4, fp)) return false; // stored as BGRx
 		}
 	}
 	toread = hd.bfImgOffset - (54 + toread*4);
@@ -169,7 +233,9 @@ bool Bitmap::loadBMP(const char* filename)
 	if (rowsz % 4 != 0)
 		rowsz = (rowsz / 4 + 1) * 4; // round the row size to the next exact multiple of 4
 	xx = new unsigned char[rowsz];
-	generateEmptyImage(hi.x, hi.y);
+	// keep the 8-bit channels as they are; the alpha is only meaningful in 32-bit files:
+	generateEmptyImage(hi.x, hi.y, hi.bitsperpixel == 32 ? PIXEL_RGBA8 : PIXEL_RGB8);
+	int bpp = bytesPerPixel(format);
 	if (!isOK()) {
 		printf("loadBMP: cannot allocate memory for bitmap! Check file integrity!\n");
 		delete [] xx;
@@ -181,14 +247,24 @@ bool Bitmap::loadBMP(const char* filename)
 			delete [] xx;
 			return 0;
 		}
-		for (int i = 0; i < hi.x; i++){ // actually read the pixels
-			if (hi.bitsperpixel > 8)
-				setPixel(i, j, Color(xx[i*k+2]/255.0f, xx[i*k+1]/255.0f, xx[i*k]/255.0f));
-			else
-				setPixel(i, j,  palette[xx[i*k]]);
+		unsigned char* row = data + j * hi.x * bpp;
+		for (int i = 0; i < hi.x; i++){ // actually read the pixels (BGR(A) -> RGB(A))
+			const unsigned char* src = hi.bitsperpixel > 8 ? &xx[i*k] : palette[xx[i]];
+			unsigned char* dest = row + i * bpp;
+			dest[0] = src[2];
+			dest[1] = src[1];
+			dest[2] = src[0];
+			if (bpp == 4) dest[3] = src[3];
 		}
 	}
 	delete [] xx;
+	if (format == PIXEL_RGBA8) {
+		// most 32-bit BMPs leave the fourth byte unused (zero); treat these as opaque
+		bool hasAlpha = false;
+		for (int i = 0; i < width * height && !hasAlpha; i++) hasAlpha = data[i * 4 + 3] != 0;
+		if (!hasAlpha)
+			for (int i = 0; i < width * height; i++) data[i * 4 + 3] = 255;
+	}
 	
 	helper.imageIsOk = true;
 	return true;
@@ -237,6 +313,7 @@ bool Bitmap::saveBMP(const char* filename)
 
 bool Bitmap::loadEXR(const char* filename)
 {
+	freeMem();
 	try {
 		Imf::RgbaInputFile exr(filename);
 		Imf::Array2D<Imf::Rgba> pixels;
@@ -246,13 +323,16 @@ bool Bitmap::loadEXR(const char* filename)
 		pixels.resizeErase(height, width);
 		exr.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * width, 1, width);
 		exr.readPixels(dw.min.y, dw.max.y);
-		data = new Color[width * height];
+		// keep the halves; no need to expand to floats:
+		format = PIXEL_RGB16F;
+		data = new unsigned char[size_t(width) * height * bytesPerPixel(format)];
+		half* dest = reinterpret_cast<half*>(data);
 		for (int y = 0; y < height; y++)
 			for (int x = 0; x < width; x++) {
-				Color& pixel = data[y * width + x];
-				pixel.r = pixels[y + dw.min.y][x + dw.min.x].r;
-				pixel.g = pixels[y + dw.min.y][x + dw.min.x].g;
-				pixel.b = pixels[y + dw.min.y][x + dw.min.x].b;
+				const Imf::Rgba& pixel = pixels[y + dw.min.y][x + dw.min.x];
+				*dest++ = pixel.r;
+				*dest++ = pixel.g;
+				*dest++ = pixel.b;
 			}
 		return true;
 	}
@@ -268,12 +348,15 @@ bool Bitmap::saveEXR(const char* filename)
 	try {
 		Imf::RgbaOutputFile file(filename, width, height, Imf::WRITE_RGBA);
 		std::vector<Imf::Rgba> temp(width * height);
-		for (int i = 0; i < width * height; i++) {
-			temp[i].r = data[i].r;
-			temp[i].g = data[i].g;
-			temp[i].b = data[i].b;
-			temp[i].a = 1.0f;
-		}
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++) {
+				Imf::Rgba& pixel = temp[y * width + x];
+				Color c = getPixel(x, y);
+				pixel.r = c.r;
+				pixel.g = c.g;
+				pixel.b = c.b;
+				pixel.a = getAlpha(x, y);
+			}
 		file.setFrameBuffer(&temp[0], 1, width);
 		file.writePixels(height);
 	}
@@ -312,4 +395,5 @@ void Bitmap::differentiate()
 		}
 	}
 	std::swap(this->data, bumpTex.data);
+	std::swap(this->format, bumpTex.format);
 }
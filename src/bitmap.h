@@ -26,11 +26,22 @@
 
 #include "color.h"
 
+/// the formats, in which a Bitmap can store its pixels in memory
+enum PixelFormat {
+	PIXEL_RGB32F,  //!< three floats per pixel (rendered and generated images)
+	PIXEL_RGB8,    //!< 8 bits per channel (24-bit and palettized BMPs)
+	PIXEL_RGBA8,   //!< 8 bits per channel, plus alpha (32-bit BMPs)
+	PIXEL_RGB16F,  //!< three half-floats per pixel (EXR files)
+};
+
 /// @brief a class that represents a bitmap (2d array of colors), e.g. a image
 /// supports loading/saving to BMP
+///
+/// The pixels are kept in their native format (see PixelFormat); getPixel() always converts to Color.
 class Bitmap {
 	int width, height;
-	Color* data;
+	PixelFormat format;
+	unsigned char* data;
 public:
 	Bitmap(); //!< Generates an empty bitmap
 	virtual ~Bitmap();
@@ -38,9 +49,12 @@ public:
 	int getWidth(void) const; //!< Gets the width of the image (X-dimension)
 	int getHeight(void) const; //!< Gets the height of the image (Y-dimension)
 	bool isOK(void) const; //!< Returns true if the bitmap is valid
-	void generateEmptyImage(int width, int height); //!< Creates an empty image with the given dimensions
+	PixelFormat getFormat(void) const { return format; } //!< Gets the storage format of the pixels
+	/// Creates an empty image with the given dimensions and storage format
+	void generateEmptyImage(int width, int height, PixelFormat format = PIXEL_RGB32F);
 	Color getPixel(int x, int y) const; //!< Gets the pixel at coordinates (x, y). Returns black if (x, y) is outside of the image
-	void setPixel(int x, int y, const Color& col); //!< Sets the pixel at coordinates (x, y).
+	float getAlpha(int x, int y) const; //!< Gets the alpha at (x, y); 1 for formats without alpha
+	void setPixel(int x, int y, const Color& col); //!< Sets the pixel at coordinates (x, y). 8-bit formats clamp the color to [0..1]
 	
 	void differentiate(); //!< compute differential image, for bump mapping
 	
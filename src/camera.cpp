@@ -59,10 +59,16 @@ void Camera::beginFrame()
 Ray Camera::getScreenRay(double x, double y, WhichCamera whichCamera)
 {
 	Ray result;
-	result.dir = topLeft + (topRight - topLeft) * (x / w)
-	                     + (bottomLeft - topLeft) * (y / h);
-	result.dir.normalize();
+	Vector throughPixel = topLeft + (topRight - topLeft) * (x / w)
+	                              + (bottomLeft - topLeft) * (y / h);
+	result.dir = normalize(throughPixel);
 	result.start = this->pos;
+	// ray differentials, for texture filtering:
+	result.flags |= RF_DIFFERENTIALS;
+	result.dPdx.makeZero();
+	result.dPdy.makeZero();
+	result.dDdx = normalize(throughPixel + (topRight - topLeft) / w) - result.dir;
+	result.dDdy = normalize(throughPixel + (bottomLeft - topLeft) / h) - result.dir;
 	if (whichCamera != CAMERA_CENTER) {
 		if (whichCamera == CAMERA_LEFT)
 			result.start += rightDir * -stereoSeparation;
@@ -91,14 +97,29 @@ Ray Camera::getDOFRay(double x, double y, WhichCamera whichCamera)
 	return ray;
 }
 
+bool Camera::projectDir(const Vector& dir, double& x, double& y) const
+{
+	// the screen is at unit distance along frontDir; find where `dir' pierces it:
+	double z = dot(dir, frontDir);
+	if (z < 1e-9) return false;
+	Vector onScreen = dir / z - topLeft;
+	Vector dx = topRight - topLeft, dy = bottomLeft - topLeft;
+	x = w * dot(onScreen, dx) / dx.lengthSqr();
+	y = h * dot(onScreen, dy) / dy.lengthSqr();
+	return true;
+}
 
 void Camera::move(double rx, double ry)
 {
+	if (rx == 0 && ry == 0) return;
 	pos += rx * rightDir + ry * frontDir;
+	markChanged();
 }
 
 void Camera::rotate(double rx, double ry)
 {
+	if (rx == 0 && ry == 0) return;
+	markChanged();
 	yaw += rx;
 	pitch += ry;
 	pitch = min(pitch, +90.0);
@@ -51,6 +51,8 @@ public:
 	bool autofocus = true;
 	int numDOFSamples = 32;
 	double stereoSeparation = 0;
+	double shutter = 0;          //!< motion blur: how long the shutter is open, in frames (0 = no motion blur)
+	int numMotionSamples = 16;   //!< motion blur: rays per pixel
 	Color leftMask = Color(1, 0, 0), rightMask = Color(0, 1, 1);
 	
 	void fillProperties(ParsedBlock& pb)
@@ -68,6 +70,8 @@ public:
 		pb.getDoubleProp("focalPlaneDist", &focalPlaneDist, 0.1);
 		pb.getBoolProp("autofocus", &autofocus);
 		pb.getDoubleProp("stereoSeparation", &stereoSeparation, 0.0);
+		pb.getDoubleProp("shutter", &shutter, 0.0);
+		pb.getIntProp("motionSamples", &numMotionSamples, 1);
 		pb.getColorProp("leftMask", &leftMask);
 		pb.getColorProp("rightMask", &rightMask);
 		
@@ -81,6 +85,12 @@ public:
 	Ray getScreenRay(double x, double y, WhichCamera whichCamera = CAMERA_CENTER);
 	Ray getDOFRay(double x, double y, WhichCamera whichCamera = CAMERA_CENTER);
 	
+	/// the inverse of getScreenRay(): finds the (fractional) screen coordinates, where the point p is seen.
+	/// @returns false if p is behind the camera
+	bool project(const Vector& p, double& x, double& y) const { return projectDir(p - pos, x, y); }
+	/// same as project(), but for a point at infinity, in the given direction
+	bool projectDir(const Vector& dir, double& x, double& y) const;
+	
 	void move(double rx, double ry);
 	void rotate(double rx, double ry);
 };
@@ -0,0 +1,223 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File checkpoint.cpp
+ * @Brief Saving the progress of a long render to a file, so that it can be resumed after a crash
+ */
+#include <stdio.h>
+#include <string.h>
+#include <SDL/SDL.h>
+#include "scene.h"
+#include "render.h"
+#include "random_generator.h"
+#include "checkpoint.h"
+using namespace std;
+
+Checkpoint checkpoint;
+
+static const char CHECKPOINT_MAGIC[8] = { 'F', 'R', 'A', 'Y', 'C', 'K', 'P', '1' };
+
+/// the start of a checkpoint file. Then follow numBuckets bytes (1 = the bucket is finished), and the pixels of the
+/// finished buckets, in order, as RGB floats. It's in the machine's byte order, so it's only for resuming on the
+/// same kind of machine
+struct CheckpointHeader {
+	char magic[8];
+	uint64_t sceneHash;       //!< see Scene::getContentsHash()
+	int32_t width, height;
+	int32_t numBuckets;
+	int32_t samplesPerPixel;  //!< of each finished pixel
+	uint32_t randomSeed;      //!< see initRandom()
+	int32_t reserved;
+};
+
+void Checkpoint::enable(const char* filename, double interval, bool resume)
+{
+	strncpy(this->filename, filename, sizeof(this->filename) - 1);
+	this->interval = interval;
+	this->resume = resume;
+}
+
+void Checkpoint::begin(const vector<Rect>& buckets, int samplesPerPixel)
+{
+	this->buckets = buckets;
+	this->samplesPerPixel = samplesPerPixel;
+	sceneHash = scene.getContentsHash();
+	randomSeed = getRandomSeed();
+	done.assign(buckets.size(), false);
+	numDone = numSaved = 0;
+	if (resume) {
+		resume = false; // (only the first render continues; e.g. one after a reload starts anew)
+		if (load())
+			printf("Resuming from `%s': %d of %d buckets are done\n", filename, numDone, int(buckets.size()));
+	}
+	quit = false;
+	wakeMutex = SDL_CreateMutex();
+	wakeCond = SDL_CreateCond();
+	thread = SDL_CreateThread(threadProc, this);
+	if (!thread)
+		fprintf(stderr, "Cannot start the checkpoint thread; the progress will only be saved at the end\n");
+}
+
+bool Checkpoint::isDone(int bucketIdx)
+{
+	mutex.enter();
+	bool result = done[bucketIdx];
+	mutex.leave();
+	return result;
+}
+
+void Checkpoint::markDone(int bucketIdx)
+{
+	mutex.enter();
+	done[bucketIdx] = true;
+	numDone++;
+	mutex.leave();
+}
+
+void Checkpoint::end()
+{
+	if (thread) {
+		SDL_mutexP(wakeMutex);
+		quit = true;
+		SDL_CondSignal(wakeCond);
+		SDL_mutexV(wakeMutex);
+		SDL_WaitThread(thread, NULL);
+		thread = nullptr;
+	}
+	SDL_DestroyCond(wakeCond);
+	SDL_DestroyMutex(wakeMutex);
+	save();
+}
+
+int Checkpoint::threadProc(void* checkpoint)
+{
+	Checkpoint& cp = *(Checkpoint*) checkpoint;
+	SDL_mutexP(cp.wakeMutex);
+	while (!cp.quit) {
+		if (SDL_CondWaitTimeout(cp.wakeCond, cp.wakeMutex, Uint32(cp.interval * 1000)) == SDL_MUTEX_TIMEDOUT) {
+			SDL_mutexV(cp.wakeMutex);
+			cp.save();
+			SDL_mutexP(cp.wakeMutex);
+		}
+	}
+	SDL_mutexV(cp.wakeMutex);
+	return 0;
+}
+
+/// writes the finished buckets, if there are new ones. Only called by one thread at a time (the saving one, or end())
+bool Checkpoint::save()
+{
+	// the finished buckets' pixels don't change anymore, so only the flags need the lock:
+	mutex.enter();
+	vector<bool> finished = done;
+	int count = numDone;
+	mutex.leave();
+	if (count == numSaved) return true;
+	
+	// write a temporary file and rename it, so that a crash while writing doesn't lose the previous checkpoint:
+	string tempName = string(filename) + ".tmp";
+	FILE* f = fopen(tempName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Cannot write the checkpoint `%s'\n", tempName.c_str());
+		return false;
+	}
+	CheckpointHeader header;
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.sceneHash = sceneHash;
+	header.width = frameWidth();
+	header.height = frameHeight();
+	header.numBuckets = int(buckets.size());
+	header.samplesPerPixel = samplesPerPixel;
+	header.randomSeed = randomSeed;
+	header.reserved = 0;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	vector<char> flags(finished.begin(), finished.end());
+	if (!flags.empty()) ok = ok && fwrite(&flags[0], flags.size(), 1, f) == 1;
+	vector<float> row;
+	for (int i = 0; ok && i < int(buckets.size()); i++) {
+		if (!finished[i]) continue;
+		const Rect& r = buckets[i];
+		row.resize(r.w * 3);
+		for (int y = r.y0; ok && y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++)
+				for (int c = 0; c < 3; c++)
+					row[(x - r.x0) * 3 + c] = vfb[y][x][c];
+			ok = fwrite(&row[0], sizeof(float), row.size(), f) == row.size();
+		}
+	}
+	if (fclose(f) != 0) ok = false;
+#ifdef _WIN32
+	if (ok) remove(filename); // (rename() doesn't replace files there)
+#endif
+	if (!ok || rename(tempName.c_str(), filename) != 0) {
+		fprintf(stderr, "Cannot write the checkpoint `%s'\n", filename);
+		remove(tempName.c_str());
+		return false;
+	}
+	numSaved = count;
+	return true;
+}
+
+/// reads the finished buckets into vfb, if the file is a checkpoint of the current render
+bool Checkpoint::load()
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Cannot open the checkpoint `%s'; starting anew\n", filename);
+		return false;
+	}
+	CheckpointHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))) {
+		fprintf(stderr, "`%s' is not a checkpoint; starting anew\n", filename);
+		fclose(f);
+		return false;
+	}
+	if (header.sceneHash != sceneHash || header.width != frameWidth() || header.height != frameHeight() ||
+		header.numBuckets != int(buckets.size()) || header.samplesPerPixel != samplesPerPixel ||
+		header.randomSeed != randomSeed) {
+		fprintf(stderr, "The checkpoint `%s' is of a different scene or settings; starting anew\n", filename);
+		fclose(f);
+		return false;
+	}
+	vector<char> flags(buckets.size());
+	bool ok = flags.empty() || fread(&flags[0], flags.size(), 1, f) == 1;
+	vector<float> row;
+	for (int i = 0; ok && i < int(buckets.size()); i++) {
+		if (!flags[i]) continue;
+		const Rect& r = buckets[i];
+		row.resize(r.w * 3);
+		for (int y = r.y0; ok && y < r.y1; y++) {
+			ok = fread(&row[0], sizeof(float), row.size(), f) == row.size();
+			for (int x = r.x0; ok && x < r.x1; x++)
+				for (int c = 0; c < 3; c++)
+					vfb[y][x][c] = row[(x - r.x0) * 3 + c];
+		}
+		if (ok) {
+			done[i] = true;
+			numDone++;
+		}
+	}
+	fclose(f);
+	if (!ok)
+		fprintf(stderr, "The checkpoint `%s' is truncated; continuing with the buckets read so far\n", filename);
+	numSaved = ok ? numDone : -1; // (rewrite it whole, if it was truncated)
+	return true;
+}
@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File checkpoint.h
+ * @Brief Saving the progress of a long render to a file, so that it can be resumed after a crash
+ */
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <SDL/SDL_thread.h>
+#include <SDL/SDL_mutex.h>
+#include "cxxptl-sdl.h"
+#include "sdl.h"
+
+/**
+ * @brief periodically saves the finished buckets of a render, and restores them when the render is resumed
+ *
+ * The progress is kept per bucket: the random generators are seeded anew for each one (see render.cpp), so a bucket
+ * comes out the same, regardless of which thread renders it, and when. The file thus only needs the pixels of the
+ * finished buckets (with their count of samples per pixel in the header), and a resumed render ends up the same as
+ * an uninterrupted one.
+ *
+ * The saving is done by a thread of its own, which wakes up every settings.checkpointInterval seconds; the render
+ * threads only mark their buckets as done.
+ */
+class Checkpoint {
+	char filename[256] = "";
+	bool resume = false;
+	double interval = 60;
+	
+	// the current render:
+	uint64_t sceneHash = 0;
+	int samplesPerPixel = 0;
+	unsigned randomSeed = 0; //!< the buckets' pixels depend on it (see bucketSeed() in render.cpp)
+	std::vector<Rect> buckets;
+	std::vector<bool> done;
+	int numDone = 0, numSaved = 0; //!< finished buckets, and how many of them are in the file
+	
+	Mutex mutex; //!< guards the above, after begin()
+	
+	// the saving thread, and how to wake it up, when the render ends:
+	SDL_Thread* thread = nullptr;
+	SDL_mutex* wakeMutex = nullptr;
+	SDL_cond* wakeCond = nullptr;
+	bool quit = false;
+	
+	bool load();
+	bool save();
+	static int threadProc(void* checkpoint);
+public:
+	/// checkpoints the following non-interactive renders to the given file. If resume is set, the first one continues
+	/// from the progress in the file (if it's for the same scene)
+	void enable(const char* filename, double interval, bool resume);
+	bool isEnabled() const { return filename[0] != 0; }
+	
+	/// starts checkpointing a render of the given buckets. When resuming, the finished ones are loaded into vfb
+	void begin(const std::vector<Rect>& buckets, int samplesPerPixel);
+	/// was the bucket finished (and loaded into vfb) before the render was resumed?
+	bool isDone(int bucketIdx);
+	/// called by the render threads, after the pixels of a bucket are in vfb
+	void markDone(int bucketIdx);
+	/// stops the saving thread, and saves the final progress (also if the render was interrupted)
+	void end();
+};
+
+extern Checkpoint checkpoint;
@@ -35,8 +35,22 @@
 
 #define LOW_GLOSSY_SAMPLES 3
 
+#define MAX_ANISOTROPY 8 // maximum eccentricity of the texture footprint, used in anisotropic texture filtering
+
 #define MAX_TRIANGLES_PER_LEAF 20
 #define MAX_DEPTH 64
+#define KD_TRAVERSAL_COST 2.0 // SAH cost of visiting a KD tree node (two child box tests)...
+#define KD_INTERSECT_COST 1.5 // ... relative to the cost of a ray-triangle test
+#define KD_EMPTY_BONUS 0.2    // how much cheaper is a split, which cuts off empty space
+
+#define MAX_SPANS 16 // max number of spans of a ray through a CSG operand (see SpanList)
+
+#define MAX_INCLUDE_DEPTH 16 // max nesting of Include/Reference files in a scene
+
+#define MOTION_BLUR_STEPS 8 // transforms of a moving Node per shutter interval; it's interpolated linearly between them
+
+#define MAX_BUCKET_COPIES 2 // distributed rendering: at most this many workers render the same bucket at a time
+#define WORKER_SEND_TIMEOUT 5.0 // distributed rendering: a worker, which can't take a message for so many seconds, is dropped
 
 // large `float' number:
 #define LARGE_FLOAT 1e17f
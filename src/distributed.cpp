@@ -0,0 +1,530 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File distributed.cpp
+ * @Brief Implements the coordinator and the workers of a distributed render
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <winsock2.h>
+#	include <ws2tcpip.h>
+#else
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <signal.h>
+#	include <unistd.h>
+#	include <netdb.h>
+#	include <poll.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#	include <netinet/in.h>
+#	include <netinet/tcp.h>
+#endif
+#include "distributed.h"
+#include "constants.h"
+#include "scene.h"
+#include "sdl.h"
+#include "render.h"
+#include "util.h"
+using namespace std;
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+#	define closeSocket closesocket
+#	define poll WSAPoll
+#else
+typedef int Socket;
+#	define INVALID_SOCKET (-1)
+#	define closeSocket close
+#endif
+
+enum MessageType {
+	MSG_HELLO = 1, //!< worker -> coordinator, after connecting
+	MSG_REJECTED,  //!< coordinator -> worker: the worker's scene (or frame size) is different
+	MSG_BUCKET,    //!< coordinator -> worker: render this bucket
+	MSG_PIXELS,    //!< worker -> coordinator: the rendered bucket. It's followed by the pixels (w * h Colors, by rows)
+	MSG_DONE,      //!< coordinator -> worker: there's no more work
+};
+
+/// a message between the coordinator and a worker. It's sent as it is, so the machines should have the same byte order
+struct Message {
+	uint64_t sceneHash;     //!< MSG_HELLO: identifies the worker's scene (see Scene::getContentsHash())
+	int32_t type;           //!< a MessageType
+	int32_t frame;          //!< the animation frame (see Scene::setFrame())
+	int32_t bucket;         //!< the index of the bucket in getBucketsList()
+	int32_t x0, y0, x1, y1; //!< the bucket (MSG_HELLO: x1 and y1 are the worker's frame size)
+	int32_t reserved;
+};
+
+/// a worker, as the coordinator sees it
+struct RemoteWorker {
+	Socket socket;
+	bool greeted = false; //!< it sent a valid MSG_HELLO
+	bool failed = false;  //!< disconnected, or sent something unexpected
+	int bucket = -1;      //!< the bucket it renders (-1 = none)
+	int frame = -1;       //!< ... and its frame
+	std::vector<char> received; //!< the part of its current message (and the pixels after it), which has arrived
+};
+
+static bool initSockets()
+{
+#ifdef _WIN32
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+	signal(SIGPIPE, SIG_IGN); // (a peer, which disconnects, is detected by the failing send())
+	return true;
+#endif
+}
+
+/// sends all of `data' on a blocking socket (the worker's side)
+static bool sendAll(Socket s, const void* data, size_t size)
+{
+	const char* p = (const char*) data;
+	while (size > 0) {
+		int sent = (int) send(s, p, (int) min(size, (size_t) 1 << 20), 0);
+		if (sent <= 0) return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool recvAll(Socket s, void* data, size_t size)
+{
+	char* p = (char*) data;
+	while (size > 0) {
+		int received = (int) recv(s, p, (int) min(size, (size_t) 1 << 20), 0);
+		if (received <= 0) return false;
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+/// makes recv() return what has arrived so far, instead of waiting for the rest
+static bool setNonBlocking(Socket s)
+{
+#ifdef _WIN32
+	u_long one = 1;
+	return ioctlsocket(s, FIONBIO, &one) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+static bool wouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/**
+ * sends a message to a worker (on a non-blocking socket). If the worker's send buffer is full, it waits for it to
+ * drain, up to WORKER_SEND_TIMEOUT seconds. @returns false if the worker disconnected, or didn't take the message
+ */
+static bool sendToWorker(RemoteWorker& worker, const void* data, size_t size)
+{
+	const char* p = (const char*) data;
+	double deadline = getPreciseTime() + WORKER_SEND_TIMEOUT;
+	while (size > 0) {
+		int sent = (int) send(worker.socket, p, (int) min(size, (size_t) 1 << 20), 0);
+		if (sent < 0 && wouldBlock()) {
+			double timeLeft = deadline - getPreciseTime();
+			if (timeLeft <= 0) return false;
+			pollfd fd;
+			fd.fd = worker.socket;
+			fd.events = POLLOUT;
+			fd.revents = 0;
+			poll(&fd, 1, int(timeLeft * 1000) + 1);
+			continue;
+		}
+		if (sent <= 0) return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+/**
+ * reads (from a non-blocking socket) what has arrived of a worker's message, until there are `size' bytes in
+ * worker.received. A worker, which stalls in the middle of a message, doesn't hold up the others this way.
+ * @returns false if it disconnected
+ */
+static bool receiveFrom(RemoteWorker& worker, size_t size)
+{
+	size_t have = worker.received.size();
+	worker.received.resize(max(size, have));
+	while (have < size) {
+		int received = (int) recv(worker.socket, &worker.received[have], (int) min(size - have, (size_t) 1 << 20), 0);
+		if (received < 0 && wouldBlock()) break;
+		if (received <= 0) return false;
+		have += received;
+	}
+	worker.received.resize(have);
+	return true;
+}
+
+static bool isLocalAddress(const char* address)
+{
+	return !strncmp(address, "unix:", 5);
+}
+
+/// splits "host:port" into its parts. If there's no host, it's `defaultHost'
+static void splitAddress(const char* address, const char* defaultHost, string& host, string& port)
+{
+	const char* colon = strrchr(address, ':');
+	if (colon) {
+		host.assign(address, colon);
+		port = colon + 1;
+	} else {
+		host = defaultHost;
+		port = address;
+	}
+}
+
+/// creates a socket, which is bound to a local address ("unix:/path"). @returns INVALID_SOCKET on error
+static Socket localSocket(const char* address, bool listening)
+{
+#ifdef _WIN32
+	fprintf(stderr, "Local (unix:) sockets aren't supported on Windows; use a TCP port\n");
+	return INVALID_SOCKET;
+#else
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	const char* path = address + 5;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "The socket path `%s' is too long\n", path);
+		return INVALID_SOCKET;
+	}
+	strcpy(addr.sun_path, path);
+	Socket s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) return s;
+	if (listening) unlink(path); // (left by a previous coordinator, which crashed)
+	bool ok = listening ? (!bind(s, (sockaddr*) &addr, sizeof(addr)) && !listen(s, 16))
+	                    : !connect(s, (sockaddr*) &addr, sizeof(addr));
+	if (!ok) {
+		closeSocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+#endif
+}
+
+/// creates a TCP socket, which listens on (or is connected to) the given address. @returns INVALID_SOCKET on error
+static Socket tcpSocket(const char* address, bool listening)
+{
+	string host, port;
+	splitAddress(address, listening ? "" : "localhost", host, port);
+	addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (listening) hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result)) return INVALID_SOCKET;
+	Socket s = INVALID_SOCKET;
+	for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s == INVALID_SOCKET) continue;
+		int one = 1;
+		bool ok;
+		if (listening) {
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*) &one, sizeof(one));
+			ok = !bind(s, ai->ai_addr, (int) ai->ai_addrlen) && !listen(s, 16);
+		} else {
+			ok = !connect(s, ai->ai_addr, (int) ai->ai_addrlen);
+			// (the messages are small, and each one is waited for)
+			if (ok) setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof(one));
+		}
+		if (ok) break;
+		closeSocket(s);
+		s = INVALID_SOCKET;
+	}
+	freeaddrinfo(result);
+	return s;
+}
+
+/// accepts a new worker. It's only given work after its MSG_HELLO
+static void acceptWorker(Socket listener, vector<RemoteWorker>& workers, bool tcp)
+{
+	RemoteWorker worker;
+	worker.socket = accept(listener, NULL, NULL);
+	if (worker.socket == INVALID_SOCKET) return;
+	if (!setNonBlocking(worker.socket)) {
+		closeSocket(worker.socket);
+		return;
+	}
+	if (tcp) {
+		int one = 1;
+		setsockopt(worker.socket, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof(one));
+	}
+	workers.push_back(worker);
+}
+
+/// checks the first message of a worker. @returns false if it can't render the same frames as the coordinator
+static bool greetWorker(RemoteWorker& worker, const Message& hello)
+{
+	if (hello.type != MSG_HELLO) return false;
+	if (hello.x1 != frameWidth() || hello.y1 != frameHeight() || hello.sceneHash != scene.getContentsHash()) {
+		fprintf(stderr, "Rejected a worker: its scene (or frame size) is different\n");
+		Message reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.type = MSG_REJECTED;
+		sendToWorker(worker, &reply, sizeof(reply));
+		return false;
+	}
+	worker.greeted = true;
+	printf("A worker connected\n");
+	return true;
+}
+
+/// hands out the buckets of a frame, and puts the results in the vfb. @returns false if the user quits
+static bool coordinateFrame(Socket listener, bool tcp, vector<RemoteWorker>& workers, int frame)
+{
+	vector<Rect> buckets = getBucketsList();
+	int numBuckets = (int) buckets.size();
+	deque<int> pending; //!< the buckets, which no worker renders
+	for (int i = 0; i < numBuckets; i++) pending.push_back(i);
+	vector<int> copies(numBuckets, 0);        // how many workers render each bucket
+	vector<double> handedOut(numBuckets, 0);  // when it was (last) given to a worker, which had no copy of it
+	vector<bool> done(numBuckets, false);
+	int numDone = 0;
+	vector<Color> pixels;
+	while (numDone < numBuckets) {
+		handlePendingEvents();
+		if (wantToQuit) return false;
+		for (auto& worker: workers) {
+			if (!worker.greeted || worker.failed || worker.bucket >= 0) continue;
+			int bucket = -1;
+			if (!pending.empty()) {
+				bucket = pending.front();
+				pending.pop_front();
+			} else {
+				// all are handed out; help with the one, which is in progress for the longest time:
+				for (int i = 0; i < numBuckets; i++)
+					if (!done[i] && copies[i] > 0 && copies[i] < MAX_BUCKET_COPIES &&
+					    (bucket < 0 || handedOut[i] < handedOut[bucket]))
+						bucket = i;
+				if (bucket < 0) break;
+			}
+			const Rect& r = buckets[bucket];
+			Message msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.type = MSG_BUCKET;
+			msg.frame = frame;
+			msg.bucket = bucket;
+			msg.x0 = r.x0;
+			msg.y0 = r.y0;
+			msg.x1 = r.x1;
+			msg.y1 = r.y1;
+			if (!sendToWorker(worker, &msg, sizeof(msg))) {
+				worker.failed = true;
+				if (copies[bucket] == 0) pending.push_front(bucket);
+				continue;
+			}
+			if (copies[bucket]++ == 0) handedOut[bucket] = getPreciseTime();
+			worker.bucket = bucket;
+			worker.frame = frame;
+			markRegion(r);
+		}
+		
+		// wait for results, or for new workers:
+		int numWorkers = (int) workers.size();
+		vector<pollfd> fds(numWorkers + 1);
+		for (int i = 0; i <= numWorkers; i++) {
+			fds[i].fd = i ? workers[i - 1].socket : listener;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (poll(fds.data(), (unsigned) fds.size(), 100) <= 0) continue;
+		for (int i = 0; i < numWorkers; i++) {
+			RemoteWorker& worker = workers[i];
+			if (!fds[i + 1].revents || worker.failed) continue;
+			Message msg;
+			if (!receiveFrom(worker, sizeof(msg))) {
+				worker.failed = true;
+				continue;
+			}
+			if (worker.received.size() < sizeof(msg)) continue; // (the rest arrives later)
+			memcpy(&msg, worker.received.data(), sizeof(msg));
+			if (!worker.greeted) {
+				worker.received.clear();
+				if (!greetWorker(worker, msg)) worker.failed = true;
+			} else if (msg.type != MSG_PIXELS || msg.bucket != worker.bucket || msg.frame != worker.frame) {
+				worker.failed = true;
+			} else {
+				const Rect& r = buckets[msg.bucket];
+				size_t size = sizeof(msg) + r.w * r.h * sizeof(Color);
+				if (!receiveFrom(worker, size)) {
+					worker.failed = true;
+					continue;
+				}
+				if (worker.received.size() < size) continue;
+				pixels.resize(r.w * r.h);
+				memcpy(pixels.data(), worker.received.data() + sizeof(msg), pixels.size() * sizeof(Color));
+				worker.received.clear();
+				worker.bucket = -1;
+				if (msg.frame != frame) continue; // (from a previous frame, which another worker has finished)
+				copies[msg.bucket]--;
+				if (done[msg.bucket]) continue; // (another worker was faster)
+				for (int y = 0; y < r.h; y++)
+					memcpy(&vfb[r.y0 + y][r.x0], &pixels[y * r.w], r.w * sizeof(Color));
+				done[msg.bucket] = true;
+				numDone++;
+				displayVFBRect(r, vfb);
+			}
+		}
+		if (fds[0].revents & POLLIN) acceptWorker(listener, workers, tcp);
+		
+		// the buckets of the disconnected workers go back to the pending ones:
+		for (int i = 0; i < (int) workers.size(); i++) {
+			RemoteWorker& worker = workers[i];
+			if (!worker.failed) continue;
+			if (worker.bucket >= 0 && worker.frame == frame && --copies[worker.bucket] == 0 && !done[worker.bucket])
+				pending.push_front(worker.bucket);
+			if (worker.greeted) fprintf(stderr, "A worker disconnected\n");
+			closeSocket(worker.socket);
+			workers.erase(workers.begin() + i);
+			i--;
+		}
+	}
+	return true;
+}
+
+bool renderCoordinator(const char* address)
+{
+	bool tcp = !isLocalAddress(address);
+	if (!initSockets()) return false;
+	Socket listener = tcp ? tcpSocket(address, true) : localSocket(address, true);
+	if (listener == INVALID_SOCKET) {
+		fprintf(stderr, "Cannot listen for workers on `%s'\n", address);
+		return false;
+	}
+	printf("Waiting for workers on `%s'...\n", address);
+	const GlobalSettings& settings = scene.settings;
+	int lastFrame = max(settings.animationStart, settings.animationEnd);
+	vector<RemoteWorker> workers;
+	bool ok = true;
+	for (int frame = settings.animationStart; ok && frame <= lastFrame; frame++) {
+		char caption[64];
+		snprintf(caption, sizeof(caption), "fray: rendering frame %d...", frame);
+		setWindowCaption(caption);
+		double start = getPreciseTime();
+		ok = coordinateFrame(listener, tcp, workers, frame);
+		if (!ok) break;
+		printf("Frame %d took %.2fs (%d workers)\n", frame, getPreciseTime() - start, (int) workers.size());
+		displayVFB(vfb);
+		char filename[sizeof(settings.outputFile) + 16];
+		snprintf(filename, sizeof(filename), settings.outputFile, frame);
+		ok = takeScreenshot(filename);
+	}
+	Message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_DONE;
+	for (auto& worker: workers) {
+		if (worker.greeted) sendToWorker(worker, &msg, sizeof(msg));
+		closeSocket(worker.socket);
+	}
+	closeSocket(listener);
+#ifndef _WIN32
+	if (!tcp) unlink(address + 5);
+#endif
+	return ok;
+}
+
+/// splits a bucket into smaller ones, for all the threads of a worker
+static vector<Rect> splitBucket(const Rect& r)
+{
+	const int SIZE = 16;
+	vector<Rect> result;
+	for (int y = r.y0; y < r.y1; y += SIZE)
+		for (int x = r.x0; x < r.x1; x += SIZE)
+			result.push_back(Rect(x, y, min(x + SIZE, r.x1), min(y + SIZE, r.y1)));
+	return result;
+}
+
+bool renderWorker(const char* address)
+{
+	if (!initSockets()) return false;
+	Socket s = isLocalAddress(address) ? localSocket(address, false) : tcpSocket(address, false);
+	if (s == INVALID_SOCKET) {
+		fprintf(stderr, "Cannot connect to the coordinator at `%s'\n", address);
+		return false;
+	}
+	Message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_HELLO;
+	msg.x1 = frameWidth();
+	msg.y1 = frameHeight();
+	msg.sceneHash = scene.getContentsHash();
+	bool ok = sendAll(s, &msg, sizeof(msg));
+	int frame = -1, numRendered = 0;
+	double renderTime = 0;
+	vector<Color> pixels;
+	while (ok) {
+		if (!recvAll(s, &msg, sizeof(msg))) {
+			fprintf(stderr, "Lost the connection to the coordinator\n");
+			ok = false;
+			break;
+		}
+		if (msg.type == MSG_DONE) break;
+		if (msg.type == MSG_REJECTED) {
+			fprintf(stderr, "The coordinator renders a different scene (or frame size)\n");
+			ok = false;
+			break;
+		}
+		Rect r(msg.x0, msg.y0, msg.x1, msg.y1);
+		if (msg.type != MSG_BUCKET || r.x0 < 0 || r.y0 < 0 || r.x1 > frameWidth() || r.y1 > frameHeight() ||
+		    r.w <= 0 || r.h <= 0) {
+			fprintf(stderr, "Unexpected message from the coordinator\n");
+			ok = false;
+			break;
+		}
+		if (msg.frame != frame) {
+			scene.setFrame(msg.frame);
+			frame = msg.frame;
+		}
+		double start = getPreciseTime();
+		renderBuckets(splitBucket(r));
+		renderTime += getPreciseTime() - start;
+		numRendered++;
+		pixels.resize(r.w * r.h);
+		for (int y = 0; y < r.h; y++)
+			memcpy(&pixels[y * r.w], &vfb[r.y0 + y][r.x0], r.w * sizeof(Color));
+		msg.type = MSG_PIXELS;
+		ok = sendAll(s, &msg, sizeof(msg)) && sendAll(s, pixels.data(), pixels.size() * sizeof(Color));
+	}
+	printf("Rendered %d buckets in %.2fs\n", numRendered, renderTime);
+	closeSocket(s);
+	return ok;
+}
@@ -0,0 +1,42 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File distributed.h
+ * @Brief Rendering a frame with several processes (possibly on different machines)
+ */
+#pragma once
+
+/**
+ * @brief renders the frames of the scene by handing their buckets to worker processes (see renderWorker())
+ *
+ * The address is a TCP port to listen on ("7311", or "host:7311" for a single interface), or "unix:/path" for a
+ * local socket (not on Windows). Workers may connect at any time. If one disconnects, its bucket goes to another
+ * one; when all buckets are handed out, idle workers get copies of the ones still in progress (the first result
+ * wins), so a slow worker doesn't hold up the frame. Each frame (animationStart..animationEnd, or a single one) is
+ * saved to settings.outputFile.
+ * The scene should be parsed, and scene.beginRender() called. @returns false on an error, or if the user quits
+ */
+bool renderCoordinator(const char* address);
+
+/// connects to a coordinator ("host:port", "port" for localhost, or "unix:/path") and renders the buckets it sends,
+/// until it says that it's done. The scene should be the same as the coordinator's (it's checked), parsed, and
+/// scene.beginRender() should've been called. @returns false on an error
+bool renderWorker(const char* address);
@@ -27,6 +27,71 @@
 #include "vector.h"
 #include "bitmap.h"
 #include "util.h"
+#include "random_generator.h"
+#include "shading.h"
+#include <vector>
+using namespace std;
+
+/// Adds a small fraction of the average to all sampling weights. As the environment lookups are interpolated,
+/// a black texel next to a bright one isn't entirely black, so it must have some chance of being sampled.
+static void addWeightFloor(vector<float>& weights, double averageWeight)
+{
+	float floor = float(averageWeight * 1e-3);
+	for (auto& w: weights) w += floor;
+}
+
+// the first 9 real spherical harmonics (bands 0, 1 and 2), at the unit direction d:
+static void evalSH(const Vector& d, double Y[9])
+{
+	Y[0] = 0.282095;
+	Y[1] = 0.488603 * d.y;
+	Y[2] = 0.488603 * d.z;
+	Y[3] = 0.488603 * d.x;
+	Y[4] = 1.092548 * d.x * d.y;
+	Y[5] = 1.092548 * d.y * d.z;
+	Y[6] = 0.315392 * (3 * d.z * d.z - 1);
+	Y[7] = 1.092548 * d.x * d.z;
+	Y[8] = 0.546274 * (d.x * d.x - d.y * d.y);
+}
+
+void Environment::beginRender()
+{
+	if (wantIrradiance) projectIrradiance();
+}
+
+void Environment::projectIrradiance()
+{
+	// integrate L(w) * Y(w) over the sphere, on a latitude-longitude grid:
+	const int THETA_STEPS = 64, PHI_STEPS = 128;
+	const double dTheta = PI / THETA_STEPS, dPhi = 2 * PI / PHI_STEPS;
+	for (auto& c: irradianceSH) c.makeZero();
+	for (int i = 0; i < THETA_STEPS; i++) {
+		double theta = (i + 0.5) * dTheta;
+		float dw = float(sin(theta) * dTheta * dPhi);
+		for (int j = 0; j < PHI_STEPS; j++) {
+			double phi = (j + 0.5) * dPhi;
+			Vector dir(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+			Color L = getEnvironment(dir) * dw;
+			double Y[9];
+			evalSH(dir, Y);
+			for (int k = 0; k < 9; k++) irradianceSH[k] += L * float(Y[k]);
+		}
+	}
+	// convolve with the clamped cosine lobe (Ramamoorthi & Hanrahan, "An Efficient Representation for
+	// Irradiance Environment Maps"). The band factors are PI, 2PI/3 and PI/4; we also divide by PI:
+	const float bandScale[9] = { 1, 2 / 3.0f, 2 / 3.0f, 2 / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+	for (int k = 0; k < 9; k++) irradianceSH[k] *= bandScale[k];
+}
+
+Color Environment::getIrradiance(const Vector& n) const
+{
+	double Y[9];
+	evalSH(n, Y);
+	Color result(0, 0, 0);
+	for (int k = 0; k < 9; k++) result += irradianceSH[k] * float(Y[k]);
+	// the truncated series may ring slightly below zero, opposite to bright lights:
+	return Color(max(0.0f, result.r), max(0.0f, result.g), max(0.0f, result.b));
+}
 
 bool CubemapEnvironment::loadMaps(const char* folder)
 {
@@ -65,11 +130,17 @@ Color CubemapEnvironment::getSide(const Bitmap* bmp, double x, double y)
 {
 	// X: [-1, 1] -> [0, width] 
 	// Y: [-1, 1] -> [0, height]
+	int w = bmp->getWidth(), h = bmp->getHeight();
+	// interpolate between the texel centers; at the edges of the side, just clamp:
+	double fx = (x + 1) / 2 * w - 0.5, fy = (y + 1) / 2 * h - 0.5;
+	int x0 = int(floor(fx)), y0 = int(floor(fy));
+	float tx = float(fx - x0), ty = float(fy - y0);
+	int x1 = max(0, min(x0 + 1, w - 1)), y1 = max(0, min(y0 + 1, h - 1));
+	x0 = max(0, min(x0, w - 1));
+	y0 = max(0, min(y0, h - 1));
 	
-	int ix = ((x + 1) / 2) * bmp->getWidth();
-	int iy = ((y + 1) / 2) * bmp->getHeight();
-	
-	return bmp->getPixel(ix, iy);
+	return (bmp->getPixel(x0, y0) * (1 - tx) + bmp->getPixel(x1, y0) * tx) * (1 - ty)
+	     + (bmp->getPixel(x0, y1) * (1 - tx) + bmp->getPixel(x1, y1) * tx) * ty;
 }
 
 Color CubemapEnvironment::getEnvironment(const Vector& dir)
@@ -97,3 +168,142 @@ Color CubemapEnvironment::getEnvironment(const Vector& dir)
 	return Color(0, 0, 0);
 }
 
+
+Vector CubemapEnvironment::sideToDirection(int side, double x, double y)
+{
+	// given the (x, y) coordinates, passed to getSide(), reconstruct the point on the unit cube:
+	switch (side) {
+		case NEGX: return Vector(-1, -y, x);
+		case POSX: return Vector(1, -y, -x);
+		case NEGY: return Vector(x, -1, -y);
+		case POSY: return Vector(x, 1, y);
+		case NEGZ: return Vector(x, y, -1);
+		case POSZ: return Vector(x, -y, 1);
+	};
+	return Vector(0, 0, 1);
+}
+
+void CubemapEnvironment::beginRender()
+{
+	Environment::beginRender();
+	distributionsBuilt = false;
+	if (!importanceSampling || !loaded) return;
+	// each texel is weighted by its luminance and the solid angle it subtends. A texel at (x, y) on a side
+	// of the cube [-1, 1]^3 subtends a solid angle proportional to 1 / (1 + x^2 + y^2)^1.5:
+	vector<float> weights[6];
+	double total = 0;
+	int count = 0;
+	for (int side = 0; side < 6; side++) {
+		const Bitmap& bmp = *maps[side];
+		int w = bmp.getWidth(), h = bmp.getHeight();
+		weights[side].resize(w * h);
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++) {
+				double sx = (x + 0.5) / w * 2 - 1, sy = (y + 0.5) / h * 2 - 1;
+				double solidAngle = pow(1 + sx * sx + sy * sy, -1.5) * (4.0 / (w * h));
+				weights[side][y * w + x] = float(bmp.getPixel(x, y).intensityPerceptual() * solidAngle);
+				total += weights[side][y * w + x];
+			}
+		count += w * h;
+	}
+	float faceTotals[6];
+	for (int side = 0; side < 6; side++) {
+		addWeightFloor(weights[side], total / count);
+		texelDist[side].build(weights[side].data(), maps[side]->getWidth(), maps[side]->getHeight());
+		faceTotals[side] = float(texelDist[side].getTotal());
+	}
+	faceDist.build(faceTotals, 6);
+	distributionsBuilt = true;
+}
+
+void CubemapEnvironment::sampleDirection(Random& rnd, Vector& dir, Color& radiance, float& pdf)
+{
+	float probSide, probTexel;
+	int side = faceDist.sample(rnd.randdouble(), probSide);
+	int w = maps[side]->getWidth(), h = maps[side]->getHeight();
+	int tx, ty;
+	texelDist[side].sample(rnd.randdouble(), rnd.randdouble(), tx, ty, probTexel);
+	// a random point within the texel, in [-1, 1]^2:
+	double sx = (tx + rnd.randdouble()) / w * 2 - 1;
+	double sy = (ty + rnd.randdouble()) / h * 2 - 1;
+	Vector onCube = sideToDirection(side, sx, sy);
+	double r = onCube.length();
+	dir = onCube / r;
+	radiance = getEnvironment(dir);
+	// convert the density from area on the cube side (a texel has area 4/(w*h)) to solid angle:
+	// dA = dw * r^2 / cos(theta) = dw * r^3
+	double pdfArea = probSide * probTexel * (w * h / 4.0);
+	pdf = float(pdfArea * r * r * r);
+}
+
+void LatLongEnvironment::fillProperties(ParsedBlock& pb)
+{
+	Environment::fillProperties(pb);
+	if (!pb.getBitmapFileProp("file", image)) pb.requiredProp("file");
+	getTextureFilterProp(pb, filter);
+	loaded = true;
+}
+
+void LatLongEnvironment::toImageCoords(const Vector& dir, double& u, double& v)
+{
+	u = atan2(dir.z, dir.x) / (2 * PI) + 0.5;
+	v = acos(max(-1.0, min(1.0, dir.y))) / PI;
+}
+
+Color LatLongEnvironment::getEnvironment(const Vector& dir)
+{
+	double u, v;
+	toImageCoords(dir, u, v);
+	return mipmap.sample(filter, u, v, 0, 0, 0, 0);
+}
+
+Color LatLongEnvironment::getFilteredEnvironment(const Ray& ray)
+{
+	if (!(ray.flags & RF_DIFFERENTIALS)) return getEnvironment(ray.dir);
+	double u, v, ux, vx, uy, vy;
+	toImageCoords(ray.dir, u, v);
+	toImageCoords(ray.dir + ray.dDdx, ux, vx);
+	toImageCoords(ray.dir + ray.dDdy, uy, vy);
+	// the u coordinate wraps around at the seam:
+	double dudx = ux - u, dudy = uy - u;
+	if (dudx > 0.5) dudx -= 1; else if (dudx < -0.5) dudx += 1;
+	if (dudy > 0.5) dudy -= 1; else if (dudy < -0.5) dudy += 1;
+	return mipmap.sample(filter, u, v, dudx, vx - v, dudy, vy - v);
+}
+
+void LatLongEnvironment::beginRender()
+{
+	mipmap.build(image);
+	Environment::beginRender();
+	distributionBuilt = false;
+	if (!importanceSampling || !image.isOK()) return;
+	// weight the texels by luminance and solid angle; the latter is proportional to sin(theta) for each row:
+	int w = image.getWidth(), h = image.getHeight();
+	vector<float> weights(w * h);
+	double total = 0;
+	for (int y = 0; y < h; y++) {
+		double sinTheta = sin((y + 0.5) / h * PI);
+		for (int x = 0; x < w; x++) {
+			weights[y * w + x] = float(image.getPixel(x, y).intensityPerceptual() * sinTheta);
+			total += weights[y * w + x];
+		}
+	}
+	addWeightFloor(weights, total / (w * h));
+	texelDist.build(weights.data(), w, h);
+	distributionBuilt = true;
+}
+
+void LatLongEnvironment::sampleDirection(Random& rnd, Vector& dir, Color& radiance, float& pdf)
+{
+	int w = image.getWidth(), h = image.getHeight();
+	int tx, ty;
+	float probTexel;
+	texelDist.sample(rnd.randdouble(), rnd.randdouble(), tx, ty, probTexel);
+	double u = (tx + rnd.randdouble()) / w, v = (ty + rnd.randdouble()) / h;
+	double phi = (u - 0.5) * 2 * PI, theta = v * PI;
+	double sinTheta = sin(theta);
+	dir = Vector(sinTheta * cos(phi), cos(theta), sinTheta * sin(phi));
+	radiance = getEnvironment(dir);
+	// the image spans 2*pi x pi radians, and dw = sin(theta) * dphi * dtheta:
+	pdf = sinTheta > 0 ? float(probTexel * w * h / (2 * PI * PI * sinTheta)) : 0.0f;
+}
@@ -27,6 +27,9 @@
 #include "color.h"
 #include "vector.h"
 #include "scene.h"
+#include "sampling.h"
+#include "bitmap.h"
+#include "mipmap.h"
 
 enum CubeOrder {
 	NEGX, // 0
@@ -37,21 +40,59 @@ enum CubeOrder {
 	POSZ, // 5
 };
 
+class Random;
 class Environment: public SceneElement {
+	Color irradianceSH[9]; //!< the environment, projected to the first 9 spherical harmonics
+	bool wantIrradiance = false; //!< GlobalSettings::environmentLighting, when it was parsed
+	void projectIrradiance();
 public:
 	bool loaded = false;
+	bool importanceSampling = true; //!< sample the environment as a light source in path tracing (if supported)
 	virtual ~Environment() {}
 	/// gets a color from the environment at the specified direction
 	virtual Color getEnvironment(const Vector& dir) = 0;
 	
+	/// same as getEnvironment(ray.dir), but environments, which support prefiltering, may use the ray's
+	/// differentials (if present) to average over the pixel's footprint
+	virtual Color getFilteredEnvironment(const Ray& ray) { return getEnvironment(ray.dir); }
+	
+	/// can sampleDirection() be used? (only after beginRender())
+	virtual bool canSample() const { return false; }
+	
+	/**
+	 * @brief picks a random direction towards the environment, with probability roughly proportional to its brightness
+	 *
+	 * @param dir      - output: the (unit) direction
+	 * @param radiance - output: the environment's color in that direction, i.e. getEnvironment(dir)
+	 * @param pdf      - output: the probability density of choosing `dir', with respect to solid angle
+	 */
+	virtual void sampleDirection(Random& rnd, Vector& dir, Color& radiance, float& pdf) {}
+	
+	/// gets the diffuse (cosine-convolved) lighting from the environment, for a surface with normal n.
+	/// It's scaled by 1/PI, so that a constant environment of color C gives C, just like `ambientLight'.
+	/// Only available after beginRender(), if GlobalSettings::environmentLighting is on.
+	Color getIrradiance(const Vector& n) const;
+	
+	/// if needed, precomputes the irradiance (derived classes should call this from their beginRender())
+	void beginRender() override;
+	
+	void fillProperties(ParsedBlock& pb)
+	{
+		pb.getBoolProp("importanceSampling", &importanceSampling);
+		wantIrradiance = pb.getParser().getSettings().environmentLighting;
+	}
+	
 	ElementType getElementType() const { return ELEM_ENVIRONMENT; }	
 };
 
-class Bitmap;
 class CubemapEnvironment: public Environment {
 	Bitmap* maps[6];
+	Distribution1D faceDist;    //!< for choosing a side of the cube
+	Distribution2D texelDist[6]; //!< for choosing a texel within a side
+	bool distributionsBuilt = false;
 	
-	Color getSide(const Bitmap* bmp, double x, double y);
+	Color getSide(const Bitmap* bmp, double x, double y); //!< bilinear lookup
+	Vector sideToDirection(int side, double x, double y); //!< the inverse of the mapping in getEnvironment()
 public:
 	bool loadMaps(const char* folder);
  	/// loads a cubemap from 6 separate images, from the specified folder.
@@ -65,6 +106,10 @@ public:
 
 	~CubemapEnvironment();
 	Color getEnvironment(const Vector& dir);
+	
+	void beginRender() override;
+	bool canSample() const override { return distributionsBuilt; }
+	void sampleDirection(Random& rnd, Vector& dir, Color& radiance, float& pdf) override;
     
 	void fillProperties(ParsedBlock& pb)
 	{
@@ -76,3 +121,28 @@ public:
 		}
 	}
 };
+
+/// @brief an environment, given by a single equirectangular (latitude-longitude) panorama
+///
+/// The top row of the image is straight up (+Y); the left and right edges meet at -X, and
+/// the center of the image is at +X.
+class LatLongEnvironment: public Environment {
+	Bitmap image;
+	MipMap mipmap;
+	TextureFilter filter = FILTER_ANISOTROPIC;
+	Distribution2D texelDist;
+	bool distributionBuilt = false;
+	
+	void toImageCoords(const Vector& dir, double& u, double& v);
+public:
+	LatLongEnvironment() { mipmap.clampT = true; } // (u wraps around at the seam, but v ends at the poles)
+	
+	Color getEnvironment(const Vector& dir) override;
+	Color getFilteredEnvironment(const Ray& ray) override;
+	
+	void beginRender() override;
+	bool canSample() const override { return distributionBuilt; }
+	void sampleDirection(Random& rnd, Vector& dir, Color& radiance, float& pdf) override;
+	
+	void fillProperties(ParsedBlock& pb) override;
+};
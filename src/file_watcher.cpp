@@ -0,0 +1,88 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File file_watcher.cpp
+ * @Brief Implements the FileWatcher class
+ */
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#	include <unistd.h>
+#	include <sys/inotify.h>
+#endif
+#include "file_watcher.h"
+using namespace std;
+
+FileWatcher::~FileWatcher()
+{
+#ifdef __linux__
+	if (inotifyFd >= 0) close(inotifyFd);
+#endif
+}
+
+time_t FileWatcher::getModificationTime() const
+{
+	struct stat st;
+	if (stat(path.c_str(), &st)) return 0;
+	return st.st_mtime;
+}
+
+bool FileWatcher::watch(const char* filename)
+{
+	path = filename;
+	size_t slash = path.find_last_of("/\\");
+	dir = slash == string::npos ? "." : path.substr(0, slash);
+	fileName = slash == string::npos ? path : path.substr(slash + 1);
+	lastModified = getModificationTime();
+#ifdef __linux__
+	// (if inotify isn't available, fall back to checking the modification time)
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+#endif
+	return lastModified != 0;
+}
+
+bool FileWatcher::hasChanged()
+{
+#ifdef __linux__
+	if (inotifyFd >= 0) {
+		bool changed = false;
+		char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t len;
+		// (drain all the pending events; an editor's save usually generates several)
+		while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+			for (char* p = buffer; p < buffer + len; ) {
+				const inotify_event* event = (const inotify_event*) p;
+				if (event->len && fileName == event->name) changed = true;
+				p += sizeof(inotify_event) + event->len;
+			}
+		}
+		return changed;
+	}
+#endif
+	time_t modified = getModificationTime();
+	if (modified == 0 || modified == lastModified) return false;
+	lastModified = modified;
+	return true;
+}
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File file_watcher.h
+ * @Brief Detects changes of a file (e.g. the scene file, for reloading it)
+ */
+#pragma once
+
+#include <string>
+#include <time.h>
+
+/**
+ * @brief watches a single file for modifications
+ *
+ * On Linux, it uses inotify on the file's directory (editors often save by writing a new file and renaming it
+ * over the old one, which a watch on the file itself would miss). Elsewhere, it compares the modification time.
+ */
+class FileWatcher {
+	std::string path, dir, fileName;
+	int inotifyFd = -1;
+	time_t lastModified = 0;
+	time_t getModificationTime() const;
+public:
+	FileWatcher() {}
+	~FileWatcher();
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator = (const FileWatcher&) = delete;
+	
+	bool watch(const char* filename); //!< starts watching the file. @returns false on error
+	/// @returns true if the file was modified since the last call (or since watch()). Doesn't block
+	bool hasChanged();
+};
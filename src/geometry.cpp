@@ -24,9 +24,20 @@
  */
 #include "geometry.h"
 #include "util.h"
+#include "render_stats.h"
 #include <algorithm>
+#include <atomic>
 using namespace std;
 
+/// the open end of a span, which extends to infinity
+static inline IntersectionInfo infiniteEnd(double dist)
+{
+	IntersectionInfo info;
+	info.dist = dist;
+	info.geom = nullptr;
+	return info;
+}
+
 bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
 {
 	if (ray.start.y > height && ray.dir.y >= 0) return false;
@@ -44,11 +55,55 @@ bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
 	info.norm = Vector(0, 1, 0);
 	info.u = info.ip.x;
 	info.v = info.ip.z;
+	info.dpdu = Vector(1, 0, 0);
+	info.dpdv = Vector(0, 0, 1);
 	info.geom = this;
 	//
 	return true;
 }
 
+void Plane::getSpans(const Ray& ray, SpanList& spans)
+{
+	spans.count = 0;
+	if (ray.dir.y == 0) {
+		if (ray.start.y <= height) spans.add(infiniteEnd(-INF), infiniteEnd(INF));
+		return;
+	}
+	double t = (height - ray.start.y) / ray.dir.y;
+	IntersectionInfo info;
+	info.ip = ray.start + ray.dir * t;
+	info.dist = t * ray.dir.length();
+	info.norm = Vector(0, 1, 0);
+	info.u = info.ip.x;
+	info.v = info.ip.z;
+	info.dpdu = Vector(1, 0, 0);
+	info.dpdv = Vector(0, 0, 1);
+	info.geom = this;
+	if (ray.dir.y > 0)
+		spans.add(infiniteEnd(-INF), info); // going up, out of the half-space
+	else
+		spans.add(info, infiniteEnd(INF));
+}
+
+void Sphere::fillInfo(const Ray& ray, double t, IntersectionInfo& info)
+{
+	info.ip = ray.start + ray.dir * t;
+	info.dist = t * ray.dir.length();
+	info.norm = info.ip - this->O;
+	info.norm.normalize();
+	info.u = (toDegrees(atan2(info.norm.z, info.norm.x)) + 180.0) / 360.0;
+	info.v = 1 - (toDegrees(asin(info.norm.y)) + 90) / 180.0;
+	// u = atan2(z, x) / 2pi + 0.5; v = 0.5 - asin(y) / pi:
+	const Vector& n = info.norm;
+	double cosLat = sqrt(sqr(n.x) + sqr(n.z));
+	info.dpdu = Vector(-n.z, 0, n.x) * (2 * PI * R);
+	if (cosLat > 1e-9)
+		info.dpdv = Vector(n.y * n.x / cosLat, -cosLat, n.y * n.z / cosLat) * (PI * R);
+	else
+		info.dpdv.makeZero(); // at the poles
+	info.geom = this;
+}
+
 bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
 {
 	// p^2 * ray.dir.length^2 + p * (2 * dot(ray.dir, H)) + (H.length^2 - R^2) = 0
@@ -72,137 +127,399 @@ bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
 	if (larger < 0) return false;
 	double dist = (smaller >= 0) ? smaller : larger;
 	
-	info.ip = ray.start + ray.dir * dist;
-	info.dist = distance(ray.start, info.ip);
-	info.norm = info.ip - this->O;
-	info.norm.normalize();
-	info.u = (toDegrees(atan2(info.norm.z, info.norm.x)) + 180.0) / 360.0;
-	info.v = 1 - (toDegrees(asin(info.norm.y)) + 90) / 180.0;
-	info.geom = this;
+	fillInfo(ray, dist, info);
 	return true;
 }
 
-void Cube::intersectCubeSide(const Ray& ray, double start, double dir, double target, const Vector& normal,
-							IntersectionInfo& info, std::function<void (const Vector&)> uv_mapping)
+void Sphere::getSpans(const Ray& ray, SpanList& spans)
+{
+	spans.count = 0;
+	Vector H = ray.start - this->O;
+	double A = ray.dir.lengthSqr();
+	double B = 2 * dot(ray.dir, H);
+	double C = H.lengthSqr() - sqr(this->R);
+	double Disc = B*B - 4*A*C;
+	if (Disc < 0) return;
+	double sqrtDisc = sqrt(Disc);
+	double tEnter = (-B - sqrtDisc) / (2*A);
+	double tExit  = (-B + sqrtDisc) / (2*A);
+	if (tExit < 0) return;
+	IntersectionInfo enter, exit;
+	fillInfo(ray, tEnter, enter);
+	fillInfo(ray, tExit, exit);
+	spans.add(enter, exit);
+}
+
+bool Cube::slabTest(const Ray& ray, double& tEnter, double& tExit, int& axisEnter, int& axisExit)
 {
-	if (fabs(dir) < 1e-9) return;
+	tEnter = -INF;
+	tExit = INF;
+	axisEnter = axisExit = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		double lo = O[axis] - halfSide, hi = O[axis] + halfSide;
+		if (fabs(ray.dir[axis]) < 1e-12) {
+			// parallel to these sides; either always between them, or never:
+			if (ray.start[axis] < lo || ray.start[axis] > hi) return false;
+			continue;
+		}
+		double t0 = (lo - ray.start[axis]) / ray.dir[axis];
+		double t1 = (hi - ray.start[axis]) / ray.dir[axis];
+		if (t0 > t1) swap(t0, t1);
+		if (t0 > tEnter) { tEnter = t0; axisEnter = axis; }
+		if (t1 < tExit)  { tExit  = t1; axisExit  = axis; }
+	}
+	return tEnter <= tExit;
+}
 
-	// start + mult*dir = target
-	double mult = (target - start) / dir;
-	
-	if (mult < 0) return;
-	
-	Vector ip = ray.start + ray.dir * mult;
-	
-	if (ip.x < O.x - halfSide - 1e-6 || ip.x > O.x + halfSide + 1e-6) return;
-	if (ip.y < O.y - halfSide - 1e-6 || ip.y > O.y + halfSide + 1e-6) return;
-	if (ip.z < O.z - halfSide - 1e-6 || ip.z > O.z + halfSide + 1e-6) return;
-		
-	double dist = distance(ray.start, ip);
-	if (dist < info.dist) {
-		info.dist = dist;
-		info.ip = ip;
-		
-		info.norm = normal;
-		uv_mapping(ip);
+void Cube::fillInfo(const Ray& ray, double t, int axis, IntersectionInfo& info)
+{
+	info.ip = ray.start + ray.dir * t;
+	info.dist = t * ray.dir.length();
+	info.norm.makeZero();
+	info.norm[axis] = info.ip[axis] > O[axis] ? +1 : -1;
+	switch (axis) {
+		case 0:
+			info.u = info.ip.y; info.v = info.ip.z; info.dpdu = Vector(0, 1, 0); info.dpdv = Vector(0, 0, 1);
+			break;
+		case 1:
+			info.u = info.ip.x; info.v = info.ip.z; info.dpdu = Vector(1, 0, 0); info.dpdv = Vector(0, 0, 1);
+			break;
+		default:
+			info.u = info.ip.x; info.v = info.ip.y; info.dpdu = Vector(1, 0, 0); info.dpdv = Vector(0, 1, 0);
+			break;
 	}
+	info.geom = this;
 }
 
 bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
 {
-	info.dist = 1e99;
-	
-	auto sideX_UV = [&info] (const Vector& ip) { info.u = ip.y; info.v = ip.z; };
-	auto sideY_UV = [&info] (const Vector& ip) { info.u = ip.x; info.v = ip.z; };
-	auto sideZ_UV = [&info] (const Vector& ip) { info.u = ip.x; info.v = ip.y; };
-
-	// X:	
-	intersectCubeSide(ray, ray.start.x, ray.dir.x, O.x - halfSide, Vector(-1, 0, 0), info, sideX_UV);
-	intersectCubeSide(ray, ray.start.x, ray.dir.x, O.x + halfSide, Vector(+1, 0, 0), info, sideX_UV);
-
-	// Y:
-	intersectCubeSide(ray, ray.start.y, ray.dir.y, O.y - halfSide, Vector(0, -1, 0), info, sideY_UV);
-	intersectCubeSide(ray, ray.start.y, ray.dir.y, O.y + halfSide, Vector(0, +1, 0), info, sideY_UV);
-	
-	// Z:
-	intersectCubeSide(ray, ray.start.z, ray.dir.z, O.z - halfSide, Vector(0, 0, -1), info, sideZ_UV);
-	intersectCubeSide(ray, ray.start.z, ray.dir.z, O.z + halfSide, Vector(0, 0, +1), info, sideZ_UV);
+	double tEnter, tExit;
+	int axisEnter, axisExit;
+	if (!slabTest(ray, tEnter, tExit, axisEnter, axisExit) || tExit < 0) return false;
+	// if we're inside the cube, we hit it on the way out:
+	if (tEnter >= 0)
+		fillInfo(ray, tEnter, axisEnter, info);
+	else
+		fillInfo(ray, tExit, axisExit, info);
+	return true;
+}
 
-	if (info.dist < 1e99) {
-		info.geom = this;
-		return true;
-	} else {
-		return false;
-	}
+void Cube::getSpans(const Ray& ray, SpanList& spans)
+{
+	spans.count = 0;
+	double tEnter, tExit;
+	int axisEnter, axisExit;
+	if (!slabTest(ray, tEnter, tExit, axisEnter, axisExit) || tExit < 0) return;
+	IntersectionInfo enter, exit;
+	fillInfo(ray, tEnter, axisEnter, enter);
+	fillInfo(ray, tExit, axisExit, exit);
+	spans.add(enter, exit);
 }
 
-vector<IntersectionInfo> findAllIntersections(const Ray& _ray, Geometry* g)
+void Geometry::getSpans(const Ray& _ray, SpanList& spans)
 {
-	vector<IntersectionInfo> result;
+	// find all crossings of the surface, by re-shooting the ray from just past each hit:
+	IntersectionInfo hits[2 * MAX_SPANS];
+	int numHits = 0;
 	Ray ray = _ray;
-	
-	int counter = 30;
 	Vector origin = ray.start;
 	
-	IntersectionInfo info;
-	while (g->intersect(ray, info) && counter --> 0) {
-		result.push_back(info);
-	
-		ray.start = info.ip + ray.dir * 1e-6;
+	while (numHits < 2 * MAX_SPANS && intersect(ray, hits[numHits])) {
+		IntersectionInfo& hit = hits[numHits++];
+		hit.dist = distance(hit.ip, origin);
+		ray.start = hit.ip + ray.dir * 1e-6;
+		countStat(STAT_CSG_REINTERSECTIONS);
 	}
 	
-	for (int i = 1; i < int(result.size()); i++)
-		result[i].dist = distance(result[i].ip, origin);
-	
-	return result;
+	// the crossings alternate between entering and exiting. If their number is odd, we started inside:
+	spans.count = 0;
+	int i = 0;
+	if (numHits % 2 == 1) {
+		spans.add(infiniteEnd(-INF), hits[0]);
+		i = 1;
+	}
+	for (; i + 1 < numHits; i += 2)
+		spans.add(hits[i], hits[i + 1]);
 }
 
 bool CsgOp::intersect(const Ray& ray, IntersectionInfo& info)
 {
-	vector<IntersectionInfo>
-		leftIntersections = findAllIntersections(ray, left),
-		rightIntersections = findAllIntersections(ray, right);
+	SpanList spans;
+	getSpans(ray, spans);
 	
-	vector<IntersectionInfo> allIntersections;
-	
-	for (auto& ip: leftIntersections) allIntersections.push_back(ip);
-	for (auto& ip: rightIntersections) allIntersections.push_back(ip);
+	// the first span boundary in front of the ray:
+	for (int i = 0; i < spans.count; i++) {
+		const Span& span = spans.spans[i];
+		if (span.enter.dist >= 0) {
+			info = span.enter;
+		} else if (span.exit.dist < INF) {
+			info = span.exit;
+		} else continue;
+		info.dist = distance(ray.start, info.ip);
+		info.geom = this;
+		return true;
+	}
 	
-	sort(allIntersections.begin(), allIntersections.end(), []
-		(const IntersectionInfo& a, const IntersectionInfo& b) -> bool {
-			return a.dist < b.dist;
-	});
+	return false;
+}
+
+/// boundary k of a span list is the entry (k even) or the exit (k odd) of span k/2
+static inline const IntersectionInfo& spanBoundary(const SpanList& list, int k)
+{
+	return (k % 2) ? list.spans[k / 2].exit : list.spans[k / 2].enter;
+}
+
+bool CsgOp::getBBox(BBox& bbox)
+{
+	BBox leftBox, rightBox;
+	bool hasLeft = left->getBBox(leftBox);
+	bool hasRight = right->getBBox(rightBox);
+	return combineBBoxes(hasLeft, leftBox, hasRight, rightBox, bbox);
+}
+
+void CsgOp::beginRender()
+{
+	leftBounded = left->getBBox(leftBounds);
+	rightBounded = right->getBBox(rightBounds);
+	bounded = combineBBoxes(leftBounded, leftBounds, rightBounded, rightBounds, bounds);
+	empty = bounded && bounds.isEmpty();
+}
+
+void CsgOp::getSpans(const Ray& ray, SpanList& spans)
+{
+	spans.count = 0;
+	if (empty) return;
+	RRay rray(ray);
+	rray.prepareForTracing();
+	if (bounded && !bounds.testIntersect(rray)) return;
 	
-	bool inLeft = (leftIntersections.size() % 2) == 1;
-	bool inRight = (rightIntersections.size() % 2) == 1;
+	// if the ray misses an operand, its span list is empty, and we can skip it. If the result would
+	// then be empty (e.g. the left operand of CsgMinus is missed), skip the other operand as well:
+	SpanList leftSpans, rightSpans;
+	if (!leftBounded || leftBounds.testIntersect(rray)) left->getSpans(ray, leftSpans);
+	if (leftSpans.count == 0 && !boolOp(false, true)) return;
+	if (!rightBounded || rightBounds.testIntersect(rray)) right->getSpans(ray, rightSpans);
+	if (rightSpans.count == 0 && !boolOp(true, false)) return;
 	
-	bool boolResult = boolOp(inLeft, inRight);
+	// sweep over the span boundaries of both operands, in order of distance (both lists are already sorted):
+	spans.count = 0;
+	int nLeft = 2 * leftSpans.count, nRight = 2 * rightSpans.count;
+	int iLeft = 0, iRight = 0;
+	bool inLeft = false, inRight = false, inResult = false;
+	IntersectionInfo enter;
+	while (iLeft < nLeft || iRight < nRight) {
+		const IntersectionInfo* boundary;
+		if (iRight >= nRight || (iLeft < nLeft &&
+		    spanBoundary(leftSpans, iLeft).dist <= spanBoundary(rightSpans, iRight).dist)) {
+			boundary = &spanBoundary(leftSpans, iLeft++);
+			inLeft = !inLeft;
+		} else {
+			boundary = &spanBoundary(rightSpans, iRight++);
+			inRight = !inRight;
+		}
+		bool newResult = boolOp(inLeft, inRight);
+		if (newResult == inResult) continue;
+		inResult = newResult;
+		// the normals of the result should point outwards; e.g., the surfaces, carved by CsgMinus, are flipped:
+		if (inResult) {
+			enter = *boundary;
+			if (enter.geom && dot(enter.norm, ray.dir) > 0) enter.norm = -enter.norm;
+		} else {
+			IntersectionInfo exit = *boundary;
+			if (exit.geom && dot(exit.norm, ray.dir) < 0) exit.norm = -exit.norm;
+			spans.add(enter, exit);
+		}
+	}
+	// (only possible, if some spans were dropped due to the MAX_SPANS limit)
+	if (inResult) spans.add(enter, infiniteEnd(INF));
+}
+
+static bool sameTransform(const Transform& a, const Transform& b)
+{
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (a.m.m[i][j] != b.m.m[i][j]) return false;
+	return a.offset.x == b.offset.x && a.offset.y == b.offset.y && a.offset.z == b.offset.z;
+}
+
+/// Each render thread remembers the transforms of the moving nodes at the time of its last rays through them. The
+/// shadow and secondary rays of a sample are at the same time, so they don't interpolate (and invert) it again.
+struct RecentMotion {
+	static const int SIZE = 16;
+	struct Slot {
+		unsigned motionId = 0;
+		double time = -1;
+		Transform T;
+	} slots[SIZE];
+};
+
+static thread_local RecentMotion recentMotion;
+static std::atomic<unsigned> lastMotionId(0);
+
+void Node::beginRender()
+{
+	bool moving = false;
+	for (auto& step: motion)
+		if (!sameTransform(step, motion[0])) moving = true;
+	if (!moving) {
+		motion.clear();
+		return;
+	}
+	// the transform is a linear blend between the steps, so each point moves along straight segments, between its
+	// positions at each step. The box around all of them contains the node at any time:
+	motionId = ++lastMotionId; // (so the threads don't use transforms, cached before a change)
+	BBox box;
+	motionBounded = geometry->getBBox(box);
+	if (!motionBounded) return;
+	motionBounds.makeEmpty();
+	for (auto& step: motion)
+		for (int corner = 0; corner < 8; corner++) {
+			Vector p((corner & 1) ? box.vmax.x : box.vmin.x,
+			         (corner & 2) ? box.vmax.y : box.vmin.y,
+			         (corner & 4) ? box.vmax.z : box.vmin.z);
+			motionBounds.add(step.transformPoint(p));
+		}
+}
+
+bool Node::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	if (motion.empty()) return intersectTransformed(T, ray, info);
+	// a moving node: only the rays, which hit its bounds, pay for interpolating the transform:
+	if (motionBounded) {
+		RRay rray(ray);
+		rray.prepareForTracing();
+		if (!motionBounds.testIntersect(rray)) return false;
+	}
+	double time = min(max(ray.time, 0.0), 1.0);
+	RecentMotion::Slot& slot = recentMotion.slots[motionId % RecentMotion::SIZE];
+	if (slot.motionId != motionId || slot.time != time) {
+		double t = time * (MOTION_BLUR_STEPS - 1);
+		int step = min(int(t), MOTION_BLUR_STEPS - 2);
+		slot.T.interpolate(motion[step], motion[step + 1], t - step);
+		slot.motionId = motionId;
+		slot.time = time;
+	}
+	return intersectTransformed(slot.T, ray, info);
+}
+
+bool Node::intersectTransformed(Transform& T, const Ray& ray, IntersectionInfo& info)
+{
+	// (the geometries don't need the ray differentials, so don't bother copying them)
+	Ray localRay;
+	localRay.depth = ray.depth;
+	localRay.flags = ray.flags & ~RF_DIFFERENTIALS;
 	
-	for (auto& ip: allIntersections) {
-		if (ip.geom == left) inLeft = !inLeft;
-		else                 inRight = !inRight;
-		bool newBoolResult = boolOp(inLeft, inRight);
-		
-		if (newBoolResult != boolResult) {
-			info = ip;
-			info.geom = this;
+	switch (T.type) {
+		case XFORM_IDENTITY:
+		{
+			localRay.start = ray.start;
+			localRay.dir = ray.dir;
+			return geometry->intersect(localRay, info);
+		}
+		case XFORM_TRANSLATE:
+		{
+			// directions and distances are unchanged:
+			localRay.start = ray.start - T.offset;
+			localRay.dir = ray.dir;
+			if (!geometry->intersect(localRay, info)) return false;
+			info.ip += T.offset;
+			return true;
+		}
+		case XFORM_UNIFORM_SCALE:
+		{
+			// the normal matrix is m / scaleFactor^2, so normals only need m / scaleFactor, and no renormalization.
+			// Distances are scaled by scaleFactor:
+			localRay.start = T.untransformPoint(ray.start);
+			localRay.dir = T.untransformDir(ray.dir);
+			if (!geometry->intersect(localRay, info)) return false;
+			info.ip = T.transformPoint(info.ip);
+			info.norm = info.norm * T.m * (1 / T.scaleFactor);
+			info.dpdu = info.dpdu * T.m;
+			info.dpdv = info.dpdv * T.m;
+			info.dist *= T.scaleFactor;
+			return true;
+		}
+		case XFORM_AFFINE:
+		{
+			localRay.start = T.untransformPoint(ray.start);
+			localRay.dir = ray.dir * T.invM;
+			double dirScale = localRay.dir.length(); // a unit of world distance is this much in local space
+			localRay.dir *= 1 / dirScale;
+			if (!geometry->intersect(localRay, info)) return false;
+			info.ip = T.transformPoint(info.ip);
+			info.norm = T.transformNormal(info.norm);
+			info.dpdu = info.dpdu * T.m;
+			info.dpdv = info.dpdv * T.m;
+			info.dist /= dirScale;
 			return true;
 		}
 	}
-	
 	return false;
 }
 
-bool Node::intersect(const Ray& ray, IntersectionInfo& info)
+void computeTextureDifferentials(const Ray& ray, IntersectionInfo& info)
 {
-	Ray localRay = ray;
-	localRay.start = T.untransformPoint(ray.start);
-	localRay.dir = T.untransformDir(ray.dir);
+	info.dPdx.makeZero();
+	info.dPdy.makeZero();
+	info.dudx = info.dvdx = info.dudy = info.dvdy = 0;
+	if (!(ray.flags & RF_DIFFERENTIALS)) return;
 	
-	if (!geometry->intersect(localRay, info)) return false;
+	// intersect the two offset rays with the tangent plane at the intersection point:
+	const Vector& n = info.norm;
+	Vector dirX = ray.dir + ray.dDdx;
+	Vector dirY = ray.dir + ray.dDdy;
+	double denomX = dot(n, dirX);
+	double denomY = dot(n, dirY);
+	if (fabs(denomX) < 1e-12 || fabs(denomY) < 1e-12) return;
 	
-	info.ip = T.transformPoint(info.ip);
-	info.norm = T.transformDir(info.norm);
-	info.dist = distance(ray.start, info.ip);
-	return true;
+	double planeD = dot(n, info.ip);
+	Vector startX = ray.start + ray.dPdx;
+	Vector startY = ray.start + ray.dPdy;
+	info.dPdx = startX + dirX * ((planeD - dot(n, startX)) / denomX) - info.ip;
+	info.dPdy = startY + dirY * ((planeD - dot(n, startY)) / denomY) - info.ip;
+	
+	// solve dPdx = dudx * dpdu + dvdx * dpdv (and the same for y). The system is overdetermined, so just
+	// drop the dimension, where the normal is largest (it's the least significant one):
+	int dimDropped = n.maxDimension();
+	int d0 = (dimDropped + 1) % 3, d1 = (dimDropped + 2) % 3;
+	double det = info.dpdu[d0] * info.dpdv[d1] - info.dpdv[d0] * info.dpdu[d1];
+	if (fabs(det) < 1e-12) return;
+	double rDet = 1 / det;
+	info.dudx = (info.dpdv[d1] * info.dPdx[d0] - info.dpdv[d0] * info.dPdx[d1]) * rDet;
+	info.dvdx = (info.dpdu[d0] * info.dPdx[d1] - info.dpdu[d1] * info.dPdx[d0]) * rDet;
+	info.dudy = (info.dpdv[d1] * info.dPdy[d0] - info.dpdv[d0] * info.dPdy[d1]) * rDet;
+	info.dvdy = (info.dpdu[d0] * info.dPdy[d1] - info.dpdu[d1] * info.dPdy[d0]) * rDet;
+}
+
+void reflectRayDifferentials(const Ray& ray, const IntersectionInfo& info, const Vector& n, Ray& newRay)
+{
+	if (!(ray.flags & RF_DIFFERENTIALS)) {
+		newRay.flags &= ~RF_DIFFERENTIALS;
+		return;
+	}
+	newRay.flags |= RF_DIFFERENTIALS;
+	newRay.dPdx = info.dPdx;
+	newRay.dPdy = info.dPdy;
+	newRay.dDdx = ray.dDdx - 2 * dot(ray.dDdx, n) * n;
+	newRay.dDdy = ray.dDdy - 2 * dot(ray.dDdy, n) * n;
+}
+
+void refractRayDifferentials(const Ray& ray, const IntersectionInfo& info, const Vector& n, double ior, Ray& newRay)
+{
+	if (!(ray.flags & RF_DIFFERENTIALS)) {
+		newRay.flags &= ~RF_DIFFERENTIALS;
+		return;
+	}
+	// refracted = ior * dir - mu * n, where mu = ior * dot(dir, n) + sqrt(k), as in refract(). Differentiating:
+	double cosOut = dot(newRay.dir, n);
+	if (fabs(cosOut) < 1e-9) {
+		newRay.flags &= ~RF_DIFFERENTIALS;
+		return;
+	}
+	double dmuMult = ior - ior * ior * dot(ray.dir, n) / cosOut;
+	newRay.flags |= RF_DIFFERENTIALS;
+	newRay.dPdx = info.dPdx;
+	newRay.dPdy = info.dPdy;
+	newRay.dDdx = ior * ray.dDdx - (dmuMult * dot(ray.dDdx, n)) * n;
+	newRay.dDdy = ior * ray.dDdy - (dmuMult * dot(ray.dDdy, n)) * n;
 }
@@ -25,9 +25,10 @@
 #pragma once
 
 #include "vector.h"
-#include <functional>
 #include "matrix.h"
 #include "scene.h"
+#include "constants.h"
+#include "bbox.h"
 
 class Geometry;
 struct IntersectionInfo {
@@ -35,9 +36,27 @@ struct IntersectionInfo {
 	Vector ip;
 	Vector norm, dNdx, dNdy;
 	double u, v;
+	Vector dpdu, dpdv; //!< derivatives of the intersection point w.r.t. the texture coordinates (u, v); not normalized
 	Geometry* geom;
+	
+	// filled by computeTextureDifferentials():
+	Vector dPdx, dPdy; //!< how the intersection point moves, if we shift the pixel by one unit in x or y
+	double dudx, dvdx, dudy, dvdy; //!< the same, for the texture coordinates (the texture footprint of a pixel)
 };
 
+/// Computes the screen-space derivatives of the intersection point and its texture coordinates (dPdx, dudx, etc.),
+/// by intersecting the ray differentials with the tangent plane at the intersection. If the ray carries no
+/// differentials, they are all set to zero (i.e., no texture filtering is possible)
+void computeTextureDifferentials(const Ray& ray, IntersectionInfo& info);
+
+/// Sets up the ray differentials of `newRay', which is `ray', reflected at `info' along the normal n.
+/// The curvature of the surface is neglected.
+void reflectRayDifferentials(const Ray& ray, const IntersectionInfo& info, const Vector& n, Ray& newRay);
+
+/// Sets up the ray differentials of `newRay', which is `ray', refracted at `info' with the given ior (eta1 / eta2).
+/// n is the normal, facing the incoming ray. The curvature of the surface is neglected.
+void refractRayDifferentials(const Ray& ray, const IntersectionInfo& info, const Vector& n, double ior, Ray& newRay);
+
 class Intersectable {
 public:
 	virtual ~Intersectable() {}
@@ -46,11 +65,51 @@ public:
 	virtual bool intersect(const Ray& ray, IntersectionInfo& info) = 0;
 };
 
+/// @brief an interval along a ray, where the ray is inside a solid
+///
+/// enter.dist and exit.dist are signed distances along the ray (negative ones are behind its start).
+/// If the span extends to infinity, that end has a dist of -INF or +INF, and the rest of the info is not filled.
+struct Span {
+	IntersectionInfo enter, exit;
+};
+
+/// @brief the spans of a ray through a solid, sorted by distance and non-overlapping
+///
+/// The capacity is fixed, to avoid heap allocations per ray. If there are more spans, the farthest ones are dropped.
+struct SpanList {
+	int count = 0;
+	Span spans[MAX_SPANS];
+	
+	/// adds a span after the last one. Spans, which are entirely behind the ray start, are ignored
+	void add(const IntersectionInfo& enter, const IntersectionInfo& exit)
+	{
+		if (exit.dist < 0 || count == MAX_SPANS) return;
+		spans[count].enter = enter;
+		spans[count].exit = exit;
+		count++;
+	}
+};
+
 class Geometry: public Intersectable, public SceneElement {
 public:
 	ElementType getElementType() const { return ELEM_GEOMETRY; }
+	
+	/**
+	 * @brief finds all spans, where the ray is inside the geometry (used for CSG)
+	 *
+	 * The geometry should be a closed solid. The default implementation repeatedly calls intersect(), moving the
+	 * ray start slightly past each hit; geometries with an analytic solution should override it.
+	 */
+	virtual void getSpans(const Ray& ray, SpanList& spans);
+	
+	/// gets a box, which contains the whole geometry (in its own coordinates, i.e. without any Node transforms).
+	/// @returns false if the geometry is unbounded, or the bounds are unknown
+	virtual bool getBBox(BBox& bbox) { return false; }
 };
 
+/// @brief a square with side 2*limit, perpendicular to Y.
+///
+/// In CSG, a Plane is the half-space below it (y <= height); the limit is ignored then.
 class Plane: public Geometry {
 public:
 	double limit;
@@ -64,9 +123,12 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	void getSpans(const Ray& ray, SpanList& spans) override;
+	// (getBBox(): the half-space is unbounded)
 };
 
 class Sphere: public Geometry {
+	void fillInfo(const Ray& ray, double t, IntersectionInfo& info); //!< fills the hit info, at ray.start + ray.dir * t
 public:
 	Vector O = Vector(0, 0, 0);
 	double R = 1;
@@ -84,12 +146,20 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	void getSpans(const Ray& ray, SpanList& spans) override;
+	bool getBBox(BBox& bbox) override
+	{
+		bbox.vmin = O - Vector(R, R, R);
+		bbox.vmax = O + Vector(R, R, R);
+		return true;
+	}
 };
 
 class Cube: public Geometry {
-	void intersectCubeSide(const Ray& ray, double start, double dir, double target,
-							const Vector& normal, IntersectionInfo& info,
-							std::function<void(const Vector&)> uv_mapping);
+	/// finds the entry and exit of the ray (as in ray.start + ray.dir * t), and the axes of the sides, where they occur
+	bool slabTest(const Ray& ray, double& tEnter, double& tExit, int& axisEnter, int& axisExit);
+	/// fills the hit info for a point on the side, perpendicular to the given axis
+	void fillInfo(const Ray& ray, double t, int axis, IntersectionInfo& info);
 
 public:
 	Vector O = Vector(0, 0, 0);
@@ -108,15 +178,31 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
-	
+	void getSpans(const Ray& ray, SpanList& spans) override;
+	bool getBBox(BBox& bbox) override
+	{
+		bbox.vmin = O - Vector(halfSide, halfSide, halfSide);
+		bbox.vmax = O + Vector(halfSide, halfSide, halfSide);
+		return true;
+	}
 };
 
 class CsgOp: public Geometry {
+protected:
+	// computed in beginRender():
+	BBox bounds, leftBounds, rightBounds;
+	bool bounded = false, leftBounded = false, rightBounded = false;
+	bool empty = false; //!< e.g. the intersection of two disjoint objects
 public:
 	Geometry* left;
 	Geometry* right;
 	
 	virtual bool boolOp(bool inLeft, bool inRight) = 0;
+	/// computes the bounds of the result, given the bounds of the operands (if known)
+	virtual bool combineBBoxes(bool hasLeft, const BBox& leftBox, bool hasRight, const BBox& rightBox, BBox& result) = 0;
+	
+	void beginRender() override;
+	bool getBBox(BBox& bbox) override;
 
 	void fillProperties(ParsedBlock& pb)
 	{
@@ -127,6 +213,7 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	void getSpans(const Ray& ray, SpanList& spans) override;
 };
 
 class CsgPlus: public CsgOp {
@@ -135,6 +222,14 @@ public:
 	{
 		return inLeft || inRight;
 	}
+	bool combineBBoxes(bool hasLeft, const BBox& leftBox, bool hasRight, const BBox& rightBox, BBox& result) override
+	{
+		if (!hasLeft || !hasRight) return false;
+		result = leftBox;
+		result.add(rightBox.vmin);
+		result.add(rightBox.vmax);
+		return true;
+	}
 };
 
 class CsgIntersect: public CsgOp {
@@ -143,6 +238,17 @@ public:
 	{
 		return inLeft && inRight;
 	}
+	bool combineBBoxes(bool hasLeft, const BBox& leftBox, bool hasRight, const BBox& rightBox, BBox& result) override
+	{
+		if (!hasLeft && !hasRight) return false;
+		if (!hasLeft) { result = rightBox; return true; }
+		if (!hasRight) { result = leftBox; return true; }
+		for (int i = 0; i < 3; i++) {
+			result.vmin[i] = max(leftBox.vmin[i], rightBox.vmin[i]);
+			result.vmax[i] = min(leftBox.vmax[i], rightBox.vmax[i]);
+		}
+		return true;
+	}
 };
 
 class CsgMinus: public CsgOp {
@@ -151,6 +257,12 @@ public:
 	{
 		return inLeft && !inRight;
 	}
+	bool combineBBoxes(bool hasLeft, const BBox& leftBox, bool hasRight, const BBox& rightBox, BBox& result) override
+	{
+		if (!hasLeft) return false;
+		result = leftBox;
+		return true;
+	}
 };
 
 struct Shader;
@@ -160,6 +272,15 @@ struct Node: public Intersectable, public SceneElement {
 	Shader* shader = nullptr;
 	Transform T;
 	Texture* bump = nullptr;
+	/// with motion blur: the transforms at MOTION_BLUR_STEPS evenly spaced times of the shutter interval (the first
+	/// one is T). Empty, if the node doesn't move
+	std::vector<Transform> motion;
+	// computed in beginRender(), for a moving node: a box, which contains it during the whole motion (world space)
+	BBox motionBounds;
+	bool motionBounded = false;
+	unsigned motionId = 0; //!< unique to each beginRender() of a moving node (identifies it in the caches of the threads)
+	
+	bool isMoving() const { return !motion.empty(); }
 
 	// from Intersectable:
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
@@ -172,6 +293,17 @@ struct Node: public Intersectable, public SceneElement {
 		pb.getShaderProp("shader", &shader);
 		pb.getTransformProp(T);
 		pb.getTextureProp("bump", &bump);
+		motion.resize(MOTION_BLUR_STEPS);
+		for (int i = 0; i < MOTION_BLUR_STEPS; i++)
+			if (!pb.getMotionTransformProp(i / double(MOTION_BLUR_STEPS - 1), motion[i])) {
+				motion.clear();
+				break;
+			}
 	}
+	void beginRender() override;
+
+private:
+	/// intersects the geometry, placed with the given transform
+	bool intersectTransformed(Transform& T, const Ray& ray, IntersectionInfo& info);
 };
 
@@ -96,7 +96,7 @@ bool RectLight::intersect(const Ray& ray, IntersectionInfo& info)
 	info.norm = Vector(0, -1, 0);
 	
 	info.ip = T.transformPoint(info.ip);
-	info.norm = T.transformDir(info.norm);
+	info.norm = T.transformNormal(info.norm);
 	info.dist = distance(ray.start, info.ip);
 
 	return true;
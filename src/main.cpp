@@ -35,424 +35,166 @@
 #include <vector>
 #include "util.h"
 #include "sdl.h"
-#include "color.h"
-#include "vector.h"
-#include "matrix.h"
 #include "camera.h"
-#include "geometry.h"
-#include "mesh.h"
 #include "scene.h"
-#include "lights.h"
-#include "shading.h"
-#include "environment.h"
 #include "random_generator.h"
-#include "cxxptl-sdl.h"
+#include "texture_cache.h"
+#include "render_stats.h"
+#include "render.h"
+#include "file_watcher.h"
+#include "distributed.h"
+#include "checkpoint.h"
 using namespace std;
 
-ThreadPool pool;
-Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
 char sceneFile[256] = "data/forest.fray";
-const double offsets[5][2] = {
-	{ 0, 0 }, 
-	{ 0.6, 0 },
-	{ 0.3, 0.3 },
-	{ 0, 0.6 },
-	{ 0.6, 0.6 },
-};
+bool watchScene = false; //!< reload the scene and render it again, whenever the scene file changes
+vector<FileWatcher*> sceneWatchers; //!< for the scene file and all the files it includes or references
+int firstFrame = -1, lastFrame = -1; //!< the frames to render, from the command line (-1 = as in the scene)
+const char* coordinatorAddress = NULL; //!< hand out the buckets to workers, which connect to this address
+const char* workerAddress = NULL;      //!< render buckets for the coordinator at this address (see distributed.h)
+bool resumeRender = false; //!< continue from the settings.checkpointFile
 
-
-bool visible(const Vector& a, const Vector& b)
+bool parseCmdLine(int argc, char** argv)
 {
-	Ray ray;
-	ray.dir = b - a;
-	ray.start = a;
-	double maxDist = distance(a, b);
-	ray.dir.normalize();
-	
-	for (auto node: scene.nodes) {
-		IntersectionInfo info;
-		if (node->intersect(ray, info) && info.dist < maxDist) {
+	bool haveScene = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--watch")) {
+			watchScene = true;
+		} else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			i++;
+			int n = sscanf(argv[i], "%d-%d", &firstFrame, &lastFrame);
+			if (n == 1) lastFrame = firstFrame;
+			if (n < 1 || firstFrame < 0 || lastFrame < firstFrame) {
+				fprintf(stderr, "Invalid frame range `%s' (expected e.g. `--frames 0-99', or `--frames 42')\n", argv[i]);
+				return false;
+			}
+		} else if (!strcmp(argv[i], "--coordinator") && i + 1 < argc) {
+			coordinatorAddress = argv[++i];
+		} else if (!strcmp(argv[i], "--worker") && i + 1 < argc) {
+			workerAddress = argv[++i];
+		} else if (!strcmp(argv[i], "--resume")) {
+			resumeRender = true;
+		} else if (argv[i][0] != '-' && !haveScene) {
+			strcpy(sceneFile, argv[i]);
+			haveScene = true;
+		} else {
+			fprintf(stderr, "Usage: fray [--watch] [--frames <first>-<last>] [--coordinator|--worker <address>] "
+			                "[--resume] [scene.fray]\n");
 			return false;
 		}
 	}
-	
 	return true;
 }
 
-void applyBumpMapping(Node& closestNode, IntersectionInfo& info)
-{
-	if (!closestNode.bump) return;
-	
-	void* interface = closestNode.bump->getInterface(BumpMapperInterface::ID);
-	if (interface) {
-		static_cast<BumpMapperInterface*>(interface)->modifyNormal(info);
-	}
-}
-
-Vector hemisphereSample(const IntersectionInfo& info)
-{
-	// we want unit resultRay (direction), such that dot(info.norm, resultRay) >= 0
-	
-	Random& rnd = getRandomGen();
-	
-	double u = rnd.randdouble();
-	double v = rnd.randdouble();
-	
-	double theta = 2 * PI * u;
-	double phi = acos(2 * v - 1);
-	
-	Vector dir(
-		sin(phi) * cos(theta),
-		cos(phi),
-		sin(phi) * sin(theta)
-	);
-	
-	// v is uniform in the unit sphere
-	
-	if (dot(dir, info.norm) > 0)
-		return dir;
-	else
-		return -dir;
-}
-
-Color explicitLightSample(const Ray& ray, const IntersectionInfo& info, const Color& pathMultiplier, Shader* shader, Random& rnd)
-{
-	// try to end a path by explicitly sampling a light. If there are no lights, we can't do that:
-	if (scene.lights.empty()) return Color(0, 0, 0);
-
-	// choose a random light:
-	int lightIdx = rnd.randint(0, scene.lights.size() - 1);
-	Light* chosenLight = scene.lights[lightIdx];
-
-	// evaluate light's solid angle as viewed from the intersection point, x:
-	Vector x = info.ip;
-	double solidAngle = chosenLight->solidAngle(info);
-
-	// is light is too small or invisible?
-	if (solidAngle == 0) return Color(0, 0, 0);
-
-	// choose a random point on the light:
-	int samplesInLight = chosenLight->getNumSamples();
-	int randSample = rnd.randint(0, samplesInLight - 1);
-
-	Vector pointOnLight;
-	Color unused;
-	chosenLight->getNthSample(randSample, x, pointOnLight, unused);
-
-	// camera -> ... path ... -> x -> lightPos
-	//                       are x and lightPos visible?
-	if (!visible(x + info.norm * 1e-6, pointOnLight))
-		return Color(0, 0, 0);
-
-	// get the emitted light energy (color * power):
-	Color L = chosenLight->getColor();
-
-
-	// evaluate BRDF. It might be zero (e.g., pure reflection), so bail out early if that's the case
-	Vector w_out = pointOnLight - x;
-	w_out.normalize();
-	Color brdfAtPoint = shader->eval(info, ray.dir, w_out);
-	if (brdfAtPoint.intensity() == 0) return Color(0, 0, 0);
-
-	// probability to hit this light's projection on the hemisphere
-	// (conditional probability, since we're specifically aiming for this light):
-	float probHitLightArea = 1.0f / solidAngle;
-
-	// probability to pick this light out of all N lights:
-	float probPickThisLight = 1.0f / scene.lights.size();
-
-	// combined probability of this generated w_out ray:
-	float chooseLightProb = probHitLightArea * probPickThisLight;
-
-	/* Light flux (Li) */ /* BRDFs@path*/  /*last BRDF*/ /*MC probability*/
-	return     L       *   pathMultiplier * brdfAtPoint / chooseLightProb;
-}
-
-Color pathtrace(const Ray& ray, Color pathMultiplier, Random& rnd)
-{
-	if (ray.depth > scene.settings.maxTraceDepth ||
-		pathMultiplier.intensity() < 0.01 
-		)
-		return Color(0, 0, 0);
-	
-	Node* closestNode = nullptr;
-	IntersectionInfo closestIntersection;
-	closestIntersection.dist = 1e99;
-	
-	for (auto node: scene.nodes) {
-		IntersectionInfo info;
-		if (node->intersect(ray, info) && info.dist < closestIntersection.dist) {
-			closestIntersection = info;
-			closestNode = node;
-		}
-	}
-	
-	bool hitLight = false;
-	Light* intersectedLight = nullptr;
-	for (auto light: scene.lights) {
-		IntersectionInfo info;
-		if (light->intersect(ray, info) && info.dist < closestIntersection.dist) {
-			hitLight = true;
-			closestIntersection = info;
-			intersectedLight = light;
-		}
-	}
-	
-	if (hitLight) {
-		if (ray.flags & RF_DIFFUSE) {
-			// forbid light contributions after a diffuse reflection
-			return Color(0, 0, 0);
-		} else {
-			return intersectedLight->getColor() * pathMultiplier;
-		}
-	}
-	
-	if (!closestNode) {
-		if (scene.environment)
-			return scene.environment->getEnvironment(ray.dir) * pathMultiplier;
-		else
-			return Color(0, 0, 0);
-	}
-		
-	applyBumpMapping(*closestNode, closestIntersection);
-	
-	Ray newRay = ray;
-	newRay.depth++;
-	newRay.start = closestIntersection.ip + closestIntersection.norm * 1e-6;
-	Color brdfColor;
-	float rayPdf;
-	closestNode->shader->spawnRay(closestIntersection, ray, newRay, brdfColor, rayPdf);
-	
-	// ("sampling the light"):
-	// try to end the current path with explicit sampling of some light
-	Color contribLight = explicitLightSample(ray, closestIntersection, pathMultiplier,
-											closestNode->shader, rnd);
-	// ("sampling the BRDF"):
-	// also try to extend the current path randomly:
-	Ray w_out = ray;
-	w_out.depth++;
-	Color brdf;
-	float pdf;
-	closestNode->shader->spawnRay(closestIntersection, ray, w_out, brdf, pdf);
-
-	if (pdf == -1) return Color(1, 0, 0); // BRDF not implemented
-	if (pdf == 0) return Color(0, 0, 0);  // BRDF is zero
-
-
-	Color contribGI = pathtrace(w_out, pathMultiplier * brdf / pdf, rnd);
-	return contribLight + contribGI;
-}
-
-Color raytrace(const Ray& ray)
-{
-	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
-	
-	Node* closestNode = nullptr;
-	IntersectionInfo closestIntersection;
-	closestIntersection.dist = 1e99;
-	
-	for (auto node: scene.nodes) {
-		IntersectionInfo info;
-		if (node->intersect(ray, info) && info.dist < closestIntersection.dist) {
-			closestIntersection = info;
-			closestNode = node;
-		}
-	}
-	
-	bool hitLight = false;
-	Light* intersectedLight = nullptr;
-	for (auto light: scene.lights) {
-		IntersectionInfo info;
-		if (light->intersect(ray, info) && info.dist < closestIntersection.dist) {
-			hitLight = true;
-			closestIntersection = info;
-			intersectedLight = light;
-		}
-	}
-	
-	if (hitLight) {
-		return intersectedLight->getColor();
-	}
-	
-	if (!closestNode) {
-		if (scene.environment) return scene.environment->getEnvironment(ray.dir);
-		else return Color(0, 0, 0);
-	}
-		
-	applyBumpMapping(*closestNode, closestIntersection);
-	
-	return closestNode->shader->shade(ray, closestIntersection);
-}
-
-inline Color trace(const Ray& ray, Random& rnd)
-{
-	if (scene.settings.gi) {
-		return pathtrace(ray, Color(1, 1, 1), rnd);
-	} else {
-		return raytrace(ray);
-	}
-}
-
-inline Ray getRay(double x, double y, WhichCamera whichCamera)
+/// applies the settings, which affect more than the scene (after it's loaded or reloaded)
+static void applySettings()
 {
-	if (scene.camera->dof)
-		return scene.camera->getDOFRay(x, y, whichCamera);
-	else
-		return scene.camera->getScreenRay(x, y, whichCamera);
+	if (scene.settings.numThreads == 0)
+		scene.settings.numThreads = get_processor_count();
+	textureCache.setBudget(scene.settings.textureCacheSize);
+	renderStats.enabled = scene.settings.collectStats;
 }
 
-Color raytraceSinglePixel(double x, double y, Random& rnd)
+/// renders the frames animationStart..animationEnd, and saves each one to the outputFile
+static void renderAnimation()
 {
-	if (scene.camera->stereoSeparation > 0) {
-		Ray leftRay = getRay(x, y, CAMERA_LEFT);
-		Ray rightRay= getRay(x, y, CAMERA_RIGHT);
-		Color colorLeft = trace(leftRay, rnd);
-		Color colorRight = trace(rightRay, rnd);
-		if (scene.settings.saturation != 1) {
-			colorLeft.adjustSaturation(scene.settings.saturation);
-			colorRight.adjustSaturation(scene.settings.saturation);
-
+	const GlobalSettings& settings = scene.settings;
+	for (int frame = settings.animationStart; frame <= settings.animationEnd && !wantToQuit; frame++) {
+		scene.setFrame(frame);
+		char caption[64];
+		snprintf(caption, sizeof(caption), "fray: rendering frame %d...", frame);
+		setWindowCaption(caption);
+		Uint32 startTicks = getTicks();
+		renderScene_threaded();
+		Uint32 elapsedMs = getTicks() - startTicks;
+		printf("Frame %d took %.2fs\n", frame, elapsedMs / 1000.0f);
+		displayVFB(vfb);
+		char filename[sizeof(settings.outputFile) + 16];
+		snprintf(filename, sizeof(filename), settings.outputFile, frame);
+		if (!takeScreenshot(filename)) {
+			fprintf(stderr, "Could not save frame %d to `%s'\n", frame, filename);
+			break;
 		}
-		return  colorLeft * scene.camera->leftMask
-		      + colorRight* scene.camera->rightMask;
-	} else {
-		return trace(getRay(x, y, CAMERA_CENTER), rnd);
 	}
+	textureCache.printStats();
+	reportStats();
 }
 
-class RendMT: public Parallel {
-	InterlockedInt cursor;
-	vector<Rect> buckets;
-	int samplesPerPixel;
-	Mutex mtx;
-public:
-	RendMT(const vector<Rect>& buckets, int samplesPerPixel): 
-		cursor(0), buckets(buckets), samplesPerPixel(samplesPerPixel) {}
-	void entry(int threadIdx, int threadCount) override
-	{
-		Random rnd = getRandomGen();
-		while (1) {
-			int buckId = (cursor++);
-			if (buckId >= int(buckets.size())) return;
-			Rect& r = buckets[buckId];
-			bool ok = true;
-			if (!scene.settings.interactive) {
-				mtx.enter();
-				ok = markRegion(r);
-				mtx.leave();
-				if (!ok) return;
-			}
-			for (int y = r.y0; y < r.y1; y++) {
-				for (int x = r.x0; x < r.x1; x++) {
-					Color avg(0, 0, 0);
-					for (int i = 0; i < samplesPerPixel; i++) {
-						Ray ray;
-						float offsetX, offsetY;
-						if (scene.camera->dof || scene.settings.gi) {
-							offsetX = rnd.randfloat();
-							offsetY = rnd.randfloat();
-						} else {
-							offsetX = offsets[i][0];
-							offsetY = offsets[i][1];
-						}
-						avg += raytraceSinglePixel(x + offsetX, y + offsetY, rnd);
-					}
-					vfb[y][x] = avg / samplesPerPixel;
-				}
-			}
-			if (!scene.settings.interactive) {
-				mtx.enter();
-				ok = displayVFBRect(r, vfb);
-				mtx.leave();
-				if (!ok) return;
-			}
-		}
-	}
-};
-
-void render()
+/// (re)starts watching the files, which the scene was loaded from
+static void watchSceneFiles()
 {
-	Random& rnd = getRandomGen();
-	scene.beginFrame();
-	const int SQUARE_SIZE = 16;
-	if (scene.settings.wantPrepass && !scene.settings.interactive) {
-		for (int y = 0; y < frameHeight(); y += SQUARE_SIZE) {
-			int ey = min(frameHeight(), y + SQUARE_SIZE);
-			int cy = (y + ey) / 2;
-			for (int x = 0; x < frameWidth(); x += SQUARE_SIZE) {
-				int ex = min(frameWidth(), x + SQUARE_SIZE);
-				int cx = (x + ex) / 2;
-				Color c = raytraceSinglePixel(cx, cy, rnd);
-				if (!drawRect(Rect(x, y, ex, ey), c))
-					return;
-			}
+	for (auto watcher: sceneWatchers) delete watcher;
+	sceneWatchers.clear();
+	for (auto& file: scene.sourceFiles) {
+		FileWatcher* watcher = new FileWatcher;
+		if (watcher->watch(file.c_str())) {
+			sceneWatchers.push_back(watcher);
+		} else {
+			fprintf(stderr, "Cannot watch `%s' for changes\n", file.c_str());
+			delete watcher;
 		}
-				
 	}
-	
-	vector<Rect> buckets = getBucketsList();
-	
-	int samplesPerPixel = COUNT_OF(offsets);
-	if (!scene.settings.wantAA) samplesPerPixel = 1;
-	if (scene.camera->dof)
-		samplesPerPixel = max(samplesPerPixel, scene.camera->numDOFSamples);
-	if (scene.settings.gi)
-		samplesPerPixel = max(samplesPerPixel, scene.settings.numPaths);
-
-	RendMT worker(buckets, samplesPerPixel);
-	
-	pool.run(&worker, scene.settings.numThreads);
 }
 
-int renderSceneThread(void* /*unused*/)
+/// parses the scene file again; the unchanged elements (e.g. meshes and textures) are kept as they are
+static bool reloadScene()
 {
-	render();
-	rendering = false;
-	return 0;
-}
-
-bool parseCmdLine(int argc, char** argv)
-{
-	if (argc == 1) return true;
-	if (argc != 2) {
-		fprintf(stderr, "Usage: fray [scene.fray]\n");
+	printf("Reloading `%s'...\n", sceneFile);
+	bool interactive = scene.settings.interactive; // (the mode can't be switched while running)
+	if (!scene.reloadScene(sceneFile)) {
+		fprintf(stderr, "Could not reload the scene; keeping the previous one\n");
 		return false;
-	} else {
-		strcpy(sceneFile, argv[1]);
-		return true;
 	}
+	scene.settings.interactive = interactive;
+	applySettings();
+	watchSceneFiles(); // (the included files may be different now)
+	return true;
 }
 
-void debugRayTrace(int x, int y)
+static bool sceneFileChanged()
 {
-	// trace a test ("debugging") ray through a clicked pixel on the screen
-	Ray ray = scene.camera->getScreenRay(x, y);
-	ray.flags |= RF_DEBUG;
-	if (scene.settings.gi)
-		pathtrace(ray, Color(1, 1, 1), getRandomGen());
-	else
-		raytrace(ray);
+	bool changed = false;
+	for (auto watcher: sceneWatchers)
+		if (watcher->hasChanged()) changed = true; // (checks all, so that none reports the same change later)
+	return changed;
 }
 
 void mainloop(void)
 {
 	SDL_ShowCursor(0);
 	bool running = true;
-	Camera& cam = *scene.camera;
 	const double MOVEMENT_PER_SEC = 20;
 	const double ROTATION_PER_SEC = 50;
 	const double SENSITIVITY = 0.1;
+	const GlobalSettings& settings = scene.settings;
+	// while the camera moves, only every pixelStep-th pixel (in x and y) is traced, so that the frame rate stays
+	// near settings.targetFrameTime. When it stops, the next frame is at full resolution:
+	int movingPixelStep = 1;
+	bool cameraMoving = false;
 
 	while (running) {
+		if (watchScene && sceneFileChanged()) reloadScene();
+		Camera& cam = *scene.camera; // (a reload may replace it)
 		Uint32 ticksSaved = SDL_GetTicks();
-		render();
-		displayVFB(vfb);
+		int pixelStep = cameraMoving ? movingPixelStep : 1;
+		double renderStart = getPreciseTime();
+		render(pixelStep);
+		double frameTime = getPreciseTime() - renderStart;
+		// the conversion and the flip overlap with rendering the next frame:
+		displayVFBAsync(vfb);
+		if (cameraMoving && settings.targetFrameTime > 0) {
+			// (the step changes the work by the square of it, so only step down, if it's safely under the target)
+			if (frameTime > settings.targetFrameTime && movingPixelStep < settings.maxPixelStep)
+				movingPixelStep++;
+			else if (movingPixelStep > 1 && frameTime * 2.5 < settings.targetFrameTime)
+				movingPixelStep--;
+		}
 		// timeDelta is how much time the frame took to render:
 		double timeDelta = (SDL_GetTicks() - ticksSaved) / 1000.0;
 		//
 		SDL_Event ev;
 
-		while (SDL_PollEvent(&ev)) {
+		while (pollEvent(&ev)) {
 			switch (ev.type) {
 				case SDL_QUIT:
 					running = false;
@@ -487,6 +229,13 @@ void mainloop(void)
 		int deltax, deltay;
 		SDL_GetRelativeMouseState(&deltax, &deltay);
 		cam.rotate(-SENSITIVITY * deltax, -SENSITIVITY*deltay);
+		
+		cameraMoving = deltax || deltay;
+		static const SDLKey movementKeys[] = {
+			SDLK_UP, SDLK_DOWN, SDLK_LEFT, SDLK_RIGHT, SDLK_KP8, SDLK_KP2, SDLK_KP4, SDLK_KP6
+		};
+		for (SDLKey key: movementKeys)
+			if (keystate[key]) cameraMoving = true;
 	}
 }
 
@@ -505,24 +254,63 @@ int main(int argc, char** argv)
 		return -3;
 	}
 
-	initGraphics(scene.settings.frameWidth, scene.settings.frameHeight, 
-				scene.settings.fullscreen);
-	
-	if (scene.settings.numThreads == 0)
-		scene.settings.numThreads = get_processor_count();
+	if (workerAddress)
+		initHeadless(scene.settings.frameWidth, scene.settings.frameHeight);
+	else
+		initGraphics(scene.settings.frameWidth, scene.settings.frameHeight, 
+					scene.settings.fullscreen);
 	
+	applySettings();
+	if (firstFrame >= 0) {
+		scene.settings.animationStart = firstFrame;
+		scene.settings.animationEnd = lastFrame;
+	}
+	if (watchScene) watchSceneFiles();
+	bool singleFrame = !workerAddress && !coordinatorAddress && !scene.settings.interactive &&
+		scene.settings.animationEnd < scene.settings.animationStart;
+	if (resumeRender && !singleFrame)
+		fprintf(stderr, "Warning: --resume only works for single, non-interactive frames (not for workers, "
+		                "coordinators or animations); ignoring it\n");
 	scene.beginRender();
-	if (!scene.settings.interactive) {
-		setWindowCaption("fray: rendering...");
-		Uint32 startTicks = getTicks();
-		renderScene_threaded();
-		Uint32 elapsedMs = getTicks() - startTicks;
-		printf("Render took %.2fs\n", elapsedMs / 1000.0f);
-		setWindowCaption("fray: rendered in %.2fs", elapsedMs / 1000.0f);
-		displayVFB(vfb);
-		if (!wantToQuit) waitForUserExit();
+	if (workerAddress) {
+		bool ok = renderWorker(workerAddress);
+		closeGraphics();
+		return ok ? 0 : -4;
+	} else if (coordinatorAddress) {
+		renderCoordinator(coordinatorAddress);
+	} else if (scene.settings.animationEnd >= scene.settings.animationStart) {
+		renderAnimation();
+	} else if (!scene.settings.interactive) {
+		if (scene.settings.checkpointFile[0])
+			checkpoint.enable(scene.settings.checkpointFile, scene.settings.checkpointInterval, resumeRender);
+		else if (resumeRender)
+			fprintf(stderr, "There's no checkpointFile in the scene's settings; nothing to resume\n");
+		while (true) {
+			setWindowCaption("fray: rendering...");
+			Uint32 startTicks = getTicks();
+			renderScene_threaded();
+			Uint32 elapsedMs = getTicks() - startTicks;
+			printf("Render took %.2fs\n", elapsedMs / 1000.0f);
+			textureCache.printStats();
+			reportStats();
+			setWindowCaption("fray: rendered in %.2fs", elapsedMs / 1000.0f);
+			displayVFB(vfb);
+			if (!watchScene) {
+				if (!wantToQuit) waitForUserExit();
+				break;
+			}
+			// render again, after the scene file is changed (and reloads successfully):
+			bool reloaded = false;
+			while (!wantToQuit && !reloaded) {
+				waitForUserExit(sceneFileChanged);
+				if (!wantToQuit) reloaded = reloadScene();
+			}
+			if (!reloaded) break;
+		}
 	} else {
 		mainloop();
+		textureCache.printStats();
+		reportStats();
 	}
 	closeGraphics();
 	printf("Exited cleanly\n");
@@ -20,13 +20,15 @@
  ***************************************************************************/
 /**
  * @File main.h
- * @Brief Raytracer main file
+ * @Brief The tracing functions, which shaders may call (implemented in render.cpp)
  */
 #pragma once
 
 #include "vector.h"
 
-bool visible(const Vector& a, const Vector& b);
+bool visible(const Vector& a, const Vector& b, double time = 0); //!< (time: as in Ray::time)
 Vector hemisphereSample(const IntersectionInfo& info);
+Color getAmbientLight(const Ray& ray, const IntersectionInfo& info);
 
-Color raytrace(const Ray& ray);
+/// traces a ray (without GI). If hitDist is given, it gets the distance to the first hit (INF if the ray escapes)
+Color raytrace(const Ray& ray, double* hitDist = nullptr);
@@ -111,7 +111,36 @@ void Transform::loadIdentity()
 {
 	offset.makeZero();
 	m.loadIdentity();
-	invM.loadIdentity();
+	update();
+}
+
+void Transform::update()
+{
+	invM = inverseMatrix(m);
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			normalM.m[i][j] = invM.m[j][i];
+	
+	bool isIdentity = true;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (m.m[i][j] != (i == j ? 1.0 : 0.0)) isIdentity = false;
+	if (isIdentity) {
+		type = offset.isZero() ? XFORM_IDENTITY : XFORM_TRANSLATE;
+		scaleFactor = 1;
+		return;
+	}
+	// m is rotation * uniform scale iff m * transpose(m) = s^2 * identity:
+	Matrix mmT;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			mmT.m[i][j] = m.m[i][0] * m.m[j][0] + m.m[i][1] * m.m[j][1] + m.m[i][2] * m.m[j][2];
+	double s2 = (mmT.m[0][0] + mmT.m[1][1] + mmT.m[2][2]) / 3;
+	type = XFORM_UNIFORM_SCALE;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (fabs(mmT.m[i][j] - (i == j ? s2 : 0.0)) > 1e-9 * s2) type = XFORM_AFFINE;
+	scaleFactor = sqrt(s2);
 }
 
 void Transform::scale(double x, double y, double z)
@@ -123,7 +152,7 @@ void Transform::scale(double x, double y, double z)
 	tmp.m[2][2] = z;
 	
 	this->m = this->m * tmp;
-	this->invM = inverseMatrix(m);
+	update();
 }
 
 void Transform::rotate(double yaw, double pitch, double roll)
@@ -131,12 +160,29 @@ void Transform::rotate(double yaw, double pitch, double roll)
 	this->m = this->m * rotationAroundZ(toRadians(roll)) * 
 	                    rotationAroundX(toRadians(pitch)) *
 	                    rotationAroundY(toRadians(yaw));
-	this->invM = inverseMatrix(m);	
+	update();
 }
 
 void Transform::translate(const Vector& t)
 {
 	offset += t;
+	update();
+}
+
+void Transform::append(const Transform& T)
+{
+	m = m * T.m;
+	offset = offset * T.m + T.offset;
+	update();
+}
+
+void Transform::interpolate(const Transform& a, const Transform& b, double t)
+{
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			m.m[i][j] = a.m.m[i][j] + (b.m.m[i][j] - a.m.m[i][j]) * t;
+	offset = a.offset + (b.offset - a.offset) * t;
+	update();
 }
 
 // use the transform:
@@ -159,3 +205,8 @@ Vector Transform::untransformDir(const Vector& dir)
 {
 	return normalize(dir * invM);
 }
+
+Vector Transform::transformNormal(const Vector& norm)
+{
+	return normalize(norm * normalM);
+}
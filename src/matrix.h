@@ -69,10 +69,21 @@ Matrix rotationAroundX(double angle); //!< returns a rotation matrix around the
 Matrix rotationAroundY(double angle); //!< same as above, but rotate around Y
 Matrix rotationAroundZ(double angle); //!< same as above, but rotate around Z
 
+/// what kind of a transform is it; Node::intersect() has a fast path for each
+enum TransformClass {
+	XFORM_IDENTITY,
+	XFORM_TRANSLATE,     //!< only an offset
+	XFORM_UNIFORM_SCALE, //!< rotation and uniform scaling (plus offset): preserves angles
+	XFORM_AFFINE,        //!< anything else (non-uniform scaling)
+};
+
 struct Transform {
 	Vector offset;
 	Matrix m;
 	Matrix invM;
+	Matrix normalM; //!< transforms normals: the inverse transpose of m
+	TransformClass type;
+	double scaleFactor; //!< for XFORM_UNIFORM_SCALE: how much are lengths scaled
 	
 	Transform()
 	{
@@ -86,6 +97,10 @@ struct Transform {
 	void scale(double x, double y, double z);
 	void rotate(double yaw, double pitch, double roll);
 	void translate(const Vector& t);
+	/// makes this transform apply `T' after itself (i.e., p -> T(this(p)))
+	void append(const Transform& T);
+	/// sets this to a blend of two transforms (their matrices and offsets are interpolated linearly; t = 0 gives a)
+	void interpolate(const Transform& a, const Transform& b, double t);
 	
 	// use the transform:
 	Vector transformPoint(const Vector& t);
@@ -94,5 +109,11 @@ struct Transform {
 	Vector transformDir(const Vector& dir);
 	Vector untransformDir(const Vector& dir);
 	
-	
+	/// transforms a normal (using the normal matrix, so that it stays perpendicular to the surface).
+	/// The result is normalized
+	Vector transformNormal(const Vector& norm);
+
+private:
+	/// recomputes invM, normalM and the classification, after m or offset change
+	void update();
 };
@@ -26,13 +26,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <iterator>
 #include <numeric>
 #include "mesh.h"
 #include "constants.h"
 #include "color.h"
 #include "bbox.h"
+#include "render_stats.h"
 using std::max;
 using std::vector;
+using std::sort;
+using std::unique;
+using std::merge;
+using std::back_inserter;
+using std::lower_bound;
+using std::upper_bound;
+using std::equal_range;
 using std::string;
 
 
@@ -78,12 +87,23 @@ void Mesh::computeBoundingGeometry()
 		bbox.add(vert);
 	}
 	
-	vector<int> allTriangles;
-	for (int i = 0; i < int(triangles.size()); i++)
-		allTriangles.push_back(i);
+	// (re-prepared after a change: the old tree refers to the old triangles, even if no new one is built)
+	if (kdRoot) delete kdRoot;
+	kdRoot = NULL;
 	
-	if (useKD && allTriangles.size() > 20) {
+	if (useKD && triangles.size() > 20) {
 		const long long start = getTicks();
+		vector<KDBuildTriangle> allTriangles(triangles.size());
+		for (int i = 0; i < int(triangles.size()); i++) {
+			allTriangles[i].index = i;
+			allTriangles[i].bounds.makeEmpty();
+			for (int j = 0; j < 3; j++) allTriangles[i].bounds.add(vertices[triangles[i].v[j]]);
+		}
+		// around vertices, shared by many triangles, SAH keeps finding "profitable" splits, which only separate
+		// the triangles by roundoff. So, don't make nodes thinner than this:
+		Vector size = bbox.vmax - bbox.vmin;
+		minSplitWidth = 1e-6 * max(max(size.x, size.y), size.z);
+		maxTreeDepth = nodeDepthSum = numNodes = 0;
 		kdRoot = new KDTreeNode;
 		buildKD(kdRoot, allTriangles, bbox, 0);
 		const long long end = getTicks();
@@ -93,6 +113,14 @@ void Mesh::computeBoundingGeometry()
 	}
 }
 
+bool Mesh::getBBox(BBox& result)
+{
+	// (don't rely on `bbox', as it's only computed in beginRender())
+	result.makeEmpty();
+	for (auto& vert: vertices) result.add(vert);
+	return !vertices.empty();
+}
+
 Mesh::~Mesh()
 {
 	if (kdRoot)
@@ -101,6 +129,7 @@ Mesh::~Mesh()
 
 bool Mesh::intersectTriangle(const Ray& ray, const Triangle& T, IntersectionInfo& info)
 {
+	countStat(STAT_TRIANGLE_TESTS);
 	double lambda2, lambda3;
 	// backface culling?
 	if (backfaceCulling && dot(ray.dir, T.gnormal) > 0) return false;
@@ -134,6 +163,8 @@ bool Mesh::intersectTriangle(const Ray& ray, const Triangle& T, IntersectionInfo
 		}
 		info.dNdx = T.dNdx;
 		info.dNdy = T.dNdy;
+		info.dpdu = T.dpdu;
+		info.dpdv = T.dpdv;
 		return true;
 	}
 	
@@ -145,14 +176,15 @@ bool Mesh::intersect(const Ray& _ray, IntersectionInfo& info)
 {
 	RRay ray(_ray);
 	ray.prepareForTracing();
-	if (!bbox.testIntersect(ray))
+	double tmin, tmax;
+	if (!bbox.intersectSlabs(ray, tmin, tmax))
 		return false;
 	
 	info.dist = INF;
 	bool found = false;
 	
 	if (useKD && kdRoot) {
-		found = intersectKD(ray, info, *kdRoot, bbox);
+		found = intersectKD(ray, info, *kdRoot, bbox, tmax);
 	} else {
 		for (auto& T: triangles) {
 			if (intersectTriangle(ray, T, info)) {
@@ -206,6 +238,10 @@ bool Mesh::loadFromOBJ(const char* filename)
 
 	if (!f) return false;
 
+	vertices.clear();
+	uvs.clear();
+	normals.clear();
+	triangles.clear();
 	vertices.push_back(Vector(0, 0, 0));
 	uvs.push_back(Vector(0, 0, 0));
 	normals.push_back(Vector(0, 0, 0));
@@ -258,15 +294,17 @@ bool Mesh::loadFromOBJ(const char* filename)
 }
 
 
-static void solve2D(Vector A, Vector B, Vector C, double& x, double& y)
+static bool solve2D(Vector A, Vector B, Vector C, double& x, double& y)
 {
 	// solve: x * A + y * B = C
 	double mat[2][2] = { { A.x, B.x }, { A.y, B.y } };
 	double h[2] = { C.x, C.y };
 
 	double Dcr = mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
+	if (fabs(Dcr) < 1e-12) return false; // degenerate UV mapping
 	x =         (     h[0] * mat[1][1] -      h[1] * mat[0][1]) / Dcr;
 	y =         (mat[0][0] *      h[1] - mat[1][0] *      h[0]) / Dcr;
+	return true;
 }
 
 
@@ -285,7 +323,9 @@ void Mesh::prepareTriangles()
 		t.ABcrossAC = t.gnormal;
 		t.gnormal.normalize();
 		
-		if (!uvs.empty() && !normals.empty()) {
+		t.dpdu.makeZero();
+		t.dpdv.makeZero();
+		if (!uvs.empty()) {
 			Vector tA = uvs[t.t[0]];
 			Vector tB = uvs[t.t[1]];
 			Vector tC = uvs[t.t[2]];
@@ -294,15 +334,16 @@ void Mesh::prepareTriangles()
 			Vector tAC = tC - tA;
 			
 			double px, qx, py, qy;
-			solve2D(tAB, tAC, Vector(1, 0, 0), px, qx);
 			// px * tAB + qx * tAC = (1, 0, 0)
-			solve2D(tAB, tAC, Vector(0, 1, 0), py, qy);
 			// py * tAB + qy * tAC = (0, 1, 0)
-			
-			t.dNdx = px * AB + qx * AC;
-			t.dNdy = py * AB + qy * AC;
-			t.dNdx.normalize();
-			t.dNdy.normalize();
+			if (solve2D(tAB, tAC, Vector(1, 0, 0), px, qx) && solve2D(tAB, tAC, Vector(0, 1, 0), py, qy)) {
+				t.dpdu = px * AB + qx * AC;
+				t.dpdv = py * AB + qy * AC;
+			}
+		}
+		if (!normals.empty() && !t.dpdu.isZero()) {
+			t.dNdx = normalize(t.dpdu);
+			t.dNdy = normalize(t.dpdv);
 		} else {
 			t.dNdx.makeZero();
 			t.dNdy.makeZero();
@@ -312,50 +353,115 @@ void Mesh::prepareTriangles()
 	printf("Mesh loaded, %d triangles\n", int(triangles.size()));
 }
 
-inline double findOptimalSplitPlane(const vector<int>& triangleIndices, BBox bbox, Axis axis)
+bool Mesh::findSAHSplit(const vector<KDBuildTriangle>& items, const BBox& bbox, Axis& bestAxis, double& bestPos)
 {
-	return (bbox.vmin[int(axis)] + bbox.vmax[int(axis)]) * 0.5; // <- this could be improved a lot!
+	int n = int(items.size());
+	double bestCost = KD_INTERSECT_COST * n; // the cost of a leaf
+	bool found = false;
+	Vector size = bbox.vmax - bbox.vmin;
+	double invArea = 1.0 / (2 * (size.x * size.y + size.y * size.z + size.z * size.x));
+	
+	vector<double> mins(n), maxs(n), planars, candidates;
+	for (int axis = 0; axis < 3; axis++) {
+		// the candidate planes are at the sides of the (clipped) triangle bounds ("perfect splits").
+		// A triangle goes to the left if it extends below the plane, or lies in it; to the right if it extends above it.
+		planars.clear();
+		candidates.clear();
+		for (int i = 0; i < n; i++) {
+			mins[i] = items[i].bounds.vmin[axis];
+			maxs[i] = items[i].bounds.vmax[axis];
+			if (mins[i] == maxs[i]) planars.push_back(mins[i]);
+		}
+		sort(mins.begin(), mins.end());
+		sort(maxs.begin(), maxs.end());
+		sort(planars.begin(), planars.end());
+		merge(mins.begin(), mins.end(), maxs.begin(), maxs.end(), back_inserter(candidates));
+		candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+		
+		int u = (axis + 1) % 3, v = (axis + 2) % 3;
+		double crossArea = size[u] * size[v];
+		double perimeter = size[u] + size[v];
+		for (double pos: candidates) {
+			if (pos - bbox.vmin[axis] < minSplitWidth || bbox.vmax[axis] - pos < minSplitWidth) continue;
+			auto planar = equal_range(planars.begin(), planars.end(), pos);
+			int numLeft = int(lower_bound(mins.begin(), mins.end(), pos) - mins.begin()) + int(planar.second - planar.first);
+			int numRight = n - int(upper_bound(maxs.begin(), maxs.end(), pos) - maxs.begin());
+			double leftArea  = 2 * (crossArea + perimeter * (pos - bbox.vmin[axis]));
+			double rightArea = 2 * (crossArea + perimeter * (bbox.vmax[axis] - pos));
+			double cost = KD_TRAVERSAL_COST +
+				KD_INTERSECT_COST * invArea * (leftArea * numLeft + rightArea * numRight);
+			if (numLeft == 0 || numRight == 0) cost *= 1 - KD_EMPTY_BONUS;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = Axis(axis);
+				bestPos = pos;
+				found = true;
+			}
+		}
+	}
+	return found;
 }
 
-void Mesh::buildKD(KDTreeNode* node, const vector<int>& triangleIndices, BBox bbox, int depth)
+void Mesh::buildKD(KDTreeNode* node, const vector<KDBuildTriangle>& items, const BBox& bbox, int depth)
 {
 	numNodes++;
 	maxTreeDepth = max(maxTreeDepth, depth);
-	if (int(triangleIndices.size()) <= MAX_TRIANGLES_PER_LEAF || depth > MAX_DEPTH) {
-		// make a leaf node:
+	
+	Axis axis = Axis(depth % 3);
+	double splitPos = (bbox.vmin[int(axis)] + bbox.vmax[int(axis)]) * 0.5;
+	bool isLeaf;
+	if (useSAH)
+		isLeaf = depth > MAX_DEPTH || !findSAHSplit(items, bbox, axis, splitPos);
+	else
+		isLeaf = int(items.size()) <= MAX_TRIANGLES_PER_LEAF || depth > MAX_DEPTH;
+	
+	if (isLeaf) {
+		vector<int> triangleIndices;
+		for (auto& item: items) triangleIndices.push_back(item.index);
 		node->initLeafNode(triangleIndices);
 		nodeDepthSum += depth;
 		return;
 	}
 	
 	node->initBinaryNode();
-	node->axis = Axis(depth % 3);
-	node->splitPos = findOptimalSplitPlane(triangleIndices, bbox, node->axis);
+	node->axis = axis;
+	node->splitPos = splitPos;
 	
 	BBox leftbbox, rightbbox;
 	bbox.split(node->axis, node->splitPos, leftbbox, rightbbox);
 	
-	vector<int> leftTriangles, rightTriangles;
-	for (auto& ti: triangleIndices) {
-		Triangle& T = triangles[ti];
-		const Vector& A = vertices[T.v[0]];
-		const Vector& B = vertices[T.v[1]];
-		const Vector& C = vertices[T.v[2]];
-		
-		if (leftbbox.intersectTriangle(A, B, C))
-			leftTriangles.push_back(ti);
-		
-		if (rightbbox.intersectTriangle(A, B, C))
-			rightTriangles.push_back(ti);
+	// the bounds of a triangle are already clipped to this node, so if it's on one side of the plane, they're
+	// the same in the child. Straddling triangles are clipped again, to each child.
+	vector<KDBuildTriangle> leftItems, rightItems;
+	const int a = int(axis);
+	for (auto& item: items) {
+		bool planar = item.bounds.vmin[a] == item.bounds.vmax[a];
+		bool toLeft  = item.bounds.vmin[a] < splitPos || (planar && item.bounds.vmin[a] == splitPos);
+		bool toRight = item.bounds.vmax[a] > splitPos;
+		if (toLeft && toRight) {
+			const Triangle& T = triangles[item.index];
+			const Vector& A = vertices[T.v[0]];
+			const Vector& B = vertices[T.v[1]];
+			const Vector& C = vertices[T.v[2]];
+			KDBuildTriangle part;
+			part.index = item.index;
+			if (leftbbox.clipTriangle(A, B, C, part.bounds)) leftItems.push_back(part);
+			if (rightbbox.clipTriangle(A, B, C, part.bounds)) rightItems.push_back(part);
+		} else if (toLeft) {
+			leftItems.push_back(item);
+		} else {
+			rightItems.push_back(item);
+		}
 	}
 	
-	buildKD(&node->children[0], leftTriangles, leftbbox, depth + 1);
-	buildKD(&node->children[1], rightTriangles, rightbbox, depth + 1);
+	buildKD(&node->children[0], leftItems, leftbbox, depth + 1);
+	buildKD(&node->children[1], rightItems, rightbbox, depth + 1);
 	nodeDepthSum += depth;
 }
 
-bool Mesh::intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node, const BBox& bbox)
+bool Mesh::intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node, const BBox& bbox, double tmax)
 {
+	countStat(STAT_KD_NODES);
 	// is it leaf?
 	if (node.isLeafNode()) {
 		bool found = false;
@@ -365,7 +471,8 @@ bool Mesh::intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node
 				found = true;
 		}
 		
-		return found && bbox.inside(info.ip);
+		// the hit only counts if it's within the node (a triangle may stick out into nodes, which come later):
+		return found && info.dist <= tmax;
 	}
 	
 	// binary node:
@@ -384,9 +491,10 @@ bool Mesh::intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node
 		traverseOrder[1] = 0;
 	}
 	
-	for (int childId: traverseOrder) {		
-		if (childBBoxen[childId].testIntersect(ray)) {
-			if (intersectKD(ray, info, node.children[childId], childBBoxen[childId]))
+	for (int childId: traverseOrder) {
+		double childTMin, childTMax;
+		if (childBBoxen[childId].intersectSlabs(ray, childTMin, childTMax)) {
+			if (intersectKD(ray, info, node.children[childId], childBBoxen[childId], childTMax))
 				return true;
 		}
 	}
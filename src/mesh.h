@@ -52,6 +52,12 @@ struct KDTreeNode {
 	inline bool isLeafNode() const { return axis == Axis::AXIS_NONE; }
 };
 
+/// a triangle, while building the KD tree, along with the bounds of its part, which is inside the current node
+struct KDBuildTriangle {
+	int index;
+	BBox bounds;
+};
+
 class Mesh: public Geometry {
 protected:
 	std::vector<Vector> vertices;
@@ -62,16 +68,21 @@ protected:
 	BBox bbox;
 	KDTreeNode* kdRoot = nullptr;
 	int maxTreeDepth = 0, nodeDepthSum = 0, numNodes = 0;
+	double minSplitWidth = 0;
 
 	void computeBoundingGeometry();
 	void prepareTriangles();
 	bool intersectTriangle(const Ray& ray, const Triangle& T, IntersectionInfo& info);
-	void buildKD(KDTreeNode* node, const std::vector<int>& triangleIndices, BBox bbox, int depth);
-	bool intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node, const BBox& bbox);
+	void buildKD(KDTreeNode* node, const std::vector<KDBuildTriangle>& items, const BBox& bbox, int depth);
+	/// finds the split with the least SAH cost. @returns false, if a leaf is cheaper than any split
+	bool findSAHSplit(const std::vector<KDBuildTriangle>& items, const BBox& bbox, Axis& axis, double& splitPos);
+	/// @param tmax - where the ray exits the node's bbox (as in BBox::intersectSlabs())
+	bool intersectKD(const RRay& ray, IntersectionInfo& info, KDTreeNode& node, const BBox& bbox, double tmax);
 public:
 
 	bool faceted = false;
 	bool useKD = true;
+	bool useSAH = false; //!< build the KD tree with the surface area heuristic (otherwise: median splits)
 	bool backfaceCulling = true;
 
 	~Mesh();
@@ -89,6 +100,7 @@ public:
 		pb.getBoolProp("faceted", &faceted);
 		pb.getBoolProp("backfaceCulling", &backfaceCulling);
 		pb.getBoolProp("useKDTree", &useKD);
+		pb.getBoolProp("useSAH", &useSAH);
 	}
 
 
@@ -97,4 +109,5 @@ public:
 	void beginRender() override;
 
 	bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	bool getBBox(BBox& bbox) override;
 };
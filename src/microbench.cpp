@@ -0,0 +1,347 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File microbench.cpp
+ * @Brief fray-microbench: times the intersection kernels in isolation, on fixed sets of rays
+ *
+ * The rays are generated once (from a fixed seed), around the bounding box of an OBJ mesh. Each kernel is then
+ * run over the whole set several times, single-threaded, and the fastest pass is reported; this is much more
+ * stable than timing whole renders, so it's the one to use when changing a single kernel.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "util.h"
+#include "vector.h"
+#include "bbox.h"
+#include "triangle.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "random_generator.h"
+using namespace std;
+
+/// gives the benchmark access to the mesh internals (the triangles, the KD tree)
+class BenchMesh: public Mesh {
+public:
+	int getNumTriangles() const { return int(triangles.size()); }
+	const Triangle& getTriangle(int i) const { return triangles[i]; }
+	const Vector& getVertex(int i) const { return vertices[i]; }
+	const BBox& getBounds() const { return bbox; }
+	bool hasKD() const { return kdRoot != nullptr; }
+	
+	/// the same as Mesh::intersect(), but without the RRay setup
+	bool traceKD(const RRay& ray, IntersectionInfo& info)
+	{
+		double tmin, tmax;
+		if (!bbox.intersectSlabs(ray, tmin, tmax)) return false;
+		info.dist = INF;
+		return intersectKD(ray, info, *kdRoot, bbox, tmax);
+	}
+};
+
+/// the meshes, which are tested if none are given on the command line (relative to the repository root). The walls of
+/// the Cornell box (data/cornell) are left out: they're a few triangles each, too small for a KD tree
+static const char* defaultMeshes[] = {
+	"data/geom/3pyramid.obj",
+	"data/geom/heart.obj",
+	"data/geom/leaf.obj",
+	"data/geom/newwine.obj",
+	"data/geom/teapot_lowres.obj",
+	"data/geom/teapot_hires.obj",
+	"data/geom/truncated_cube.obj",
+	"data/hw9/axe_lo.obj",
+	"data/hw9/fig1.obj",
+	"data/hw9/fig2.obj",
+	"data/hw9/fig3.obj",
+	"data/hw9/fig4.obj",
+	"data/hw9/fig5.obj",
+	"data/hw9/dragon.obj",
+	"data/hw10/medusa.obj",
+};
+
+struct MicroOptions {
+	vector<string> meshFiles;
+	int numRays = 65536;
+	int repeat = 5;
+	unsigned seed = 42;
+	string csvFile;
+};
+
+struct RaySet {
+	const char* name;
+	vector<RRay> rays;
+};
+
+struct MicroResult {
+	string mesh, kernel, raySet;
+	double nsPerRay;
+	double mraysPerSec;
+	double hitPercent;
+};
+
+static RRay makeRay(const Vector& start, const Vector& dir)
+{
+	RRay ray(Ray(start, dir));
+	ray.dir.normalize();
+	ray.prepareForTracing();
+	return ray;
+}
+
+static Vector randomPointInBox(Random& rnd, const BBox& box)
+{
+	Vector size = box.vmax - box.vmin;
+	return box.vmin + Vector(rnd.randdouble() * size.x, rnd.randdouble() * size.y, rnd.randdouble() * size.z);
+}
+
+/// primary rays from a pinhole camera in front of the mesh, which just covers its bounding box
+static void generateCameraRays(const BBox& box, int n, RaySet& set)
+{
+	Vector center = (box.vmin + box.vmax) * 0.5;
+	double radius = (box.vmax - box.vmin).length() * 0.5;
+	Vector eye = center + Vector(0.3, 0.4, -2.5) * radius;
+	Vector front = center - eye;
+	front.normalize();
+	Vector right = Vector(0, 1, 0) ^ front;
+	right.normalize();
+	Vector up = front ^ right;
+	int side = max(1, int(sqrt(double(n))));
+	double halfFov = 1.1 * radius / (center - eye).length();
+	for (int y = 0; y < side; y++)
+		for (int x = 0; x < side; x++) {
+			double sx = ((x + 0.5) / side * 2 - 1) * halfFov;
+			double sy = (1 - (y + 0.5) / side * 2) * halfFov;
+			set.rays.push_back(makeRay(eye, front + right * sx + up * sy));
+		}
+}
+
+/// incoherent rays: from random points on a sphere around the mesh, towards random points inside its box
+static void generateRandomRays(Random& rnd, const BBox& box, int n, RaySet& set)
+{
+	Vector center = (box.vmin + box.vmax) * 0.5;
+	double radius = (box.vmax - box.vmin).length();
+	for (int i = 0; i < n; i++) {
+		Vector dir;
+		do {
+			dir = Vector(rnd.randdouble() * 2 - 1, rnd.randdouble() * 2 - 1, rnd.randdouble() * 2 - 1);
+		} while (dir.lengthSqr() > 1 || dir.lengthSqr() < 1e-6);
+		dir.normalize();
+		Vector start = center + dir * radius;
+		set.rays.push_back(makeRay(start, randomPointInBox(rnd, box) - start));
+	}
+}
+
+/// shadow rays: from random points on the mesh surface, towards a point light above it
+static void generateShadowRays(Random& rnd, const BenchMesh& mesh, int n, RaySet& set)
+{
+	const BBox& box = mesh.getBounds();
+	Vector center = (box.vmin + box.vmax) * 0.5;
+	Vector light = center + Vector(1, 2, -1.5) * (box.vmax - box.vmin).length();
+	for (int i = 0; i < n; i++) {
+		const Triangle& T = mesh.getTriangle(rnd.randint(0, mesh.getNumTriangles() - 1));
+		double u = rnd.randdouble(), v = rnd.randdouble();
+		if (u + v > 1) { u = 1 - u; v = 1 - v; }
+		const Vector& A = mesh.getVertex(T.v[0]);
+		Vector start = A + T.AB * u + T.AC * v + T.gnormal * 1e-6;
+		set.rays.push_back(makeRay(start, light - start));
+	}
+}
+
+/// runs `kernel' over all rays, `repeat' times; records the fastest pass.
+/// `raysPerCall' is the number of ray queries that a single call does (e.g. a ray against several triangles).
+/// The kernel returns the number of hits (which is also used to keep the compiler from dropping the work)
+template <typename Kernel>
+static MicroResult runKernel(const char* name, const RaySet& set, int raysPerCall, int repeat, Kernel kernel)
+{
+	long long hits = 0;
+	double best = INF;
+	for (int pass = 0; pass <= repeat; pass++) { // (pass 0 is a warm-up)
+		hits = 0;
+		double start = getPreciseTime();
+		for (auto& ray: set.rays) hits += kernel(ray);
+		double elapsed = getPreciseTime() - start;
+		if (pass > 0) best = min(best, elapsed);
+	}
+	double queries = double(set.rays.size()) * raysPerCall;
+	MicroResult result;
+	result.kernel = name;
+	result.raySet = set.name;
+	result.nsPerRay = best / queries * 1e9;
+	result.mraysPerSec = best > 0 ? queries / best * 1e-6 : 0;
+	result.hitPercent = 100.0 * hits / queries;
+	return result;
+}
+
+static bool writeCSV(const char* filename, const vector<MicroResult>& results, const MicroOptions& opt)
+{
+	FILE* f = fopen(filename, "wt");
+	if (!f) return false;
+	fprintf(f, "kernel,rays,mesh,count,ns_per_ray,mrays_per_s,hit_percent\n");
+	for (auto& r: results)
+		fprintf(f, "%s,%s,%s,%d,%.3f,%.4f,%.2f\n", r.kernel.c_str(), r.raySet.c_str(), r.mesh.c_str(),
+			opt.numRays, r.nsPerRay, r.mraysPerSec, r.hitPercent);
+	fclose(f);
+	return true;
+}
+
+/// times all the kernels against a mesh (and the primitives, sized to it); adds the results to `results'.
+/// @returns false if the mesh can't be loaded, or is too small
+static bool benchMesh(const string& meshFile, const MicroOptions& opt, vector<MicroResult>& results)
+{
+	BenchMesh mesh;
+	if (!mesh.loadFromOBJ(meshFile.c_str())) {
+		fprintf(stderr, "fray-microbench: cannot load the mesh `%s'\n", meshFile.c_str());
+		return false;
+	}
+	mesh.beginRender();
+	if (mesh.getNumTriangles() == 0 || !mesh.hasKD()) {
+		fprintf(stderr, "fray-microbench: the mesh `%s' is too small (skipped)\n", meshFile.c_str());
+		return false;
+	}
+	const BBox& box = mesh.getBounds();
+	Vector center = (box.vmin + box.vmax) * 0.5;
+	Vector halfSize = (box.vmax - box.vmin) * 0.5;
+	double radius = halfSize.length();
+	
+	// the analytic primitives are sized to the mesh, so that the ray sets hit them in a similar way:
+	Sphere sphere(center, radius * 0.6);
+	Cube cube(center, max(max(halfSize.x, halfSize.y), halfSize.z));
+	Sphere hole(center + Vector(0, halfSize.y, 0), radius * 0.5);
+	CsgMinus csg;
+	csg.left = &cube;
+	csg.right = &hole;
+	csg.beginRender();
+	// the same sphere as above, but defined in local coordinates, and placed with a transform:
+	Sphere unitSphere;
+	Node node;
+	node.geometry = &unitSphere;
+	node.T.scale(radius * 0.6);
+	node.T.translate(center);
+	
+	initRandom(opt.seed);
+	Random& rnd = getRandomGen(0);
+	RaySet sets[3];
+	sets[0].name = "camera";
+	generateCameraRays(box, opt.numRays, sets[0]);
+	sets[1].name = "random";
+	generateRandomRays(rnd, box, opt.numRays, sets[1]);
+	sets[2].name = "shadow";
+	generateShadowRays(rnd, mesh, opt.numRays, sets[2]);
+	
+	// for the triangle kernel, each ray is tested against a fixed handful of triangles, spread over the mesh:
+	const int NUM_TEST_TRIANGLES = 16;
+	vector<int> testTriangles;
+	for (int i = 0; i < NUM_TEST_TRIANGLES; i++)
+		testTriangles.push_back(int((long long) i * mesh.getNumTriangles() / NUM_TEST_TRIANGLES));
+	
+	printf("%s: %d triangles, %d rays per set, best of %d passes\n", meshFile.c_str(), mesh.getNumTriangles(),
+		int(sets[0].rays.size()), opt.repeat);
+	printf("%-24s %-8s %10s %10s %7s\n", "kernel", "rays", "ns/ray", "Mrays/s", "hit%");
+	auto report = [&results, &meshFile] (MicroResult r) {
+		r.mesh = meshFile;
+		printf("%-24s %-8s %10.2f %10.3f %7.2f\n", r.kernel.c_str(), r.raySet.c_str(), r.nsPerRay, r.mraysPerSec,
+			r.hitPercent);
+		fflush(stdout);
+		results.push_back(r);
+	};
+	
+	for (auto& set: sets) {
+		report(runKernel("Triangle::intersectFast", set, NUM_TEST_TRIANGLES, opt.repeat, [&] (const RRay& ray) {
+			int hits = 0;
+			for (int idx: testTriangles) {
+				const Triangle& T = mesh.getTriangle(idx);
+				double dist = INF, l2, l3;
+				hits += T.intersectFast(ray, mesh.getVertex(T.v[0]), dist, l2, l3);
+			}
+			return hits;
+		}));
+		report(runKernel("BBox::testIntersect", set, 1, opt.repeat, [&] (const RRay& ray) {
+			return int(box.testIntersect(ray));
+		}));
+		report(runKernel("Mesh::intersectKD", set, 1, opt.repeat, [&] (const RRay& ray) {
+			IntersectionInfo info;
+			return int(mesh.traceKD(ray, info));
+		}));
+		report(runKernel("Sphere::intersect", set, 1, opt.repeat, [&] (const RRay& ray) {
+			IntersectionInfo info;
+			return int(sphere.intersect(ray, info));
+		}));
+		report(runKernel("CsgOp::intersect", set, 1, opt.repeat, [&] (const RRay& ray) {
+			IntersectionInfo info;
+			return int(csg.intersect(ray, info));
+		}));
+		report(runKernel("Node::intersect", set, 1, opt.repeat, [&] (const RRay& ray) {
+			IntersectionInfo info;
+			return int(node.intersect(ray, info));
+		}));
+	}
+	printf("\n");
+	return true;
+}
+
+static void printUsage()
+{
+	fprintf(stderr,
+		"Usage: fray-microbench [options]\n"
+		"Options:\n"
+		"  --mesh FILE      an OBJ mesh to test against (may be repeated; default: all the bundled ones)\n"
+		"  --rays N         rays per set (default 65536)\n"
+		"  --repeat N       timed passes per kernel; the fastest one is reported (default 5)\n"
+		"  --seed S         random seed for the ray sets (default 42)\n"
+		"  --csv FILE       save the results\n");
+}
+
+int main(int argc, char** argv)
+{
+	MicroOptions opt;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--mesh" && hasValue) opt.meshFiles.push_back(argv[++i]);
+		else if (arg == "--rays" && hasValue) opt.numRays = atoi(argv[++i]);
+		else if (arg == "--repeat" && hasValue) opt.repeat = atoi(argv[++i]);
+		else if (arg == "--seed" && hasValue) opt.seed = unsigned(atol(argv[++i]));
+		else if (arg == "--csv" && hasValue) opt.csvFile = argv[++i];
+		else {
+			printUsage();
+			return -1;
+		}
+	}
+	if (opt.numRays < 1 || opt.repeat < 1) {
+		printUsage();
+		return -1;
+	}
+	
+	if (opt.meshFiles.empty())
+		for (auto m: defaultMeshes) opt.meshFiles.push_back(m);
+	
+	vector<MicroResult> results;
+	int numTested = 0;
+	for (auto& meshFile: opt.meshFiles)
+		if (benchMesh(meshFile, opt, results)) numTested++;
+	
+	if (!opt.csvFile.empty() && !writeCSV(opt.csvFile.c_str(), results, opt))
+		fprintf(stderr, "fray-microbench: cannot write `%s'\n", opt.csvFile.c_str());
+	return numTested > 0 ? 0 : -1;
+}
@@ -0,0 +1,238 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File mipmap.cpp
+ * @Brief Implementation of the MipMap class
+ */
+#include <string.h>
+#include <algorithm>
+#include "mipmap.h"
+#include "constants.h"
+#include "util.h"
+using namespace std;
+
+bool parseTextureFilter(const char* name, TextureFilter& filter)
+{
+	static const struct {
+		const char* name;
+		TextureFilter filter;
+	} FILTERS[] = {
+		{ "nearest",     FILTER_NEAREST },
+		{ "bilinear",    FILTER_BILINEAR },
+		{ "trilinear",   FILTER_TRILINEAR },
+		{ "anisotropic", FILTER_ANISOTROPIC },
+	};
+	for (auto& f: FILTERS) {
+		if (!strcmp(f.name, name)) {
+			filter = f.filter;
+			return true;
+		}
+	}
+	return false;
+}
+
+MipMap::~MipMap()
+{
+	freeLevels();
+}
+
+void MipMap::freeLevels()
+{
+	for (int i = 1; i < int(levels.size()); i++)
+		delete levels[i];
+	levels.clear();
+	numLevels = 0;
+}
+
+void MipMap::build(const Bitmap& bmp)
+{
+	freeLevels();
+	if (!bmp.isOK()) return;
+	levels.push_back(&bmp);
+	while ((levels.back()->getWidth() > 1 || levels.back()->getHeight() > 1) && int(levels.size()) < MAX_MIP_LEVELS) {
+		const Bitmap& src = *levels.back();
+		int srcW = src.getWidth(), srcH = src.getHeight();
+		int w = max(1, srcW / 2), h = max(1, srcH / 2);
+		Bitmap* level = new Bitmap;
+		// the levels keep the storage format of the original (the alpha isn't used in filtering, though)
+		level->generateEmptyImage(w, h, src.getFormat() == PIXEL_RGBA8 ? PIXEL_RGB8 : src.getFormat());
+		// box filter; for odd sizes, some of the destination texels cover three source texels
+		for (int y = 0; y < h; y++) {
+			int sy0 = y * srcH / h, sy1 = (y + 1) * srcH / h;
+			for (int x = 0; x < w; x++) {
+				int sx0 = x * srcW / w, sx1 = (x + 1) * srcW / w;
+				Color sum(0, 0, 0);
+				for (int sy = sy0; sy < sy1; sy++)
+					for (int sx = sx0; sx < sx1; sx++)
+						sum += src.getPixel(sx, sy);
+				level->setPixel(x, y, sum / float((sx1 - sx0) * (sy1 - sy0)));
+			}
+		}
+		levels.push_back(level);
+	}
+	numLevels = int(levels.size());
+	for (int i = 0; i < numLevels; i++) {
+		levelWidth[i] = levels[i]->getWidth();
+		levelHeight[i] = levels[i]->getHeight();
+	}
+}
+
+static inline int wrapAround(int x, int size)
+{
+	x %= size;
+	return x < 0 ? x + size : x;
+}
+
+static inline int clampToEdge(int x, int size)
+{
+	return x < 0 ? 0 : (x >= size ? size - 1 : x);
+}
+
+Color MipMapBase::texel(int level, int x, int y) const
+{
+	int h = levelHeight[level];
+	return fetchTexel(level, wrapAround(x, levelWidth[level]), clampT ? clampToEdge(y, h) : wrapAround(y, h));
+}
+
+Color MipMapBase::bilinear(int level, double s, double t) const
+{
+	int w = levelWidth[level], h = levelHeight[level];
+	double x = s * w - 0.5;
+	double y = t * h - 0.5;
+	double fx0 = floor(x), fy0 = floor(y);
+	float fx = float(x - fx0), fy = float(y - fy0);
+	int x0 = wrapAround(int(fx0), w);
+	int x1 = (x0 + 1 == w) ? 0 : x0 + 1;
+	int y0, y1;
+	if (clampT) {
+		y0 = clampToEdge(int(fy0), h);
+		y1 = clampToEdge(int(fy0) + 1, h);
+	} else {
+		y0 = wrapAround(int(fy0), h);
+		y1 = (y0 + 1 == h) ? 0 : y0 + 1;
+	}
+	return fetchTexel(level, x0, y0) * ((1 - fx) * (1 - fy)) +
+	       fetchTexel(level, x1, y0) * (fx       * (1 - fy)) +
+	       fetchTexel(level, x0, y1) * ((1 - fx) * fy      ) +
+	       fetchTexel(level, x1, y1) * (fx       * fy      );
+}
+
+Color MipMapBase::trilinear(double s, double t, double width) const
+{
+	double level = log2(max(width, 1e-8));
+	int lastLevel = numLevels - 1;
+	if (level <= 0) return bilinear(0, s, t);
+	if (level >= lastLevel) return bilinear(lastLevel, s, t);
+	int intLevel = int(floor(level));
+	float frac = float(level - intLevel);
+	return bilinear(intLevel, s, t) * (1 - frac) + bilinear(intLevel + 1, s, t) * frac;
+}
+
+// Elliptically weighted average (Heckbert), with a gaussian filter
+Color MipMapBase::ewa(int level, double s, double t, double ds0, double dt0, double ds1, double dt1) const
+{
+	const int lastLevel = numLevels - 1;
+	if (level >= lastLevel) return bilinear(lastLevel, s, t);
+	// convert to the texel space of this level:
+	s = s * levelWidth[level] - 0.5;
+	t = t * levelHeight[level] - 0.5;
+	ds0 *= levelWidth[level];
+	ds1 *= levelWidth[level];
+	dt0 *= levelHeight[level];
+	dt1 *= levelHeight[level];
+	// the implicit ellipse equation: A*s^2 + B*s*t + C*t^2 = 1
+	double A = dt0 * dt0 + dt1 * dt1 + 1;
+	double B = -2 * (ds0 * dt0 + ds1 * dt1);
+	double C = ds0 * ds0 + ds1 * ds1 + 1;
+	double invF = 1 / (A * C - B * B * 0.25);
+	A *= invF;
+	B *= invF;
+	C *= invF;
+	// the bounding box of the ellipse:
+	double det = -B * B + 4 * A * C;
+	double invDet = 1 / det;
+	double uSqrt = sqrt(det * C), vSqrt = sqrt(A * det);
+	int s0 = int(ceil (s - 2 * invDet * uSqrt));
+	int s1 = int(floor(s + 2 * invDet * uSqrt));
+	int t0 = int(ceil (t - 2 * invDet * vSqrt));
+	int t1 = int(floor(t + 2 * invDet * vSqrt));
+	
+	const double ALPHA = 2;
+	const double expAlpha = exp(-ALPHA);
+	Color sum(0, 0, 0);
+	double sumWeights = 0;
+	for (int it = t0; it <= t1; it++) {
+		double tt = it - t;
+		for (int is = s0; is <= s1; is++) {
+			double ss = is - s;
+			double r2 = A * ss * ss + B * ss * tt + C * tt * tt;
+			if (r2 < 1) {
+				double weight = exp(-ALPHA * r2) - expAlpha;
+				sum += texel(level, is, it) * float(weight);
+				sumWeights += weight;
+			}
+		}
+	}
+	if (sumWeights <= 0) return bilinear(level, s, t);
+	return sum / float(sumWeights);
+}
+
+Color MipMapBase::sample(TextureFilter filter, double s, double t,
+                     double dsdx, double dtdx, double dsdy, double dtdy) const
+{
+	if (numLevels == 0) return Color(0, 0, 0);
+	if (filter == FILTER_NEAREST)
+		return texel(0, int(floor(s * levelWidth[0])), int(floor(t * levelHeight[0])));
+	if (filter == FILTER_BILINEAR || numLevels == 1) return bilinear(0, s, t);
+	
+	// the footprint axes, in texels of the full-resolution image:
+	double w = levelWidth[0], h = levelHeight[0];
+	double len0 = sqrt(sqr(dsdx * w) + sqr(dtdx * h));
+	double len1 = sqrt(sqr(dsdy * w) + sqr(dtdy * h));
+	if (len0 < len1) {
+		swap(dsdx, dsdy);
+		swap(dtdx, dtdy);
+		swap(len0, len1);
+	}
+	// len0 is now the major axis; len1 is the minor one
+	if (filter == FILTER_TRILINEAR || len0 <= 2 * len1 || len0 == 0)
+		return trilinear(s, t, len0);
+	
+	// clamp the eccentricity, so that the number of texels we visit stays bounded. This blurs the result a bit.
+	if (len1 * MAX_ANISOTROPY < len0) {
+		if (len1 > 0) {
+			double scale = len0 / (len1 * MAX_ANISOTROPY);
+			dsdy *= scale;
+			dtdy *= scale;
+		} else {
+			// degenerate footprint (a line); make up a minor axis, perpendicular to the major one:
+			dsdy = -dtdx * h / (w * MAX_ANISOTROPY);
+			dtdy =  dsdx * w / (h * MAX_ANISOTROPY);
+		}
+		len1 = len0 / MAX_ANISOTROPY;
+	}
+	double level = max(0.0, log2(len1));
+	int intLevel = int(floor(level));
+	float frac = float(level - intLevel);
+	if (frac == 0) return ewa(intLevel, s, t, dsdx, dtdx, dsdy, dtdy);
+	return ewa(intLevel    , s, t, dsdx, dtdx, dsdy, dtdy) * (1 - frac) +
+	       ewa(intLevel + 1, s, t, dsdx, dtdx, dsdy, dtdy) * frac;
+}
@@ -0,0 +1,96 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File mipmap.h
+ * @Brief Mip-mapped, filtered bitmap lookups (for texture anti-aliasing)
+ */
+#pragma once
+
+#include <vector>
+#include "color.h"
+#include "bitmap.h"
+
+/// the supported texture filtering modes
+enum TextureFilter {
+	FILTER_NEAREST,     //!< no filtering; just take the nearest texel of the full-resolution image
+	FILTER_BILINEAR,    //!< bilinear interpolation in the full-resolution image
+	FILTER_TRILINEAR,   //!< bilinear lookups in the two mip levels, nearest to the pixel footprint size
+	FILTER_ANISOTROPIC, //!< EWA filtering for elongated footprints, trilinear otherwise
+};
+
+/// parses a filter name from the scene file ("nearest", "bilinear", "trilinear" or "anisotropic")
+/// @returns false if the name is not recognized
+bool parseTextureFilter(const char* name, TextureFilter& filter);
+
+#define MAX_MIP_LEVELS 32
+
+/// @brief base class for mip-mapped images, which can do filtered lookups
+///
+/// The texture coordinates (s, t) are normalized, i.e. [0..1) spans the whole image (and the image
+/// repeats outside of that, unless clampT is set). The footprint of a pixel is given by the screen-space derivatives
+/// of (s, t), see computeTextureDifferentials().
+///
+/// Derived classes provide the texels of each level (see MipMap and TiledImage).
+class MipMapBase {
+	Color texel(int level, int x, int y) const; //!< wraps around (or clamps, in t)
+	Color bilinear(int level, double s, double t) const;
+	Color trilinear(double s, double t, double width) const; //!< width is in level-0 texels
+	Color ewa(int level, double s, double t, double ds0, double dt0, double ds1, double dt1) const;
+protected:
+	int numLevels = 0;
+	int levelWidth[MAX_MIP_LEVELS], levelHeight[MAX_MIP_LEVELS]; //!< level 0 is the original image
+	
+	/// fetch a single texel; (x, y) are guaranteed to be inside the level's dimensions
+	virtual Color fetchTexel(int level, int x, int y) const = 0;
+public:
+	/// clamp t to the top and bottom rows instead of wrapping around, e.g. for lat-long images, where
+	/// the rows past a pole aren't the ones at the opposite pole
+	bool clampT = false;
+	
+	virtual ~MipMapBase() {}
+	int getNumLevels() const { return numLevels; }
+	
+	/// makes a filtered lookup at (s, t), with the given screen-space derivatives
+	Color sample(TextureFilter filter, double s, double t,
+	             double dsdx, double dtdx, double dsdy, double dtdy) const;
+};
+
+/// @brief an in-memory mip-map pyramid over a bitmap
+class MipMap: public MipMapBase {
+	std::vector<const Bitmap*> levels; //!< levels[0] is the original image (not owned), and each next is half the size
+	
+	void freeLevels();
+protected:
+	Color fetchTexel(int level, int x, int y) const override
+	{
+		return levels[level]->getPixel(x, y);
+	}
+public:
+	MipMap() {}
+	~MipMap();
+	MipMap(const MipMap&) = delete;
+	MipMap& operator = (const MipMap&) = delete;
+	
+	/// builds the pyramid of the given image. The bitmap must outlive the MipMap
+	void build(const Bitmap& bmp);
+	/// gets the bitmap of the given level
+	const Bitmap& getLevel(int level) const { return *levels[level]; }
+};
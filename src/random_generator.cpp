@@ -87,9 +87,11 @@ struct HashMapEntry {
 
 const int RGENS = 257; // 257 is a prime number
 static HashMapEntry rg_table[RGENS];
+static unsigned lastSeed = 0;
 
 void initRandom(unsigned seed)
 {
+	lastSeed = seed;
 	for (int i = 0; i < RGENS; i++)
 		rg_table[i].key = 0xffffffff;
 	const int MAXWARM = 1223;
@@ -107,6 +109,11 @@ void initRandom(unsigned seed)
 	}
 }
 
+unsigned getRandomSeed()
+{
+	return lastSeed;
+}
+
 Random& getRandomGen(int idx)
 {
 	unsigned key = idx;
@@ -48,6 +48,9 @@ public:
 /// seed the whole array of random generators.
 void initRandom(unsigned seed);
 
+/// the seed, passed to the last initRandom() (e.g., for generators, which are reseeded later; see render.cpp)
+unsigned getRandomSeed();
+
 /// fetch the idx-th random generator. There are at least 250 random generators, which are prepared and ready.
 /// This function does not take any start-up time and should be very fast.
 Random& getRandomGen(int idx);
@@ -0,0 +1,619 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File render.cpp
+ * @Brief The rendering core: tracing rays, and rendering frames in buckets
+ */
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "util.h"
+#include "sdl.h"
+#include "color.h"
+#include "vector.h"
+#include "matrix.h"
+#include "camera.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "scene.h"
+#include "lights.h"
+#include "shading.h"
+#include "environment.h"
+#include "random_generator.h"
+#include "render_stats.h"
+#include "reprojection.h"
+#include "render.h"
+#include "main.h"
+#include "checkpoint.h"
+#include "cxxptl-sdl.h"
+using namespace std;
+
+ThreadPool pool;
+Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
+const double offsets[5][2] = {
+	{ 0, 0 }, 
+	{ 0.6, 0 },
+	{ 0.3, 0.3 },
+	{ 0, 0.6 },
+	{ 0.6, 0.6 },
+};
+
+
+bool visible(const Vector& a, const Vector& b, double time)
+{
+	countStat(STAT_SHADOW_RAYS);
+	Ray ray;
+	ray.dir = b - a;
+	ray.start = a;
+	ray.time = time;
+	double maxDist = distance(a, b);
+	ray.dir.normalize();
+	
+	for (auto node: scene.nodes) {
+		IntersectionInfo info;
+		if (node->intersect(ray, info) && info.dist < maxDist) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/// checks whether a ray from `a' in the direction `dir' escapes the scene (i.e. reaches the environment)
+bool visibleToInfinity(const Vector& a, const Vector& dir, double time)
+{
+	countStat(STAT_SHADOW_RAYS);
+	Ray ray;
+	ray.start = a;
+	ray.dir = dir;
+	ray.time = time;
+	
+	for (auto node: scene.nodes) {
+		IntersectionInfo info;
+		if (node->intersect(ray, info)) return false;
+	}
+	
+	return true;
+}
+
+/// is the environment importance-sampled as a light source (in path tracing)?
+static inline bool sampleEnvironment()
+{
+	return scene.environment && scene.environment->canSample();
+}
+
+void applyBumpMapping(Node& closestNode, IntersectionInfo& info)
+{
+	if (!closestNode.bump) return;
+	
+	void* interface = closestNode.bump->getInterface(BumpMapperInterface::ID);
+	if (interface) {
+		static_cast<BumpMapperInterface*>(interface)->modifyNormal(info);
+	}
+}
+
+Color getAmbientLight(const Ray& ray, const IntersectionInfo& info)
+{
+	if (!scene.settings.environmentLighting || !scene.environment) return scene.settings.ambientLight;
+	
+	Vector n = faceforward(ray.dir, info.norm);
+	Color ambient = scene.environment->getIrradiance(n);
+	int numSamples = scene.settings.aoSamples;
+	if (numSamples == 0) return ambient;
+	
+	// ambient occlusion: shoot cosine-distributed rays, and scale by the fraction of them, which aren't blocked:
+	Random& rnd = getRandomGen();
+	Vector a, b;
+	orthonormalSystem(n, a, b);
+	Vector start = info.ip + n * 1e-6;
+	int unoccluded = 0;
+	for (int i = 0; i < numSamples; i++) {
+		double u = rnd.randdouble(), v = rnd.randdouble();
+		double r = sqrt(u), phi = 2 * PI * v;
+		Vector dir = a * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(1 - u);
+		if (visible(start, start + dir * scene.settings.aoDistance, ray.time)) unoccluded++;
+	}
+	return ambient * (unoccluded / float(numSamples));
+}
+
+Vector hemisphereSample(const IntersectionInfo& info)
+{
+	// we want unit resultRay (direction), such that dot(info.norm, resultRay) >= 0
+	
+	Random& rnd = getRandomGen();
+	
+	double u = rnd.randdouble();
+	double v = rnd.randdouble();
+	
+	double theta = 2 * PI * u;
+	double phi = acos(2 * v - 1);
+	
+	Vector dir(
+		sin(phi) * cos(theta),
+		cos(phi),
+		sin(phi) * sin(theta)
+	);
+	
+	// v is uniform in the unit sphere
+	
+	if (dot(dir, info.norm) > 0)
+		return dir;
+	else
+		return -dir;
+}
+
+Color explicitLightSample(const Ray& ray, const IntersectionInfo& info, const Color& pathMultiplier, Shader* shader, Random& rnd)
+{
+	// try to end a path by explicitly sampling a light (or the environment, which is treated
+	// as one more light). If there are no lights, we can't do that:
+	int numLights = int(scene.lights.size()) + (sampleEnvironment() ? 1 : 0);
+	if (numLights == 0) return Color(0, 0, 0);
+
+	// choose a random light:
+	int lightIdx = rnd.randint(0, numLights - 1);
+	if (lightIdx == int(scene.lights.size())) {
+		// sample a direction towards the environment:
+		Vector w_out;
+		Color L;
+		float pdf;
+		scene.environment->sampleDirection(rnd, w_out, L, pdf);
+		if (pdf <= 0) return Color(0, 0, 0);
+		Color brdfAtPoint = shader->eval(info, ray.dir, w_out);
+		if (brdfAtPoint.intensity() == 0) return Color(0, 0, 0);
+		if (!visibleToInfinity(info.ip + info.norm * 1e-6, w_out, ray.time)) return Color(0, 0, 0);
+		float chooseDirProb = pdf / numLights;
+		return L * pathMultiplier * brdfAtPoint / chooseDirProb;
+	}
+	Light* chosenLight = scene.lights[lightIdx];
+
+	// evaluate light's solid angle as viewed from the intersection point, x:
+	Vector x = info.ip;
+	double solidAngle = chosenLight->solidAngle(info);
+
+	// is light is too small or invisible?
+	if (solidAngle == 0) return Color(0, 0, 0);
+
+	// choose a random point on the light:
+	int samplesInLight = chosenLight->getNumSamples();
+	int randSample = rnd.randint(0, samplesInLight - 1);
+
+	Vector pointOnLight;
+	Color unused;
+	chosenLight->getNthSample(randSample, x, pointOnLight, unused);
+
+	// camera -> ... path ... -> x -> lightPos
+	//                       are x and lightPos visible?
+	if (!visible(x + info.norm * 1e-6, pointOnLight, ray.time))
+		return Color(0, 0, 0);
+
+	// get the emitted light energy (color * power):
+	Color L = chosenLight->getColor();
+
+
+	// evaluate BRDF. It might be zero (e.g., pure reflection), so bail out early if that's the case
+	Vector w_out = pointOnLight - x;
+	w_out.normalize();
+	Color brdfAtPoint = shader->eval(info, ray.dir, w_out);
+	if (brdfAtPoint.intensity() == 0) return Color(0, 0, 0);
+
+	// probability to hit this light's projection on the hemisphere
+	// (conditional probability, since we're specifically aiming for this light):
+	float probHitLightArea = 1.0f / solidAngle;
+
+	// probability to pick this light out of all N lights:
+	float probPickThisLight = 1.0f / numLights;
+
+	// combined probability of this generated w_out ray:
+	float chooseLightProb = probHitLightArea * probPickThisLight;
+
+	/* Light flux (Li) */ /* BRDFs@path*/  /*last BRDF*/ /*MC probability*/
+	return     L       *   pathMultiplier * brdfAtPoint / chooseLightProb;
+}
+
+/// traces a GI path. If hitDist is given, it gets the distance to the first hit (INF if the ray escapes)
+Color pathtrace(const Ray& ray, Color pathMultiplier, Random& rnd, double* hitDist = nullptr)
+{
+	if (hitDist) *hitDist = INF;
+	if (ray.depth > scene.settings.maxTraceDepth ||
+		pathMultiplier.intensity() < 0.01 
+		)
+		return Color(0, 0, 0);
+	countStat(ray.depth == 0 ? STAT_PRIMARY_RAYS : STAT_GI_RAYS);
+	
+	Node* closestNode = nullptr;
+	IntersectionInfo closestIntersection;
+	closestIntersection.dist = 1e99;
+	
+	for (auto node: scene.nodes) {
+		IntersectionInfo info;
+		if (node->intersect(ray, info) && info.dist < closestIntersection.dist) {
+			closestIntersection = info;
+			closestNode = node;
+		}
+	}
+	
+	bool hitLight = false;
+	Light* intersectedLight = nullptr;
+	for (auto light: scene.lights) {
+		IntersectionInfo info;
+		if (light->intersect(ray, info) && info.dist < closestIntersection.dist) {
+			hitLight = true;
+			closestIntersection = info;
+			intersectedLight = light;
+		}
+	}
+	if (hitDist && (closestNode || hitLight)) *hitDist = closestIntersection.dist;
+	
+	if (hitLight) {
+		if (ray.flags & RF_DIFFUSE) {
+			// forbid light contributions after a diffuse reflection
+			return Color(0, 0, 0);
+		} else {
+			return intersectedLight->getColor() * pathMultiplier;
+		}
+	}
+	
+	if (!closestNode) {
+		if (!scene.environment) return Color(0, 0, 0);
+		// if the environment is sampled explicitly, it's already accounted for after a diffuse
+		// reflection, same as the lights:
+		if ((ray.flags & RF_DIFFUSE) && sampleEnvironment()) return Color(0, 0, 0);
+		return scene.environment->getFilteredEnvironment(ray) * pathMultiplier;
+	}
+		
+	computeTextureDifferentials(ray, closestIntersection);
+	applyBumpMapping(*closestNode, closestIntersection);
+	countShaderCall(closestNode->shader);
+	
+	Ray newRay = ray;
+	newRay.depth++;
+	newRay.start = closestIntersection.ip + closestIntersection.norm * 1e-6;
+	Color brdfColor;
+	float rayPdf;
+	closestNode->shader->spawnRay(closestIntersection, ray, newRay, brdfColor, rayPdf);
+	
+	// ("sampling the light"):
+	// try to end the current path with explicit sampling of some light
+	Color contribLight = explicitLightSample(ray, closestIntersection, pathMultiplier,
+											closestNode->shader, rnd);
+	// ("sampling the BRDF"):
+	// also try to extend the current path randomly:
+	Ray w_out = ray;
+	w_out.depth++;
+	Color brdf;
+	float pdf;
+	closestNode->shader->spawnRay(closestIntersection, ray, w_out, brdf, pdf);
+
+	if (pdf == -1) return Color(1, 0, 0); // BRDF not implemented
+	if (pdf == 0) return Color(0, 0, 0);  // BRDF is zero
+
+
+	Color contribGI = pathtrace(w_out, pathMultiplier * brdf / pdf, rnd);
+	return contribLight + contribGI;
+}
+
+Color raytrace(const Ray& ray, double* hitDist)
+{
+	if (hitDist) *hitDist = INF;
+	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
+	countStat(ray.depth == 0 ? STAT_PRIMARY_RAYS : STAT_SECONDARY_RAYS);
+	
+	Node* closestNode = nullptr;
+	IntersectionInfo closestIntersection;
+	closestIntersection.dist = 1e99;
+	
+	for (auto node: scene.nodes) {
+		IntersectionInfo info;
+		if (node->intersect(ray, info) && info.dist < closestIntersection.dist) {
+			closestIntersection = info;
+			closestNode = node;
+		}
+	}
+	
+	bool hitLight = false;
+	Light* intersectedLight = nullptr;
+	for (auto light: scene.lights) {
+		IntersectionInfo info;
+		if (light->intersect(ray, info) && info.dist < closestIntersection.dist) {
+			hitLight = true;
+			closestIntersection = info;
+			intersectedLight = light;
+		}
+	}
+	if (hitDist && (closestNode || hitLight)) *hitDist = closestIntersection.dist;
+	
+	if (hitLight) {
+		return intersectedLight->getColor();
+	}
+	
+	if (!closestNode) {
+		if (scene.environment) return scene.environment->getFilteredEnvironment(ray);
+		else return Color(0, 0, 0);
+	}
+		
+	computeTextureDifferentials(ray, closestIntersection);
+	applyBumpMapping(*closestNode, closestIntersection);
+	countShaderCall(closestNode->shader);
+	
+	return closestNode->shader->shade(ray, closestIntersection);
+}
+
+inline Color trace(const Ray& ray, Random& rnd, double* hitDist = nullptr)
+{
+	if (scene.settings.gi) {
+		return pathtrace(ray, Color(1, 1, 1), rnd, hitDist);
+	} else {
+		return raytrace(ray, hitDist);
+	}
+}
+
+inline Ray getRay(double x, double y, WhichCamera whichCamera)
+{
+	if (scene.camera->dof)
+		return scene.camera->getDOFRay(x, y, whichCamera);
+	else
+		return scene.camera->getScreenRay(x, y, whichCamera);
+}
+
+Color raytraceSinglePixel(double x, double y, Random& rnd, double time, double* hitDist)
+{
+	if (hitDist) *hitDist = INF;
+	if (scene.camera->stereoSeparation > 0) {
+		Ray leftRay = getRay(x, y, CAMERA_LEFT);
+		Ray rightRay= getRay(x, y, CAMERA_RIGHT);
+		leftRay.time = rightRay.time = time;
+		Color colorLeft = trace(leftRay, rnd);
+		Color colorRight = trace(rightRay, rnd);
+		if (scene.settings.saturation != 1) {
+			colorLeft.adjustSaturation(scene.settings.saturation);
+			colorRight.adjustSaturation(scene.settings.saturation);
+
+		}
+		return  colorLeft * scene.camera->leftMask
+		      + colorRight* scene.camera->rightMask;
+	} else {
+		Ray ray = getRay(x, y, CAMERA_CENTER);
+		ray.time = time;
+		return trace(ray, rnd, hitDist);
+	}
+}
+
+/// the seed of the random generator for a bucket, in a checkpointed render. It only depends on the bucket's place (and
+/// the global seed, see initRandom()), so that the bucket comes out the same, whichever thread renders it, and when
+/// (i.e. after resuming from the checkpoint). Other renders don't reseed, so that each frame (or interactive pass)
+/// gets different noise
+static unsigned bucketSeed(const Rect& r)
+{
+	return (unsigned(r.x0) * 73856093u) ^ (unsigned(r.y0) * 19349663u) ^ (getRandomSeed() * 83492791u) ^ 0x9e3779b9u;
+}
+
+class RendMT: public Parallel {
+	InterlockedInt cursor;
+	vector<Rect> buckets;
+	int samplesPerPixel;
+	int pixelStep;
+	bool reproject; //!< only trace the pixels, which the reprojection cache doesn't have, and store them there
+	bool motionBlur; //!< spread the samples of each pixel over the shutter interval
+	bool checkpointing; //!< skip the buckets, restored from a checkpoint, and report the finished ones to it
+	Mutex mtx;
+public:
+	RendMT(const vector<Rect>& buckets, int samplesPerPixel, int pixelStep, bool reproject, bool motionBlur,
+		bool checkpointing):
+		cursor(0), buckets(buckets), samplesPerPixel(samplesPerPixel), pixelStep(pixelStep), reproject(reproject),
+		motionBlur(motionBlur), checkpointing(checkpointing) {}
+	void entry(int threadIdx, int threadCount) override
+	{
+		Random& rnd = getRandomGen(); // (not a copy: the shaders fetch the same one, and it may be reseeded below)
+		while (1) {
+			int buckId = (cursor++);
+			if (buckId >= int(buckets.size())) return;
+			Rect& r = buckets[buckId];
+			bool ok = true;
+			if (checkpointing && checkpoint.isDone(buckId)) {
+				mtx.enter();
+				ok = displayVFBRect(r, vfb);
+				mtx.leave();
+				if (!ok) return;
+				continue;
+			}
+			if (!scene.settings.interactive) {
+				mtx.enter();
+				ok = markRegion(r);
+				mtx.leave();
+				if (!ok) return;
+			}
+			if (checkpointing) rnd.seed(bucketSeed(r));
+			double bucketStart = renderStats.enabled ? getPreciseTime() : 0;
+			for (int y = r.y0; y < r.y1; y += pixelStep) {
+				for (int x = r.x0; x < r.x1; x += pixelStep) {
+					if (reproject && !reprojectionCache.needsTracing(x, y)) continue;
+					double pixelStart = renderStats.enabled ? getPreciseTime() : 0;
+					Color avg(0, 0, 0);
+					// for the reprojection cache: what the first sample hit, and where it went through the pixel
+					double firstHitDist = INF, firstX = x, firstY = y;
+					for (int i = 0; i < samplesPerPixel; i++) {
+						Ray ray;
+						float offsetX, offsetY;
+						if (scene.camera->dof || scene.settings.gi || motionBlur) {
+							offsetX = rnd.randfloat();
+							offsetY = rnd.randfloat();
+						} else {
+							offsetX = offsets[i][0];
+							offsetY = offsets[i][1];
+						}
+						// (stratified in time, so that the motion is covered evenly)
+						double time = motionBlur ? (i + rnd.randdouble()) / samplesPerPixel : 0;
+						double sx = x + offsetX * pixelStep, sy = y + offsetY * pixelStep;
+						if (reproject && i == 0) {
+							firstX = sx;
+							firstY = sy;
+						}
+						avg += raytraceSinglePixel(sx, sy, rnd, time, reproject && i == 0 ? &firstHitDist : nullptr);
+					}
+					avg /= samplesPerPixel;
+					if (pixelStep == 1) {
+						vfb[y][x] = avg;
+						if (reproject) {
+							// (no DOF with reprojection, so the camera ray is the one, which was traced)
+							Ray ray = scene.camera->getScreenRay(firstX, firstY);
+							if (firstHitDist == INF)
+								reprojectionCache.store(x, y, avg, ReprojectionCache::PIXEL_DIRECTION, ray.dir,
+									firstX, firstY);
+							else
+								reprojectionCache.store(x, y, avg, ReprojectionCache::PIXEL_POINT,
+									ray.start + ray.dir * firstHitDist, firstX, firstY);
+						}
+					} else {
+						// reduced resolution: fill the whole block (clipped to the bucket)
+						int ey = min(r.y1, y + pixelStep), ex = min(r.x1, x + pixelStep);
+						for (int by = y; by < ey; by++)
+							for (int bx = x; bx < ex; bx++)
+								vfb[by][bx] = avg;
+					}
+					if (renderStats.enabled) {
+						// (at a reduced resolution, the time is spread over the whole block, as in the vfb)
+						int ey = min(r.y1, y + pixelStep), ex = min(r.x1, x + pixelStep);
+						double seconds = (getPreciseTime() - pixelStart) / ((ey - y) * (ex - x));
+						for (int by = y; by < ey; by++)
+							for (int bx = x; bx < ex; bx++)
+								renderStats.setPixelTime(bx, by, seconds);
+					}
+				}
+			}
+			if (renderStats.enabled) renderStats.setBucketTime(buckId, getPreciseTime() - bucketStart);
+			if (checkpointing) checkpoint.markDone(buckId);
+			if (!scene.settings.interactive) {
+				mtx.enter();
+				ok = displayVFBRect(r, vfb);
+				mtx.leave();
+				if (!ok) return;
+			}
+		}
+	}
+};
+
+/// how many rays to trace per pixel, for the current settings. Also finds if there's any motion blur
+static int getSamplesPerPixel(bool& motionBlur)
+{
+	int samplesPerPixel = COUNT_OF(offsets);
+	if (!scene.settings.wantAA) samplesPerPixel = 1;
+	if (scene.camera->dof)
+		samplesPerPixel = max(samplesPerPixel, scene.camera->numDOFSamples);
+	if (scene.settings.gi)
+		samplesPerPixel = max(samplesPerPixel, scene.settings.numPaths);
+	// motion blur only costs more samples if something actually moves:
+	motionBlur = false;
+	if (scene.camera->shutter > 0)
+		for (auto node: scene.nodes)
+			if (node->isMoving()) motionBlur = true;
+	if (motionBlur)
+		samplesPerPixel = max(samplesPerPixel, scene.camera->numMotionSamples);
+	return samplesPerPixel;
+}
+
+void render(int pixelStep)
+{
+	Random& rnd = getRandomGen();
+	bool sceneChanged = scene.beginFrame();
+	vector<Rect> buckets = getBucketsList();
+	renderStats.beginFrame(int(buckets.size()), frameWidth(), frameHeight());
+	double frameStart = getPreciseTime();
+	const int SQUARE_SIZE = 16;
+	if (scene.settings.wantPrepass && !scene.settings.interactive) {
+		for (int y = 0; y < frameHeight(); y += SQUARE_SIZE) {
+			int ey = min(frameHeight(), y + SQUARE_SIZE);
+			int cy = (y + ey) / 2;
+			for (int x = 0; x < frameWidth(); x += SQUARE_SIZE) {
+				int ex = min(frameWidth(), x + SQUARE_SIZE);
+				int cx = (x + ex) / 2;
+				Color c = raytraceSinglePixel(cx, cy, rnd);
+				if (!drawRect(Rect(x, y, ex, ey), c)) {
+					renderStats.endFrame(getPreciseTime() - frameStart);
+					return;
+				}
+			}
+		}
+				
+	}
+	
+	bool motionBlur;
+	int samplesPerPixel = getSamplesPerPixel(motionBlur);
+
+	// in the interactive mode, reuse what's still valid from the previous frame. It needs the pixels to be
+	// sharp (not at a reduced resolution, and with a single camera ray origin):
+	const GlobalSettings& settings = scene.settings;
+	bool reproject = settings.interactive && settings.reprojection && pixelStep == 1 && !scene.camera->dof &&
+		scene.camera->stereoSeparation == 0 && !motionBlur;
+	if (!reproject || sceneChanged)
+		reprojectionCache.invalidate();
+	if (reproject)
+		reprojectionCache.reproject(*scene.camera, frameWidth(), frameHeight(),
+			int(1 / settings.reprojectionRefresh + 0.5), vfb);
+	
+	// long renders save their progress now and then (and may continue from a saved one, see checkpoint.h):
+	bool checkpointing = checkpoint.isEnabled() && !settings.interactive && pixelStep == 1;
+	if (checkpointing) checkpoint.begin(buckets, samplesPerPixel);
+	
+	RendMT worker(buckets, samplesPerPixel, pixelStep, reproject, motionBlur, checkpointing);
+	
+	pool.run(&worker, scene.settings.numThreads);
+	if (checkpointing) checkpoint.end();
+	renderStats.endFrame(getPreciseTime() - frameStart);
+}
+
+void renderBuckets(const vector<Rect>& buckets)
+{
+	scene.beginFrame();
+	renderStats.beginFrame(int(buckets.size()), frameWidth(), frameHeight());
+	double start = getPreciseTime();
+	bool motionBlur;
+	int samplesPerPixel = getSamplesPerPixel(motionBlur);
+	RendMT worker(buckets, samplesPerPixel, 1, false, motionBlur, false);
+	pool.run(&worker, scene.settings.numThreads);
+	renderStats.endFrame(getPreciseTime() - start);
+}
+
+void reportStats()
+{
+	renderStats.printSummary();
+	if (scene.settings.statsFile[0] && !renderStats.writeJSON(scene.settings.statsFile))
+		fprintf(stderr, "Could not write the statistics to `%s'\n", scene.settings.statsFile);
+	if (scene.settings.statsHeatmap[0] && !renderStats.writeHeatmap(scene.settings.statsHeatmap))
+		fprintf(stderr, "Could not save the heatmap to `%s'\n", scene.settings.statsHeatmap);
+}
+
+int renderSceneThread(void* /*unused*/)
+{
+	render();
+	rendering = false;
+	return 0;
+}
+
+void debugRayTrace(int x, int y)
+{
+	// trace a test ("debugging") ray through a clicked pixel on the screen
+	Ray ray = scene.camera->getScreenRay(x, y);
+	ray.flags |= RF_DEBUG;
+	if (scene.settings.gi)
+		pathtrace(ray, Color(1, 1, 1), getRandomGen());
+	else
+		raytrace(ray);
+}
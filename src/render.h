@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File render.h
+ * @Brief Rendering of whole frames (the per-ray functions are declared in main.h)
+ */
+#pragma once
+
+#include <vector>
+#include "color.h"
+#include "constants.h"
+
+class Random;
+struct Rect;
+
+extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; //!< the rendered frame (linear colors)
+
+/// renders a frame of the scene into vfb, with scene.settings.numThreads threads.
+/// The scene should be parsed, and scene.beginRender() should've been called.
+/// With pixelStep > 1, only one pixel in each pixelStep x pixelStep block is traced, and the block is filled with
+/// its color (a quick preview at a reduced resolution, for the interactive mode)
+void render(int pixelStep = 1);
+
+/// renders only the given parts of the frame (e.g. in a distributed render's worker, see distributed.h)
+void renderBuckets(const std::vector<Rect>& buckets);
+
+/// same as render(), but as a thread entry point (see renderScene_threaded())
+int renderSceneThread(void*);
+
+/// traces all rays for a single (possibly fractional) pixel coordinate, and returns the color.
+/// With motion blur, the rays are traced at the given time (see Ray::time). If hitDist is given, it gets the
+/// distance to the first hit of the (non-stereo) camera ray, or INF if it escapes
+Color raytraceSinglePixel(double x, double y, Random& rnd, double time = 0, double* hitDist = nullptr);
+
+/// traces a single ray through a pixel, with debugging output turned on
+void debugRayTrace(int x, int y);
+
+/// prints (and saves, if requested) the render statistics, if they were collected
+void reportStats();
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File render_stats.cpp
+ * @Brief Opt-in counters and timings of the rendering
+ */
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "render_stats.h"
+#include "shading.h"
+#include "bitmap.h"
+using namespace std;
+
+RenderStats renderStats;
+
+static const char* counterNames[NUM_STAT_COUNTERS] = {
+	"primaryRays",
+	"secondaryRays",
+	"giRays",
+	"shadowRays",
+	"kdNodesVisited",
+	"triangleTests",
+	"csgReintersections",
+};
+
+void ThreadStats::reset()
+{
+	for (auto& c: counters) c = 0;
+	shaderCalls.clear();
+}
+
+ThreadStats* RenderStats::registerThread()
+{
+	mutex.enter();
+	threads.emplace_back(new ThreadStats);
+	ThreadStats* result = threads.back().get();
+	mutex.leave();
+	return result;
+}
+
+void RenderStats::beginFrame(int numBuckets, int width, int height)
+{
+	if (!enabled) return;
+	mutex.enter();
+	for (auto& t: threads) t->reset();
+	mutex.leave();
+	bucketSeconds.assign(numBuckets, 0.0);
+	this->width = width;
+	this->height = height;
+	pixelMicroseconds.assign(width * height, 0.0f);
+}
+
+void RenderStats::endFrame(double seconds)
+{
+	if (!enabled) return;
+	mutex.enter();
+	for (auto& t: threads) {
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++) totals[i] += t->counters[i];
+		for (auto& sc: t->shaderCalls) shaderCallsByClass[sc.first->className] += sc.second;
+	}
+	mutex.leave();
+	numFrames++;
+	renderSeconds += seconds;
+}
+
+long long RenderStats::getTotalRays() const
+{
+	return totals[STAT_PRIMARY_RAYS] + totals[STAT_SECONDARY_RAYS] + totals[STAT_GI_RAYS] + totals[STAT_SHADOW_RAYS];
+}
+
+void RenderStats::printSummary()
+{
+	if (!enabled || !numFrames) return;
+	long long rays = getTotalRays();
+	printf("Render statistics (%d frame%s, %.2fs):\n", numFrames, numFrames > 1 ? "s" : "", renderSeconds);
+	for (int i = 0; i < NUM_STAT_COUNTERS; i++)
+		printf("  %-20s %14lld\n", counterNames[i], totals[i]);
+	printf("  %-20s %14.3f\n", "Mrays/s", renderSeconds > 0 ? rays / renderSeconds * 1e-6 : 0.0);
+	for (auto& sc: shaderCallsByClass)
+		printf("  shader %-13s %14lld calls\n", sc.first.c_str(), sc.second);
+	if (!bucketSeconds.empty()) {
+		auto minmax = minmax_element(bucketSeconds.begin(), bucketSeconds.end());
+		double sum = 0;
+		for (double t: bucketSeconds) sum += t;
+		printf("  buckets: %d, time min/avg/max = %.2f/%.2f/%.2f ms (last frame)\n", int(bucketSeconds.size()),
+			*minmax.first * 1000, sum / bucketSeconds.size() * 1000, *minmax.second * 1000);
+	}
+}
+
+bool RenderStats::writeJSON(const char* filename)
+{
+	if (!enabled) return true;
+	FILE* f = fopen(filename, "wt");
+	if (!f) return false;
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"frames\": %d,\n", numFrames);
+	fprintf(f, "\t\"renderSeconds\": %.6f,\n", renderSeconds);
+	fprintf(f, "\t\"counters\": {\n");
+	for (int i = 0; i < NUM_STAT_COUNTERS; i++)
+		fprintf(f, "\t\t\"%s\": %lld%s\n", counterNames[i], totals[i], i < NUM_STAT_COUNTERS - 1 ? "," : "");
+	fprintf(f, "\t},\n");
+	fprintf(f, "\t\"shaderCalls\": {");
+	bool first = true;
+	for (auto& sc: shaderCallsByClass) {
+		fprintf(f, "%s\n\t\t\"%s\": %lld", first ? "" : ",", sc.first.c_str(), sc.second);
+		first = false;
+	}
+	fprintf(f, "\n\t},\n");
+	fprintf(f, "\t\"bucketMilliseconds\": [");
+	for (int i = 0; i < int(bucketSeconds.size()); i++)
+		fprintf(f, "%s%.3f", i ? ", " : "", bucketSeconds[i] * 1000);
+	fprintf(f, "]\n");
+	fprintf(f, "}\n");
+	fclose(f);
+	return true;
+}
+
+bool RenderStats::writeHeatmap(const char* filename)
+{
+	if (!enabled || pixelMicroseconds.empty()) return true;
+	Bitmap heatmap;
+	heatmap.generateEmptyImage(width, height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) {
+			float t = pixelMicroseconds[y * width + x];
+			heatmap.setPixel(x, y, Color(t, t, t));
+		}
+	return heatmap.saveImage(filename);
+}
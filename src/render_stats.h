@@ -0,0 +1,117 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File render_stats.h
+ * @Brief Opt-in counters and timings of the rendering (see GlobalSettings::collectStats)
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cxxptl-sdl.h"
+
+class Shader;
+
+/// the counted events
+enum StatCounter {
+	STAT_PRIMARY_RAYS,      //!< camera rays
+	STAT_SECONDARY_RAYS,    //!< reflection and refraction rays (in raytracing)
+	STAT_GI_RAYS,           //!< path tracing bounces
+	STAT_SHADOW_RAYS,       //!< visibility tests towards lights, the environment, and for ambient occlusion
+	STAT_KD_NODES,          //!< KD tree nodes visited
+	STAT_TRIANGLE_TESTS,    //!< ray-triangle intersection tests
+	STAT_CSG_REINTERSECTIONS, //!< repeated intersect() calls, while finding the spans of a CSG operand
+	NUM_STAT_COUNTERS,
+};
+
+/// the counters of a single thread. Only that thread writes to them, so no locking or atomics are needed
+struct ThreadStats {
+	long long counters[NUM_STAT_COUNTERS];
+	std::unordered_map<const Shader*, long long> shaderCalls;
+	
+	ThreadStats() { reset(); }
+	void reset();
+};
+
+/**
+ * @brief gathers the per-thread counters, the time per bucket and per pixel, and reports them
+ *
+ * Everything is a no-op, unless enabled (by GlobalSettings::collectStats). Each thread registers its
+ * ThreadStats on first use; the counters are summed at the end of each frame, while the threads are idle.
+ */
+class RenderStats {
+	Mutex mutex; //!< guards `threads'
+	std::vector<std::unique_ptr<ThreadStats>> threads;
+	
+	// totals over all frames:
+	long long totals[NUM_STAT_COUNTERS] = { 0 };
+	std::unordered_map<std::string, long long> shaderCallsByClass;
+	int numFrames = 0;
+	double renderSeconds = 0;
+	
+	// of the last frame:
+	std::vector<double> bucketSeconds;
+	std::vector<float> pixelMicroseconds;
+	int width = 0, height = 0;
+public:
+	bool enabled = false;
+	
+	ThreadStats* registerThread(); //!< (called once per thread)
+	
+	/// prepares for a frame: resets the counters, and sizes the per-bucket and per-pixel timings
+	void beginFrame(int numBuckets, int width, int height);
+	/// sums up the counters of all threads (the threads should be idle by now)
+	void endFrame(double seconds);
+	
+	void setBucketTime(int bucketIdx, double seconds) { bucketSeconds[bucketIdx] = seconds; }
+	void setPixelTime(int x, int y, double seconds) { pixelMicroseconds[y * width + x] = float(seconds * 1e6); }
+	
+	long long getTotal(StatCounter counter) const { return totals[counter]; }
+	long long getTotalRays() const; //!< of all kinds
+	double getRenderSeconds() const { return renderSeconds; }
+	
+	void printSummary();
+	bool writeJSON(const char* filename);
+	/// saves the time spent on each pixel (in microseconds) as an image (e.g. an .exr file)
+	bool writeHeatmap(const char* filename);
+};
+
+extern RenderStats renderStats;
+
+inline ThreadStats& threadStats()
+{
+	static thread_local ThreadStats* stats = nullptr;
+	if (!stats) stats = renderStats.registerThread();
+	return *stats;
+}
+
+/// counts an event (if the statistics are enabled)
+inline void countStat(StatCounter counter, long long amount = 1)
+{
+	if (renderStats.enabled) threadStats().counters[counter] += amount;
+}
+
+inline void countShaderCall(const Shader* shader)
+{
+	if (renderStats.enabled) threadStats().shaderCalls[shader]++;
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File reprojection.cpp
+ * @Brief Implements the ReprojectionCache
+ */
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include "camera.h"
+#include "reprojection.h"
+using namespace std;
+
+ReprojectionCache reprojectionCache;
+
+void ReprojectionCache::invalidate()
+{
+	for (auto& p: pixels) p.kind = PIXEL_EMPTY;
+}
+
+int ReprojectionCache::reproject(const Camera& camera, int W, int H, int refreshPeriod,
+                                 Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+{
+	if (W != width || H != height) {
+		width = W;
+		height = H;
+		pixels.assign(W * H, CachedPixel());
+		newPixels.resize(W * H);
+		depth.resize(W * H);
+		return 0;
+	}
+	for (auto& p: newPixels) p.kind = PIXEL_EMPTY;
+	
+	// splat the old pixels at their new positions, keeping the nearest point in each pixel:
+	for (auto& p: pixels) {
+		if (p.kind == PIXEL_EMPTY) continue;
+		double sx, sy;
+		if (p.kind == PIXEL_POINT ? !camera.project(p.hit, sx, sy) : !camera.projectDir(p.hit, sx, sy)) continue;
+		// (where the pixel's center goes, if the point moves there)
+		sx -= p.dx;
+		sy -= p.dy;
+		if (sx < 0 || sy < 0 || sx >= W || sy >= H) continue;
+		int idx = int(sy) * W + int(sx);
+		// (the directions, e.g. to the environment, are behind everything)
+		float dist = p.kind == PIXEL_POINT ? float(distance(p.hit, camera.pos)) : std::numeric_limits<float>::infinity();
+		CachedPixel& target = newPixels[idx];
+		if (target.kind == PIXEL_EMPTY || dist < depth[idx]) {
+			target = p;
+			depth[idx] = dist;
+		}
+	}
+	pixels.swap(newPixels);
+	
+	// the rolling refresh, and writing out the reused colors:
+	refreshPeriod = max(1, refreshPeriod);
+	unsigned phase = frameCounter++ % refreshPeriod;
+	int reused = 0;
+	for (int y = 0; y < H; y++)
+		for (int x = 0; x < W; x++) {
+			CachedPixel& p = pixels[y * W + x];
+			// (a dithered pattern, so that the refreshed pixels are spread evenly)
+			if ((unsigned(x * 7 + y * 13)) % refreshPeriod == phase) p.kind = PIXEL_EMPTY;
+			if (p.kind == PIXEL_EMPTY) continue;
+			vfb[y][x] = p.color;
+			reused++;
+		}
+	return reused;
+}
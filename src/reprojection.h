@@ -0,0 +1,89 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File reprojection.h
+ * @Brief Reuses the pixels of the previous frame in the interactive mode, by reprojecting them for the new camera
+ */
+#pragma once
+
+#include <vector>
+#include "color.h"
+#include "vector.h"
+#include "constants.h"
+
+class Camera;
+
+/**
+ * @brief remembers where each pixel's central ray first hit the scene, and the pixel's color
+ *
+ * At the start of a frame, the points of the previous frame are projected through the new camera, and the nearest
+ * one, which lands in a pixel, supplies its color. Only the pixels, which get no point (disocclusions, the new
+ * parts of the view), and a rolling fraction of all pixels (which refreshes the view-dependent shading) need
+ * to be traced. Pixels, where the ray escaped to the environment, are stored as directions, and stay valid as
+ * long as the camera only rotates.
+ */
+class ReprojectionCache {
+public:
+	enum PixelKind : unsigned char {
+		PIXEL_EMPTY,     //!< nothing known; has to be traced
+		PIXEL_POINT,     //!< `hit' is a point in the scene
+		PIXEL_DIRECTION, //!< `hit' is a direction (the ray hit nothing)
+	};
+private:
+	struct CachedPixel {
+		Vector hit;
+		Color color;
+		float dx, dy; //!< where the ray, which found `hit', went through the pixel (relative to its center)
+		PixelKind kind = PIXEL_EMPTY;
+	};
+	int width = 0, height = 0;
+	std::vector<CachedPixel> pixels, newPixels;
+	std::vector<float> depth; //!< distance from the new camera of the point in newPixels (while reprojecting)
+	unsigned frameCounter = 0;
+public:
+	/// forgets everything (e.g. the scene changed, or the frame was rendered at a reduced resolution)
+	void invalidate();
+	
+	/**
+	 * @brief reprojects the previous frame through `camera', writing the reused colors into vfb
+	 *
+	 * Besides the empty pixels, one in `refreshPeriod' pixels is marked for tracing in each frame, in a pattern
+	 * which cycles over all of them. Afterwards, needsTracing() tells, which pixels weren't reused.
+	 * @returns the number of reused pixels
+	 */
+	int reproject(const Camera& camera, int width, int height, int refreshPeriod, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]);
+	
+	bool needsTracing(int x, int y) const { return pixels[y * width + x].kind == PIXEL_EMPTY; }
+	
+	/// stores a traced pixel (each thread stores distinct pixels, so no locking is needed).
+	/// (sampleX, sampleY) is the screen position, through which the ray, that found `hit', was traced
+	void store(int x, int y, const Color& color, PixelKind kind, const Vector& hit, double sampleX, double sampleY)
+	{
+		CachedPixel& p = pixels[y * width + x];
+		p.hit = hit;
+		p.color = color;
+		p.dx = float(sampleX - (x + 0.5));
+		p.dy = float(sampleY - (y + 0.5));
+		p.kind = kind;
+	}
+};
+
+extern ReprojectionCache reprojectionCache;
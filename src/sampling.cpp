@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File sampling.cpp
+ * @Brief Discrete probability distributions, for importance sampling
+ */
+#include <algorithm>
+#include "sampling.h"
+using namespace std;
+
+void Distribution1D::build(const float* w, int n)
+{
+	weights.assign(w, w + n);
+	cdf.resize(n + 1);
+	total = 0;
+	cdf[0] = 0;
+	for (int i = 0; i < n; i++) {
+		total += max(0.0f, w[i]);
+		cdf[i + 1] = total;
+	}
+	if (total > 0) {
+		for (int i = 1; i <= n; i++) cdf[i] /= total;
+	} else {
+		for (int i = 1; i <= n; i++) cdf[i] = i / double(n);
+	}
+	cdf[n] = 1;
+}
+
+int Distribution1D::sample(double u, float& prob) const
+{
+	// find the last i, where cdf[i] <= u (so cdf[i] <= u < cdf[i + 1], and the bucket can't be empty):
+	int i = int(upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1;
+	i = max(0, min(count() - 1, i));
+	prob = probability(i);
+	return i;
+}
+
+void Distribution2D::build(const float* w, int width, int height)
+{
+	rows.resize(height);
+	vector<float> rowTotals(height);
+	for (int y = 0; y < height; y++) {
+		rows[y].build(w + y * width, width);
+		rowTotals[y] = float(rows[y].getTotal());
+	}
+	marginal.build(rowTotals.data(), height);
+}
+
+void Distribution2D::sample(double u, double v, int& x, int& y, float& prob) const
+{
+	float probRow, probCell;
+	y = marginal.sample(v, probRow);
+	x = rows[y].sample(u, probCell);
+	prob = probRow * probCell;
+}
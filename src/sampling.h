@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File sampling.h
+ * @Brief Discrete probability distributions, for importance sampling
+ */
+#pragma once
+
+#include <vector>
+
+/// @brief a piecewise-constant distribution over n buckets, where the probability of each
+/// bucket is proportional to its (non-negative) weight
+class Distribution1D {
+	std::vector<float> weights;
+	std::vector<double> cdf; //!< n + 1 entries; cdf[0] = 0, cdf[n] = 1
+	double total = 0;        //!< sum of all weights
+public:
+	/// builds the distribution. If all weights are zero, it becomes uniform.
+	void build(const float* w, int n);
+	
+	int count() const { return (int) weights.size(); }
+	double getTotal() const { return total; }
+	
+	/// chooses a bucket, using a uniform random number u in [0..1).
+	/// @param prob - output: the probability of choosing that bucket
+	int sample(double u, float& prob) const;
+	
+	/// the probability of choosing bucket i
+	float probability(int i) const { return float(cdf[i + 1] - cdf[i]); }
+};
+
+/// @brief a piecewise-constant distribution over the cells of a w x h grid (e.g. the texels of an image)
+///
+/// A row is chosen first (according to the sums of the rows), and then a cell in that row.
+class Distribution2D {
+	std::vector<Distribution1D> rows;
+	Distribution1D marginal; //!< over the rows
+public:
+	/// builds the distribution from h rows of w weights each
+	void build(const float* w, int width, int height);
+	
+	double getTotal() const { return marginal.getTotal(); }
+	
+	/// chooses a cell, using two uniform random numbers in [0..1).
+	/// @param prob - output: the probability of choosing that cell
+	void sample(double u, double v, int& x, int& y, float& prob) const;
+	
+	/// the probability of choosing cell (x, y)
+	float probability(int x, int y) const { return marginal.probability(y) * rows[y].probability(x); }
+};
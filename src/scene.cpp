@@ -48,40 +48,83 @@
 #include "heightfield.h"
 #include "lights.h"
 #include <assert.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
 using std::vector;
 using std::string;
 
 SceneElement::SceneElement()
 {
 	name[0] = 0;
+	className[0] = 0;
+	generation = 1;
+	preparedStamp = frameStamp = 0;
+	sourceHash = 0;
+	usesSettings = false;
 }
+
+void SceneElement::addDependency(SceneElement* element)
+{
+	for (auto dep: dependencies) if (dep == element) return;
+	dependencies.push_back(element);
+}
+
+/**
+ * a number, which changes whenever the element, or any element it (indirectly) depends on, is changed. The generations
+ * only grow, so the sum changes if any of them does. `stamps' memoizes it, so each element is visited once, however
+ * many elements share it
+ */
+static unsigned upstreamGeneration(SceneElement* element, std::unordered_map<SceneElement*, unsigned>& stamps)
+{
+	auto it = stamps.find(element);
+	if (it != stamps.end()) return it->second;
+	stamps[element] = element->generation; // (what a cycle back to this element sees)
+	unsigned result = element->generation;
+	for (auto dep: element->dependencies) result += upstreamGeneration(dep, stamps);
+	stamps[element] = result;
+	return result;
+}
+
 void SceneElement::beginRender() {}
 void SceneElement::beginFrame() {}
 void SceneElement::fillProperties(ParsedBlock& pb) {}
 
 class DefaultSceneParser;
+struct SourceFile;
+struct AnimatedElement;
 
 class ParsedBlockImpl: public ParsedBlock {
 	friend class DefaultSceneParser;
+	// the longest property names and values (the elements copy them to fixed-size buffers, see getBlockLine()):
+	static const int MAX_NAME_LENGTH = 127, MAX_VALUE_LENGTH = 255;
 	struct LineInfo {
 		int line;
-		char propName[128];
-		char propValue[256];
+		int nameOffset, valueOffset; //!< where the property name and value start in `text'
 		bool recognized;
-
-		LineInfo() {}
-		LineInfo(int line, const char* name, const char* value): line(line)
-		{
-			strncpy(propName, name, sizeof(propName));
-			strncpy(propValue, value, sizeof(propValue));
-			recognized = false;
-		}
 	};
 	std::vector<LineInfo> lines;
+	std::string text; //!< the names and values of all properties, each one zero-terminated
+	std::unordered_map<std::string, int> propertyIndex; //!< the index in `lines' of the first line with a given name
 	int blockBegin, blockEnd; // line numbers
+	int order;                // the index of the block, counting the included and referenced files, too
+	SourceFile* source;
 	SceneParser* parser;
 	SceneElement* element;
+	AnimatedElement* animation; //!< if the block has keyed properties
+	double frame, shutter;      //!< for an animated block: the frame it's at, and the shutter interval after it
 
+	char* propName(int i) { return &text[lines[i].nameOffset]; }
+	char* propValue(int i) { return &text[lines[i].valueOffset]; }
+	/// starts a new block (the old contents are cleared)
+	void begin(SceneParser* parser, SceneElement* element, SourceFile* source, int line, int order);
+	/// adds a property. Raises a SyntaxError if the name or the value is too long
+	void addLine(int line, const string& name, const char* value);
+	uint64_t contentsHash() const;
+	bool isAnimated(); //!< are there any keyed properties (like "pos@24 (1, 2, 3)")?
+	/// puts the properties at the given frame in `result' (the keyed ones are interpolated)
+	void getFrame(double frame, ParsedBlockImpl& result);
 	bool findProperty(const char* name, int& i_s, int& line_s, char*& value);
 public:
 	bool getIntProp(const char* name, int* value, int minValue = INT_MIN, int maxValue = INT_MAX);
@@ -99,6 +142,7 @@ public:
 	bool getFilenameProp(const char* name, char* value);
 	bool getBitmapFileProp(const char* name, Bitmap& value);
 	void getTransformProp(Transform& T);
+	bool getMotionTransformProp(double time, Transform& T);
 	void requiredProp(const char* name);
 	void signalError(const char* msg);
 	void signalWarning(const char* msg);
@@ -133,18 +177,143 @@ FileNotFoundError::FileNotFoundError(int line, const char* filename)
 	strcpy(this->filename, filename);
 }
 
-bool ParsedBlockImpl::findProperty(const char* name, int& i_s, int& line_s, char*& value)
+void ParsedBlockImpl::begin(SceneParser* parser, SceneElement* element, SourceFile* source, int line, int order)
 {
-	for (int i = 0; i < (int) lines.size(); i++) if (!strcmp(lines[i].propName, name)) {
-		i_s = i;
-		line_s = lines[i].line;
-		value = lines[i].propValue;
-		lines[i].recognized = true;
-		return true;
+	this->parser = parser;
+	this->element = element;
+	this->source = source;
+	this->order = order;
+	animation = NULL;
+	frame = shutter = 0;
+	blockBegin = blockEnd = line;
+	lines.clear();
+	text.clear();
+	propertyIndex.clear();
+}
+
+void ParsedBlockImpl::addLine(int line, const string& name, const char* value)
+{
+	if ((int) name.length() > MAX_NAME_LENGTH)
+		throw SyntaxError(line, "The property name is too long (at most %d characters)", int(MAX_NAME_LENGTH));
+	if ((int) strlen(value) > MAX_VALUE_LENGTH)
+		throw SyntaxError(line, "The value of `%s' is too long (at most %d characters)", name.c_str(),
+		                  int(MAX_VALUE_LENGTH));
+	LineInfo info;
+	info.line = line;
+	info.recognized = false;
+	info.nameOffset = (int) text.size();
+	text += name;
+	text += '\0';
+	info.valueOffset = (int) text.size();
+	text += value;
+	text += '\0';
+	propertyIndex.insert(make_pair(string(text.c_str() + info.nameOffset), int(lines.size()))); // (keeps the first one)
+	lines.push_back(info);
+}
+
+uint64_t ParsedBlockImpl::contentsHash() const
+{
+	// FNV-1a, over all the names and values:
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c: text) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
 	}
+	return hash;
+}
+
+bool ParsedBlockImpl::isAnimated()
+{
+	for (int i = 0; i < (int) lines.size(); i++)
+		if (strchr(propName(i), '@')) return true;
 	return false;
 }
 
+void stripBracesAndCommas(char *s)
+{
+	int l = (int) strlen(s);
+	for (int i = 0; i < l; i++) {
+		char& c = s[i];
+		if (c == ',' || c == '(' || c == ')') c = ' ';
+	}
+}
+
+/// parses a value like "(1, 2, 3)" or "0.5" as a list of numbers. @returns false if it's something else
+static bool parseNumbers(const char* value, vector<double>& numbers)
+{
+	string temp = value;
+	stripBracesAndCommas(&temp[0]);
+	const char* p = temp.c_str();
+	numbers.clear();
+	while (true) {
+		while (isspace(*p)) p++;
+		if (!*p) break;
+		char* end;
+		numbers.push_back(strtod(p, &end));
+		if (end == p) return false;
+		p = end;
+	}
+	return !numbers.empty();
+}
+
+void ParsedBlockImpl::getFrame(double frame, ParsedBlockImpl& result)
+{
+	result.begin(parser, element, source, blockBegin, order);
+	result.blockEnd = blockEnd;
+	// the keys of each keyed property, as (frame, line index):
+	std::unordered_map<string, vector<std::pair<double, int>>> keys;
+	for (int i = 0; i < (int) lines.size(); i++) {
+		char* at = strchr(propName(i), '@');
+		if (!at) continue;
+		double keyFrame;
+		if (1 != sscanf(at + 1, "%lf", &keyFrame))
+			throw SyntaxError(lines[i].line, "Invalid key frame (expected e.g. `pos@24 (1, 2, 3)')");
+		keys[string(propName(i), at)].push_back(std::make_pair(keyFrame, i));
+	}
+	for (int i = 0; i < (int) lines.size(); i++) {
+		char* at = strchr(propName(i), '@');
+		if (!at) {
+			result.addLine(lines[i].line, propName(i), propValue(i));
+			continue;
+		}
+		// a keyed property goes where its first key is:
+		auto it = keys.find(string(propName(i), at));
+		if (it == keys.end()) continue;
+		vector<std::pair<double, int>>& k = it->second;
+		std::sort(k.begin(), k.end());
+		int prev = 0;
+		while (prev + 1 < (int) k.size() && k[prev + 1].first <= frame) prev++;
+		const char* value = propValue(k[prev].second);
+		string interpolated;
+		vector<double> a, b;
+		if (prev + 1 < (int) k.size() && frame > k[prev].first &&
+		    parseNumbers(value, a) && parseNumbers(propValue(k[prev + 1].second), b) && a.size() == b.size()) {
+			double t = (frame - k[prev].first) / (k[prev + 1].first - k[prev].first);
+			for (int j = 0; j < (int) a.size(); j++) {
+				char number[32];
+				snprintf(number, sizeof(number), "%s%.10g", j ? ", " : "", a[j] + (b[j] - a[j]) * t);
+				interpolated += number;
+			}
+			if (a.size() > 1) interpolated = "(" + interpolated + ")";
+			value = interpolated.c_str();
+		} // (otherwise, e.g. for names or booleans, the value stays the same until the next key)
+		result.addLine(lines[i].line, it->first, value);
+		keys.erase(it);
+	}
+}
+
+bool ParsedBlockImpl::findProperty(const char* name, int& i_s, int& line_s, char*& value)
+{
+	auto it = propertyIndex.find(name);
+	if (it == propertyIndex.end()) return false;
+	int i = it->second;
+	i_s = i;
+	line_s = lines[i].line;
+	value = propValue(i);
+	lines[i].recognized = true;
+	return true;
+}
+
 #define PBEGIN\
 	int i_s = 0; \
 	char* value_s; \
@@ -188,15 +357,6 @@ bool ParsedBlockImpl::getDoubleProp(const char* name, double* value, double minV
 	return true;
 }
 
-void stripBracesAndCommas(char *s)
-{
-	int l = (int) strlen(s);
-	for (int i = 0; i < l; i++) {
-		char& c = s[i];
-		if (c == ',' || c == '(' || c == ')') c = ' ';
-	}
-}
-
 bool ParsedBlockImpl::getColorProp(const char* name, Color* value, float minCompValue, float maxCompValue)
 {
 	PBEGIN;
@@ -225,6 +385,7 @@ bool ParsedBlockImpl::getGeometryProp(const char* name, Geometry** value)
 	PBEGIN;
 	Geometry* g = parser->findGeometryByName(value_s);
 	if (!g) throw SyntaxError(line, "Geometry not defined");
+	element->addDependency(g);
 	*value = g;
 	return true;
 }
@@ -234,11 +395,13 @@ bool ParsedBlockImpl::getIntersectableProp(const char* name, Intersectable** val
 	PBEGIN;
 	Geometry* g = parser->findGeometryByName(value_s);
 	if (g) {
+		element->addDependency(g);
 		*value = g;
 		return true;
 	}
 	Node* node = parser->findNodeByName(value_s);
 	if (!node) throw SyntaxError(line, "Intersectable by that name not defined");
+	element->addDependency(node);
 	*value = node;
 	return true;
 }
@@ -248,6 +411,7 @@ bool ParsedBlockImpl::getShaderProp(const char* name, Shader** value)
 	PBEGIN;
 	Shader* s = parser->findShaderByName(value_s);
 	if (!s) throw SyntaxError(line, "Shader not defined");
+	element->addDependency(s);
 	*value = s;
 	return true;
 }
@@ -257,6 +421,7 @@ bool ParsedBlockImpl:: getTextureProp(const char* name, Texture** value)
 	PBEGIN;
 	Texture* t = parser->findTextureByName(value_s);
 	if (!t) throw SyntaxError(line, "Texture not defined");
+	element->addDependency(t);
 	*value = t;
 	return true;
 }
@@ -266,6 +431,7 @@ bool ParsedBlockImpl::getNodeProp(const char* name, Node** value)
 	PBEGIN;
 	Node* n = parser->findNodeByName(value_s);
 	if (!n) throw SyntaxError(line, "Node not defined");
+	element->addDependency(n);
 	*value = n;
 	return true;
 }
@@ -296,23 +462,24 @@ bool ParsedBlockImpl::getBitmapFileProp(const char* name, Bitmap& bmp)
 
 void ParsedBlockImpl::getTransformProp(Transform& T)
 {
+	T.loadIdentity();
 	for (int i = 0; i < (int) lines.size(); i++) {
 		double x, y, z;
-		if (!strcmp(lines[i].propName, "scale")) {
+		if (!strcmp(propName(i), "scale")) {
 			lines[i].recognized = true;
-			get3Doubles(lines[i].line, lines[i].propValue, x, y, z);
+			get3Doubles(lines[i].line, propValue(i), x, y, z);
 			T.scale(x, y, z);
 			continue;
 		}
-		if (!strcmp(lines[i].propName, "rotate")) {
+		if (!strcmp(propName(i), "rotate")) {
 			lines[i].recognized = true;
-			get3Doubles(lines[i].line, lines[i].propValue, x, y, z);
+			get3Doubles(lines[i].line, propValue(i), x, y, z);
 			T.rotate(x, y, z);
 			continue;
 		}
-		if (!strcmp(lines[i].propName, "translate")) {
+		if (!strcmp(propName(i), "translate")) {
 			lines[i].recognized = true;
-			get3Doubles(lines[i].line, lines[i].propValue, x, y, z);
+			get3Doubles(lines[i].line, propValue(i), x, y, z);
 			T.translate(Vector(x, y, z));
 			continue;
 		}
@@ -347,8 +514,8 @@ void ParsedBlockImpl::getBlockLine(int idx, int& srcLine, char head[], char tail
 {
 	lines[idx].recognized = true;
 	srcLine = lines[idx].line;
-	strcpy(head, lines[idx].propName);
-	strcpy(tail, lines[idx].propValue);
+	strcpy(head, propName(idx));
+	strcpy(tail, propValue(idx));
 }
 
 SceneParser& ParsedBlockImpl::getParser()
@@ -356,12 +523,79 @@ SceneParser& ParsedBlockImpl::getParser()
 	return *parser;
 }
 
+/// a sub-scene, loaded by a Reference block. Its nodes aren't rendered directly, only their copies, made by Instances
+struct ReferencedScene {
+	string namePrefix;        //!< all the element names in the sub-scene start with this, e.g. "chair::"
+	vector<Node*> prototypes;
+};
+
+/// a scene file, or a file it includes or references
+struct SourceFile {
+	string fileName;
+	char rootDir[256];                     //!< for resolving the relative paths in the file
+	string namePrefix;                     //!< added to the names of the elements, which the file defines or references
+	ReferencedScene* reference;            //!< the sub-scene, which the file is a part of (NULL for the main scene)
+};
+
+/// an element with keyed properties. Its block is kept, to get the properties at each frame
+struct AnimatedElement {
+	SourceFile source;        //!< (a copy, for resolving the names and paths; the parser is gone when a frame is set)
+	ParsedBlockImpl keys;     //!< the block, as written
+	string frameText;         //!< the properties, which the element was last filled with (see ParsedBlockImpl::text)
+};
+
+bool ParsedBlockImpl::getMotionTransformProp(double time, Transform& T)
+{
+	if (!animation || shutter <= 0) return false;
+	ParsedBlockImpl moment;
+	animation->keys.getFrame(frame + shutter * time, moment);
+	moment.getTransformProp(T);
+	return true;
+}
+
 class DefaultSceneParser: public SceneParser {
-	char sceneRootDir[256];
+	enum BuildResult { BUILD_OK, BUILD_DEFERRED, BUILD_ERROR };
 	Scene* s;
 	SceneElement* curObj;
-	int curLine;
+	std::list<SourceFile> sources;
+	SourceFile* currentSource;             //!< the file being read, or the one of the block being built
+	SceneElement* filling;                 //!< the element, whose fillProperties() runs
+	int numBlocks;
+	std::list<ReferencedScene> references;
+	std::unordered_map<string, ReferencedScene*> referencesByName;
+	std::unordered_map<string, ReferencedScene*> referencesByFile; //!< (each file is loaded once)
+	Scene* previous;                       //!< reuse the unchanged elements of this scene (if not NULL)
+	vector<SceneElement*> reusedElements;
+	std::unordered_map<string, SceneElement*> previousElements; //!< "<className> <name>" -> element of `previous'
+	std::unordered_set<SceneElement*> reusedSet;
+	// name -> element, for resolving the references (if there are several with the same name, the first one):
+	std::unordered_map<string, Shader*> shadersByName;
+	std::unordered_map<string, Texture*> texturesByName;
+	std::unordered_map<string, Geometry*> geometriesByName;
+	std::unordered_map<string, Node*> nodesByName;
+	// blocks, which reference an element that isn't built yet, keyed by the name of that element:
+	std::unordered_map<string, vector<ParsedBlockImpl>> waiting;
+	bool deferMissing;                     //!< while building a block, a reference to an unknown name may be resolved later
+	string missingName;                    //!< the first unknown name, referenced by the block being built
+	vector<string> builtNames;             //!< the elements, built since the waiting blocks were last checked
+	
 	void replaceRandomNumbers(int srcLine, char line[], Random& rnd);
+	bool parseFile(const char* filename, const string& namePrefix, ReferencedScene* reference, int depth);
+	void addElement(SceneElement* element, const SourceFile* source);
+	SceneElement* findReusable(SceneElement* element);
+	bool anythingBuilt() const;
+	void reportError(const ParsedBlockImpl& pb, const SyntaxError& err);
+	void reportError(const ParsedBlockImpl& pb, const FileNotFoundError& err);
+	void warnUnrecognized(ParsedBlockImpl& pb);
+	BuildResult fillBlock(ParsedBlockImpl& pb, bool allowDeferring);
+	bool closeBlock(ParsedBlockImpl& pb);
+	bool animate(ParsedBlockImpl& pb);
+	void addBlockElement(ParsedBlockImpl& pb);
+	bool closeReference(ParsedBlockImpl& pb, const string& name, int depth);
+	bool closeInstance(ParsedBlockImpl& pb, const string& name);
+	bool buildWaitingBlocks();
+	void recordMissing(const string& name);
+	void discardElement(SceneElement* element); //!< deletes an element, which isn't in the scene
 public:
 	DefaultSceneParser();
 	~DefaultSceneParser();
@@ -371,19 +605,40 @@ public:
 	Texture* findTextureByName(const char* name);
 	Geometry* findGeometryByName(const char* name);
 	Node* findNodeByName(const char* name);
+	const GlobalSettings& getSettings();
 
 	bool parse(const char* filename, Scene* s);
+	
+	void reuseElementsOf(Scene* previous) { this->previous = previous; }
+	void indexScene(Scene* scene); //!< makes the names of an already parsed scene known (see setFrame())
+	void setFrame(AnimatedElement& animation, double frame);
+	/// the elements of the previous scene, which the parsed one uses (they belong to both scenes)
+	const vector<SceneElement*>& getReusedElements() const { return reusedElements; }
 };
 
 DefaultSceneParser::DefaultSceneParser()
 {
 	curObj = NULL;
 	s = NULL;
-	sceneRootDir[0] = 0;
+	previous = NULL;
+	currentSource = NULL;
+	filling = NULL;
+	numBlocks = 0;
+	deferMissing = false;
 }
 
 DefaultSceneParser::~DefaultSceneParser()
 {
+	// (after a failed parse) the elements, which aren't in the scene yet:
+	for (auto& entry: waiting)
+		for (auto& pb: entry.second) discardElement(pb.element);
+	if (curObj) discardElement(curObj);
+}
+
+void DefaultSceneParser::discardElement(SceneElement* element)
+{
+	if (element->getElementType() != ELEM_SETTINGS) // (a part of the Scene itself)
+		delete element;
 }
 
 static void stripWhiteSpace(char* s)
@@ -400,32 +655,83 @@ static void stripWhiteSpace(char* s)
 	}
 }
 
+/**
+ * The scene file is read in a single pass, and each block is built (i.e., its element's fillProperties() is called)
+ * as soon as it is closed, so only the current block is kept in memory. If a block references an element, which
+ * isn't built yet (it is further down in the file), the block waits until that element is built. The blocks, which
+ * are still waiting at the end of the file, are built the way a block-ordered parser would do it: all their names
+ * are visible to each other, and they are built by type (geometries first, etc.).
+ *
+ * The blocks are built in the order they appear, so GlobalSettings should be at the top of the file (there's a
+ * warning, if it isn't).
+ */
 bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 {
-	Random& rnd = getRandomGen(0);
 	s = ss;
 	curObj = NULL;
-	curLine = 0;
 	s->environment = NULL;
-	//
+	if (previous) {
+		for (auto element: previous->getAllElements())
+			if (element->getElementType() != ELEM_SETTINGS) // (a part of the Scene itself)
+				previousElements.insert(make_pair(string(element->className) + ' ' + element->name, element));
+	}
+	if (!parseFile(filename, "", NULL, 0)) return false;
+	if (!buildWaitingBlocks()) return false;
+	// the motion of the animated nodes depends on the camera's shutter, which may be defined after them:
+	if (s->camera && s->camera->shutter > 0)
+		for (auto animation: s->animated) setFrame(*animation, s->settings.animationStart);
+	// filter out the nodes[] array; any nodes, which don't have a shader attached are transferred to the
+	// subnodes array:
+	for (int i = (int) s->nodes.size() - 1; i >= 0; i--)
+		if (!s->nodes[i]->shader) s->superNodes.push_back(s->nodes[i]);
+	s->nodes.erase(std::remove_if(s->nodes.begin(), s->nodes.end(), [] (Node* node) { return !node->shader; }),
+	               s->nodes.end());
+	s->sourceFiles.clear();
+	for (auto& source: sources) s->sourceFiles.push_back(source.fileName);
+	return true;
+}
+
+/**
+ * Reads a scene file, or a part of a scene: one included by an `Include "file.fray"' line (as if its text was
+ * in the including file), or a sub-scene, loaded by a Reference block (with all its names prefixed by namePrefix).
+ */
+bool DefaultSceneParser::parseFile(const char* filename, const string& namePrefix, ReferencedScene* reference,
+                                   int depth)
+{
+	if (depth > MAX_INCLUDE_DEPTH) {
+		fprintf(stderr, "Cannot read `%s': too many nested Include/Reference files (do they include each other?)\n",
+		        filename);
+		return false;
+	}
+	Random& rnd = getRandomGen(0);
 	FILE* f = fopen(filename, "rt");
 	if (!f) {
 		fprintf(stderr, "Cannot open scene file `%s'!\n", filename);
 		return false;
 	}
+	sources.push_back(SourceFile());
+	SourceFile* source = &sources.back();
+	source->fileName = filename;
+	source->namePrefix = namePrefix;
+	source->reference = reference;
 	int i = (int) strlen(filename) - 1;
-	sceneRootDir[0] = 0;
+	source->rootDir[0] = 0;
 	while (i >= 0 && (filename[i] != '/' && filename[i] != '\\')) i--;
 	if (i >= 0) {
 		i++;
-		strncpy(sceneRootDir, filename, i);
-		sceneRootDir[i] = 0;
+		strncpy(source->rootDir, filename, i);
+		source->rootDir[i] = 0;
 	}
+	SourceFile* includingSource = currentSource;
+	currentSource = source;
 	FileRAII fraii(f);
 	char line[1024];
+	int curLine = 0;
 	bool commentedOut = false;
-	vector<ParsedBlockImpl> parsedBlocks;
-	ParsedBlockImpl* cblock = NULL;
+	bool inBlock = false;
+	string directive; // the kind of the current block, if it's not an element (a Reference or an Instance)
+	string blockName;
+	ParsedBlockImpl cblock;
 	while (fgets(line, sizeof(line), f)) {
 		curLine++;
 		if (commentedOut) {
@@ -448,7 +754,21 @@ bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 		}
 		replaceRandomNumbers(curLine, line, rnd);
 		vector<string> tokens = tokenize(line);
-		if (!curObj) {
+		if (!inBlock) {
+			if (tokens[0] == "Include") {
+				char includeName[256] = "";
+				sscanf(line, "Include \"%255[^\"]\"", includeName);
+				if (!includeName[0]) {
+					fprintf(stderr, "%s:%d: Expected a line like `Include \"file.fray\"'\n", filename, curLine);
+					return false;
+				}
+				if (!resolveFullPath(includeName)) {
+					fprintf(stderr, "%s:%d: Included file not found (%s)\n", filename, curLine, includeName);
+					return false;
+				}
+				if (!parseFile(includeName, namePrefix, reference, depth + 1)) return false;
+				continue;
+			}
 			switch (tokens.size()) {
 				case 1:
 				{
@@ -464,8 +784,6 @@ bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 						fprintf(stderr, "A singleton object definition should end with a `{' (on line %d)\n", curLine);
 						return false;
 					}
-					curObj = newSceneElement(tokens[0].c_str());
-					if (curObj) curObj->name[0] = 0;
 					break;
 				}
 				case 3:
@@ -474,7 +792,6 @@ bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 						fprintf(stderr, "A object definition should end with a `{' (on line %d)\n", curLine);
 						return false;
 					}
-					curObj = newSceneElement(tokens[0].c_str());
 					break;
 				}
 				default:
@@ -483,34 +800,46 @@ bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 					return false;
 				}
 			}
+			inBlock = true;
+			if (tokens[0] == "Reference" || tokens[0] == "Instance") {
+				if (tokens.size() != 3) {
+					fprintf(stderr, "A %s needs a name (on line %d)\n", tokens[0].c_str(), curLine);
+					return false;
+				}
+				directive = tokens[0];
+				blockName = tokens[1];
+				cblock.begin(this, NULL, source, curLine, numBlocks++);
+				continue;
+			}
+			directive.clear();
+			if (tokens.size() == 3 && namePrefix.length() + tokens[1].length() >= sizeof(SceneElement::name)) {
+				fprintf(stderr, "%s:%d: The name `%s%s' is too long (at most %d characters)\n", filename, curLine,
+				        namePrefix.c_str(), tokens[1].c_str(), (int) sizeof(SceneElement::name) - 1);
+				return false;
+			}
+			curObj = newSceneElement(tokens[0].c_str());
 			if (curObj) {
-				strcpy(curObj->name, tokens[1].c_str());
-				parsedBlocks.push_back(ParsedBlockImpl());
-				cblock = &parsedBlocks[parsedBlocks.size() - 1];
-				cblock->parser = this;
-				cblock->element = curObj;
-				cblock->blockBegin = curLine;
+				if (tokens.size() == 3)
+					snprintf(curObj->name, sizeof(curObj->name), "%s%s", namePrefix.c_str(), tokens[1].c_str());
+				else
+					strcpy(curObj->name, tokens[1].c_str());
+				snprintf(curObj->className, sizeof(curObj->className), "%s", tokens[0].c_str());
+				cblock.begin(this, curObj, source, curLine, numBlocks++);
 			} else {
 				fprintf(stderr, "Unknown object class `%s' on line %d\n", tokens[0].c_str(), curLine);
 				return false;
 			}
-			ElementType et = curObj->getElementType();
-			switch (et) {
-				case ELEM_GEOMETRY: s->geometries.push_back((Geometry*)curObj); break;
-				case ELEM_SHADER: s->shaders.push_back((Shader*)curObj); break;
-				case ELEM_TEXTURE: s->textures.push_back((Texture*)curObj); break;
-				case ELEM_NODE: s->nodes.push_back((Node*)curObj); break;
-				case ELEM_ENVIRONMENT: s->environment = (Environment*) curObj; break;
-				case ELEM_CAMERA: s->camera = (Camera*)curObj; break;
-				case ELEM_LIGHT: s->lights.push_back((Light*) curObj); break;
-				default: break;
-			}
 		} else {
 			if (tokens.size() == 1) {
 				if (tokens[0] == "}") {
-					cblock->blockEnd = curLine;
-					curObj = NULL;
-					cblock = NULL;
+					cblock.blockEnd = curLine;
+					inBlock = false;
+					curObj = NULL; // (the block owns it now)
+					bool ok;
+					if (directive == "Reference") ok = closeReference(cblock, blockName, depth);
+					else if (directive == "Instance") ok = closeInstance(cblock, blockName);
+					else ok = closeBlock(cblock);
+					if (!ok) return false;
 				} else {
 					fprintf(stderr, "Unexpected token in object definition on line %d: `%s'\n", curLine, tokens[0].c_str());
 					return false;
@@ -524,85 +853,436 @@ bool DefaultSceneParser::parse(const char* filename, Scene* ss)
 					line[l] = 0;
 					i++;
 				}
-				ParsedBlockImpl::LineInfo info;
-				cblock->lines.push_back(ParsedBlockImpl::LineInfo(curLine, tokens[0].c_str(), line + i));
+				try {
+					cblock.addLine(curLine, tokens[0], line + i);
+				}
+				catch (SyntaxError err) {
+					reportError(cblock, err);
+					return false;
+				}
 			}
 		}
 	}
-	if (curObj) {
+	if (inBlock) {
 		fprintf(stderr, "Unfinished object definition at EOF!\n");
 		return false;
 	}
-	const int element_types_order[] = {
-		ELEM_SETTINGS, ELEM_CAMERA, ELEM_ENVIRONMENT, ELEM_LIGHT, ELEM_GEOMETRY, ELEM_TEXTURE, ELEM_SHADER, ELEM_NODE, //ELEM_ATMOSPHERIC
-	};
-	// process all parsed blocks, but first process all singletons, then process geometries first, etc.
-	for (int ei = 0; ei < (int) (sizeof(element_types_order) / sizeof(element_types_order[0])); ei++) {
-		for (int i = 0; i < (int) parsedBlocks.size(); i++) {
-			ParsedBlockImpl& pb = parsedBlocks[i];
-			if (pb.element->getElementType() == element_types_order[ei]) {
-				try {
-					pb.element->fillProperties(pb);
-				}
-				catch (SyntaxError err) {
-					fprintf(stderr, "%s:%d: Syntax error on line %d: %s\n", filename, err.line, err.line, err.msg);
+	currentSource = includingSource;
+	return true;
+}
+
+/// puts a built element in the scene, and makes it visible to the blocks, which reference it
+void DefaultSceneParser::addElement(SceneElement* element, const SourceFile* source)
+{
+	string name = element->name;
+	switch (element->getElementType()) {
+		case ELEM_GEOMETRY:
+			s->geometries.push_back((Geometry*) element);
+			geometriesByName.insert(make_pair(name, (Geometry*) element));
+			break;
+		case ELEM_SHADER:
+			s->shaders.push_back((Shader*) element);
+			shadersByName.insert(make_pair(name, (Shader*) element));
+			break;
+		case ELEM_TEXTURE:
+			s->textures.push_back((Texture*) element);
+			texturesByName.insert(make_pair(name, (Texture*) element));
+			break;
+		case ELEM_NODE:
+			if (source->reference) { // (only the Instances of a sub-scene are rendered)
+				s->superNodes.push_back((Node*) element);
+				source->reference->prototypes.push_back((Node*) element);
+			} else {
+				s->nodes.push_back((Node*) element);
+			}
+			nodesByName.insert(make_pair(name, (Node*) element));
+			break;
+		case ELEM_ENVIRONMENT: s->environment = (Environment*) element; break;
+		case ELEM_CAMERA: s->camera = (Camera*) element; break;
+		case ELEM_LIGHT: s->lights.push_back((Light*) element); break;
+		default: break;
+	}
+	if (waiting.count(name)) builtNames.push_back(name);
+}
+
+/// whether any element (other than the settings) has been built into the scene so far
+bool DefaultSceneParser::anythingBuilt() const
+{
+	return !s->geometries.empty() || !s->textures.empty() || !s->shaders.empty() || !s->nodes.empty()
+	    || !s->superNodes.empty() || !s->lights.empty() || s->camera || s->environment;
+}
+
+/// finds the element of the previous scene, which can be used instead of the given (just parsed, but not built) one
+SceneElement* DefaultSceneParser::findReusable(SceneElement* element)
+{
+	auto it = previousElements.find(string(element->className) + ' ' + element->name);
+	if (it == previousElements.end() || it->second->sourceHash != element->sourceHash) return NULL;
+	// its properties may be the same, but not the settings it was built with:
+	if (it->second->usesSettings && previous->settings.sourceHash != s->settings.sourceHash) return NULL;
+	// two identical blocks (e.g. unnamed lights, which are all called "{") map to the same old element; only the first
+	// one gets it, or it would be in the scene (and deleted) twice:
+	if (reusedSet.count(it->second)) return NULL;
+	// it can only be reused if everything it references is reused as well (otherwise, it would point to
+	// elements of the previous scene, which are deleted). References further down the file aren't known yet,
+	// so they make the element be built anew:
+	for (auto dep: it->second->dependencies)
+		if (!reusedSet.count(dep)) return NULL;
+	return it->second;
+}
+
+void DefaultSceneParser::reportError(const ParsedBlockImpl& pb, const SyntaxError& err)
+{
+	const char* filename = pb.source->fileName.c_str();
+	fprintf(stderr, "%s:%d: Syntax error on line %d: %s\n", filename, err.line, err.line, err.msg);
+}
+
+void DefaultSceneParser::reportError(const ParsedBlockImpl& pb, const FileNotFoundError& err)
+{
+	const char* filename = pb.source->fileName.c_str();
+	fprintf(stderr, "%s:%d: Required file not found (%s) (required at line %d)\n", filename, err.line, err.filename, err.line);
+}
+
+void DefaultSceneParser::warnUnrecognized(ParsedBlockImpl& pb)
+{
+	for (int i = 0; i < (int) pb.lines.size(); i++)
+		if (!pb.lines[i].recognized)
+			fprintf(stderr, "%s:%d: Warning: the property `%s' isn't recognized!\n", pb.source->fileName.c_str(),
+			        pb.lines[i].line, pb.propName(i));
+}
+
+DefaultSceneParser::BuildResult DefaultSceneParser::fillBlock(ParsedBlockImpl& pb, bool allowDeferring)
+{
+	SourceFile* readSource = currentSource;
+	currentSource = pb.source; // (the names and the paths in the block are relative to its file)
+	deferMissing = allowDeferring;
+	missingName.clear();
+	BuildResult result = BUILD_OK;
+	filling = pb.element;
+	try {
+		pb.element->fillProperties(pb);
+		warnUnrecognized(pb);
+	}
+	catch (SyntaxError err) {
+		if (allowDeferring && !missingName.empty()) {
+			result = BUILD_DEFERRED;
+		} else {
+			reportError(pb, err);
+			result = BUILD_ERROR;
+		}
+	}
+	catch (FileNotFoundError err) {
+		reportError(pb, err);
+		result = BUILD_ERROR;
+	}
+	filling = NULL;
+	currentSource = readSource;
+	return result;
+}
+
+/// builds (or reuses) the element of a just closed block, and then the blocks, which were waiting for it
+bool DefaultSceneParser::closeBlock(ParsedBlockImpl& pb)
+{
+	if (pb.source->reference) {
+		// a sub-scene only provides the objects; the settings, the camera, etc. are the referencing scene's:
+		ElementType type = pb.element->getElementType();
+		if (type == ELEM_SETTINGS || type == ELEM_CAMERA || type == ELEM_ENVIRONMENT || type == ELEM_LIGHT) {
+			if (type == ELEM_LIGHT)
+				fprintf(stderr, "%s:%d: Warning: lights in referenced scenes are ignored\n",
+				        pb.source->fileName.c_str(), pb.blockBegin);
+			discardElement(pb.element);
+			return true;
+		}
+		// the Instances copy the transform of their prototypes once, so a prototype, which moves, would leave them
+		// behind (its geometry and its shader may be keyed, as they are shared with the Instances):
+		if (type == ELEM_NODE && pb.isAnimated()) {
+			reportError(pb, SyntaxError(pb.blockBegin, "Nodes in referenced scenes can't have keyed properties "
+			                            "(their Instances wouldn't move)"));
+			discardElement(pb.element);
+			return false;
+		}
+	}
+	if (pb.element->getElementType() == ELEM_SETTINGS && anythingBuilt()) {
+		// the blocks above it have already been built with the defaults (e.g. their textures aren't paged through
+		// the texture cache, and their keys are taken at frame 0):
+		fprintf(stderr, "%s:%d: Warning: GlobalSettings should come before the other blocks; the ones above it "
+		        "ignore it\n", pb.source->fileName.c_str(), pb.blockBegin);
+	}
+	pb.element->sourceHash = pb.contentsHash();
+	if (pb.isAnimated() && !animate(pb)) return false;
+	vector<ParsedBlockImpl> ready;
+	// (an animated element isn't reused, as it may be left at some other frame)
+	if (SceneElement* old = previous && !pb.animation ? findReusable(pb.element) : NULL) {
+		discardElement(pb.element);
+		pb.element = old;
+		reusedElements.push_back(old);
+		reusedSet.insert(old);
+		addElement(old, pb.source);
+	} else {
+		ready.push_back(std::move(pb));
+	}
+	do {
+		for (int i = 0; i < (int) ready.size(); i++) {
+			ParsedBlockImpl& block = ready[i];
+			switch (fillBlock(block, true)) {
+				case BUILD_OK: addBlockElement(block); break;
+				case BUILD_ERROR:
+				{
+					for (; i < (int) ready.size(); i++) discardElement(ready[i].element);
 					return false;
 				}
-				catch (FileNotFoundError err) {
-					fprintf(stderr, "%s:%d: Required file not found (%s) (required at line %d)\n", filename, err.line, err.filename, err.line);
-					return false;
+				case BUILD_DEFERRED:
+				{
+					// fillProperties() may have changed it partially; it is rebuilt from scratch when it's retried:
+					SceneElement* fresh = newSceneElement(block.element->className);
+					strcpy(fresh->name, block.element->name);
+					strcpy(fresh->className, block.element->className);
+					fresh->sourceHash = block.element->sourceHash;
+					delete block.element;
+					block.element = fresh;
+					for (auto& line: block.lines) line.recognized = false;
+					waiting[missingName].push_back(std::move(block));
+					break;
 				}
-				for (int i = 0; i < (int) pb.lines.size(); i++)
-					if (!pb.lines[i].recognized)
-						fprintf(stderr, "%s:%d: Warning: the property `%s' isn't recognized!\n", filename, pb.lines[i].line, pb.lines[i].propName);
 			}
 		}
+		ready.clear();
+		for (auto& name: builtNames) {
+			auto it = waiting.find(name);
+			if (it == waiting.end()) continue;
+			for (auto& block: it->second) ready.push_back(std::move(block));
+			waiting.erase(it);
+		}
+		builtNames.clear();
+	} while (!ready.empty());
+	return true;
+}
+
+/// keeps the keyed properties of a just closed block, and replaces them with their values at the first frame
+bool DefaultSceneParser::animate(ParsedBlockImpl& pb)
+{
+	ParsedBlockImpl frameBlock;
+	try {
+		pb.getFrame(s->settings.animationStart, frameBlock);
 	}
-	// filter out the nodes[] array; any nodes, which don't have a shader attached are transferred to the
-	// subnodes array:
-	for (int i = (int) s->nodes.size() - 1; i >= 0; i--) {
-		if (!s->nodes[i]->shader) {
-			s->superNodes.push_back(s->nodes[i]);
-			s->nodes.erase(s->nodes.begin() + i);
+	catch (SyntaxError err) {
+		reportError(pb, err);
+		discardElement(pb.element);
+		return false;
+	}
+	AnimatedElement* animation = new AnimatedElement;
+	s->animated.push_back(animation);
+	animation->source = *pb.source;
+	animation->source.reference = NULL;
+	animation->frameText = frameBlock.text;
+	animation->keys = std::move(pb);
+	animation->keys.source = &animation->source;
+	animation->keys.element = NULL; // (until it's built)
+	pb = std::move(frameBlock);
+	pb.animation = animation;
+	pb.frame = s->settings.animationStart;
+	return true;
+}
+
+void DefaultSceneParser::addBlockElement(ParsedBlockImpl& pb)
+{
+	addElement(pb.element, pb.source);
+	if (pb.animation) pb.animation->keys.element = pb.element;
+}
+
+/// loads the sub-scene of a just closed Reference block (unless the same file is already loaded)
+bool DefaultSceneParser::closeReference(ParsedBlockImpl& pb, const string& name, int depth)
+{
+	char filename[256];
+	try {
+		if (!pb.getFilenameProp("file", filename)) pb.requiredProp("file");
+	}
+	catch (SyntaxError err) {
+		reportError(pb, err);
+		return false;
+	}
+	catch (FileNotFoundError err) {
+		reportError(pb, err);
+		return false;
+	}
+	warnUnrecognized(pb);
+	string fullName = currentSource->namePrefix + name;
+	ReferencedScene* reference;
+	auto it = referencesByFile.find(filename);
+	if (it != referencesByFile.end()) {
+		reference = it->second; // (its elements keep the names from the first Reference)
+	} else {
+		references.push_back(ReferencedScene());
+		reference = &references.back();
+		reference->namePrefix = fullName + "::";
+		referencesByFile[filename] = reference;
+		// the sub-scene only references its own elements, so it's completely built here:
+		std::unordered_map<string, vector<ParsedBlockImpl>> referencingWaiting;
+		std::swap(waiting, referencingWaiting);
+		bool ok = parseFile(filename, reference->namePrefix, reference, depth + 1) && buildWaitingBlocks();
+		std::swap(waiting, referencingWaiting);
+		if (!ok) {
+			for (auto& entry: referencingWaiting) // (so that they're freed)
+				for (auto& block: entry.second) waiting[entry.first].push_back(std::move(block));
+			return false;
 		}
 	}
+	referencesByName.insert(make_pair(fullName, reference));
 	return true;
 }
 
-Shader* DefaultSceneParser::findShaderByName(const char* name)
+/// adds copies of the nodes of a referenced sub-scene, with the transform of a just closed Instance block
+bool DefaultSceneParser::closeInstance(ParsedBlockImpl& pb, const string& name)
 {
-	for (auto& shader: s->shaders) {
-		if (!strcmp(shader->name, name)) {
-			return shader;
+	char referenceName[256];
+	Transform T;
+	try {
+		if (!pb.getStringProp("reference", referenceName)) pb.requiredProp("reference");
+		pb.getTransformProp(T);
+	}
+	catch (SyntaxError err) {
+		reportError(pb, err);
+		return false;
+	}
+	warnUnrecognized(pb);
+	auto it = referencesByName.find(currentSource->namePrefix + referenceName);
+	if (it == referencesByName.end()) {
+		reportError(pb, SyntaxError(pb.blockBegin, "Reference `%s' not defined (it should be before its Instances)",
+		                            referenceName));
+		return false;
+	}
+	const ReferencedScene& reference = *it->second;
+	string fullName = currentSource->namePrefix + name;
+	for (Node* prototype: reference.prototypes) {
+		if (!prototype->shader) continue;
+		const char* prototypeName = prototype->name;
+		if (!strncmp(prototypeName, reference.namePrefix.c_str(), reference.namePrefix.length()))
+			prototypeName += reference.namePrefix.length();
+		string nodeName = fullName + "::" + prototypeName;
+		if (nodeName.length() >= sizeof(Node::name)) {
+			reportError(pb, SyntaxError(pb.blockBegin, "The name of the instanced node `%s' is too long (at most %d characters)",
+			                            nodeName.c_str(), (int) sizeof(Node::name) - 1));
+			return false;
 		}
+		Node* node = new Node;
+		strcpy(node->name, nodeName.c_str());
+		strcpy(node->className, prototype->className);
+		node->geometry = prototype->geometry;
+		node->shader = prototype->shader;
+		node->bump = prototype->bump;
+		node->T = prototype->T;
+		node->T.append(T);
+		node->dependencies = prototype->dependencies;
+		addElement(node, currentSource);
 	}
-	return NULL;
+	return true;
 }
-Geometry* DefaultSceneParser::findGeometryByName(const char* name)
+
+/// builds the blocks, whose references weren't resolved by the end of the file
+bool DefaultSceneParser::buildWaitingBlocks()
+{
+	vector<ParsedBlockImpl> blocks;
+	for (auto& entry: waiting)
+		for (auto& pb: entry.second) blocks.push_back(std::move(pb));
+	waiting.clear();
+	std::sort(blocks.begin(), blocks.end(), [] (const ParsedBlockImpl& a, const ParsedBlockImpl& b) {
+		return a.order < b.order;
+	});
+	for (auto& pb: blocks) addBlockElement(pb);
+	const int element_types_order[] = {
+		ELEM_SETTINGS, ELEM_CAMERA, ELEM_ENVIRONMENT, ELEM_LIGHT, ELEM_GEOMETRY, ELEM_TEXTURE, ELEM_SHADER, ELEM_NODE, //ELEM_ATMOSPHERIC
+	};
+	for (int ei = 0; ei < (int) (sizeof(element_types_order) / sizeof(element_types_order[0])); ei++)
+		for (auto& pb: blocks)
+			if (pb.element->getElementType() == element_types_order[ei] && fillBlock(pb, false) != BUILD_OK)
+				return false;
+	return true;
+}
+
+void DefaultSceneParser::indexScene(Scene* scene)
+{
+	s = scene;
+	for (auto geom: scene->geometries) geometriesByName.insert(make_pair(string(geom->name), geom));
+	for (auto shader: scene->shaders) shadersByName.insert(make_pair(string(shader->name), shader));
+	for (auto texture: scene->textures) texturesByName.insert(make_pair(string(texture->name), texture));
+	for (auto node: scene->superNodes) nodesByName.insert(make_pair(string(node->name), node));
+	for (auto node: scene->nodes) nodesByName.insert(make_pair(string(node->name), node));
+}
+
+/// fills an animated element with its properties at the given frame (if they differ from the current ones)
+void DefaultSceneParser::setFrame(AnimatedElement& animation, double frame)
 {
-	for (auto& geom: s->geometries) {
-		if (!strcmp(geom->name, name)) {
-			return geom;
+	if (!animation.keys.element) return;
+	ParsedBlockImpl pb;
+	currentSource = &animation.source;
+	animation.keys.parser = this;
+	try {
+		animation.keys.getFrame(frame, pb);
+		pb.animation = &animation;
+		pb.frame = frame;
+		string frameText = pb.text;
+		if (s->camera && s->camera->shutter > 0 && pb.element->getElementType() == ELEM_NODE) {
+			// a moving node also depends on the keys within the shutter interval (see Node::motion):
+			pb.shutter = s->camera->shutter;
+			for (int i = 1; i < MOTION_BLUR_STEPS; i++) {
+				ParsedBlockImpl moment;
+				animation.keys.getFrame(frame + pb.shutter * i / (MOTION_BLUR_STEPS - 1), moment);
+				frameText += moment.text;
+			}
 		}
+		if (frameText == animation.frameText) return;
+		animation.frameText = frameText; // (before filling: parsing the values may change them)
+		pb.element->fillProperties(pb);
+	}
+	catch (SyntaxError err) {
+		reportError(pb, err);
 	}
+	catch (FileNotFoundError err) {
+		reportError(pb, err);
+	}
+	pb.element->markChanged();
+}
+
+void DefaultSceneParser::recordMissing(const string& name)
+{
+	if (deferMissing && missingName.empty()) missingName = name;
+}
+
+Shader* DefaultSceneParser::findShaderByName(const char* name)
+{
+	string fullName = currentSource->namePrefix + name;
+	auto it = shadersByName.find(fullName);
+	if (it != shadersByName.end()) return it->second;
+	recordMissing(fullName);
+	return NULL;
+}
+Geometry* DefaultSceneParser::findGeometryByName(const char* name)
+{
+	string fullName = currentSource->namePrefix + name;
+	auto it = geometriesByName.find(fullName);
+	if (it != geometriesByName.end()) return it->second;
+	recordMissing(fullName);
 	return NULL;
 }
 Texture* DefaultSceneParser::findTextureByName(const char* name)
 {
-	for (auto& tex: s->textures) {
-		if (!strcmp(tex->name, name)) {
-			return tex;
-		}
-	}
+	string fullName = currentSource->namePrefix + name;
+	auto it = texturesByName.find(fullName);
+	if (it != texturesByName.end()) return it->second;
+	recordMissing(fullName);
 	return NULL;
 }
+const GlobalSettings& DefaultSceneParser::getSettings()
+{
+	if (filling) filling->usesSettings = true;
+	return s->settings;
+}
+
 Node* DefaultSceneParser::findNodeByName(const char* name)
 {
-	for (auto& node: s->nodes) {
-		if (!strcmp(node->name, name)) {
-			return node;
-		}
-	}
+	string fullName = currentSource->namePrefix + name;
+	auto it = nodesByName.find(fullName);
+	if (it != nodesByName.end()) return it->second;
+	recordMissing(fullName);
 	return NULL;
 }
 
@@ -710,7 +1390,7 @@ void stripPunctuation(char* s)
 bool DefaultSceneParser::resolveFullPath(char* path)
 {
 	char temp[256];
-	strcpy(temp, sceneRootDir);
+	strcpy(temp, currentSource ? currentSource->rootDir : "");
 	strcat(temp, path);
 	if (fileExists(temp)) {
 		strcpy(path, temp);
@@ -742,6 +1422,7 @@ Scene::~Scene()
 	disposeArray(textures);
 	disposeArray(shaders);
 	disposeArray(lights);
+	disposeArray(animated);
 	if (environment) delete environment;
 	environment = NULL;
 	if (camera) delete camera;
@@ -754,30 +1435,116 @@ bool Scene::parseScene(const char* filename)
 	return parser.parse(filename, this);
 }
 
+void Scene::setFrame(double frame)
+{
+	if (animated.empty()) return;
+	DefaultSceneParser parser;
+	parser.indexScene(this);
+	for (auto animation: animated) parser.setFrame(*animation, frame);
+}
+
+std::vector<SceneElement*> Scene::getAllElements()
+{
+	vector<SceneElement*> result;
+	result.insert(result.end(), geometries.begin(), geometries.end());
+	result.insert(result.end(), textures.begin(), textures.end());
+	result.insert(result.end(), shaders.begin(), shaders.end());
+	result.insert(result.end(), superNodes.begin(), superNodes.end());
+	result.insert(result.end(), nodes.begin(), nodes.end());
+	result.insert(result.end(), lights.begin(), lights.end());
+	result.push_back(camera);
+	result.push_back(&settings);
+	if (environment) result.push_back(environment);
+	return result;
+}
+
+uint64_t Scene::getContentsHash()
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (auto element: getAllElements()) {
+		if (!element) continue;
+		for (const char* p = element->name; *p; p++) hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+		hash = (hash ^ element->sourceHash) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+bool Scene::reloadScene(const char* filename)
+{
+	Scene fresh;
+	DefaultSceneParser parser;
+	parser.reuseElementsOf(this);
+	bool ok = parser.parse(filename, &fresh);
+	// the reused elements are in both scenes now; only keep them in the one, which stays:
+	(ok ? *this : fresh).forgetElements(parser.getReusedElements());
+	if (!ok) return false;
+	std::swap(geometries, fresh.geometries);
+	std::swap(shaders, fresh.shaders);
+	std::swap(nodes, fresh.nodes);
+	std::swap(superNodes, fresh.superNodes);
+	std::swap(textures, fresh.textures);
+	std::swap(lights, fresh.lights);
+	std::swap(sourceFiles, fresh.sourceFiles);
+	std::swap(animated, fresh.animated);
+	std::swap(environment, fresh.environment);
+	std::swap(camera, fresh.camera);
+	std::swap(settings, fresh.settings);
+	return true; // (the old elements are deleted along with `fresh')
+}
+
+template<typename T>
+static void removeElements(vector<T*>& objects, const std::unordered_set<SceneElement*>& elements)
+{
+	objects.erase(std::remove_if(objects.begin(), objects.end(), [&elements] (T* object) {
+		return elements.count((SceneElement*) object) > 0;
+	}), objects.end());
+}
+
+void Scene::forgetElements(const vector<SceneElement*>& elementList)
+{
+	std::unordered_set<SceneElement*> elements(elementList.begin(), elementList.end());
+	removeElements(geometries, elements);
+	removeElements(shaders, elements);
+	removeElements(nodes, elements);
+	removeElements(superNodes, elements);
+	removeElements(textures, elements);
+	removeElements(lights, elements);
+	if (elements.count((SceneElement*) environment)) environment = NULL;
+	if (elements.count((SceneElement*) camera)) camera = NULL;
+}
+
 void Scene::beginRender()
 {
-	for (auto& element: geometries) element->beginRender();
-	for (auto& element: textures) element->beginRender();
-	for (auto& element: shaders) element->beginRender();
-	for (auto& element: superNodes) element->beginRender();
-	for (auto& element: nodes) element->beginRender();
-	for (auto& element: lights) element->beginRender();
-	camera->beginRender();
-	settings.beginRender();
-	if (environment) environment->beginRender();
+	std::unordered_map<SceneElement*, unsigned> stamps;
+	for (auto& element: getAllElements()) {
+		element->beginRender();
+		element->preparedStamp = upstreamGeneration(element, stamps);
+	}
 }
 
-void Scene::beginFrame()
+bool Scene::beginFrame()
 {
-	for (auto& element: geometries) element->beginFrame();
-	for (auto& element: textures) element->beginFrame();
-	for (auto& element: shaders) element->beginFrame();
-	for (auto& element: superNodes) element->beginFrame();
-	for (auto& element: nodes) element->beginFrame();
-	for (auto& element: lights) element->beginFrame();
-	camera->beginFrame();
-	settings.beginFrame();
-	if (environment) environment->beginFrame();
+	// only redo the (possibly expensive) preparations, e.g. KD trees or mipmaps, of what actually changed.
+	// (beginRender() doesn't change any generation, so the stamps stay valid for the whole call):
+	vector<SceneElement*> elements = getAllElements();
+	std::unordered_map<SceneElement*, unsigned> stamps;
+	for (auto& element: elements) {
+		unsigned stamp = upstreamGeneration(element, stamps);
+		if (stamp != element->preparedStamp) {
+			element->beginRender();
+			element->preparedStamp = stamp;
+		}
+	}
+	bool changed = false;
+	for (auto& element: elements) {
+		unsigned stamp = stamps[element];
+		if (stamp != element->frameStamp) {
+			element->beginFrame();
+			element->frameStamp = stamp;
+			if (element != camera) changed = true;
+		}
+	}
+	return changed;
 }
 
 GlobalSettings::GlobalSettings()
@@ -794,6 +1561,36 @@ GlobalSettings::GlobalSettings()
 	numPaths = 10;
 	numThreads = 0;
 	interactive = fullscreen = false;
+	targetFrameTime = 0.1;
+	maxPixelStep = 4;
+	reprojection = false;
+	reprojectionRefresh = 0.05;
+	environmentLighting = false;
+	aoSamples = 0;
+	aoDistance = 1e99;
+	textureCacheSize = 0;
+	textureCacheDir[0] = 0;
+	collectStats = false;
+	statsFile[0] = 0;
+	statsHeatmap[0] = 0;
+	animationStart = 0;
+	animationEnd = -1;
+	strcpy(outputFile, "fray_%04d.exr");
+	checkpointFile[0] = 0;
+	checkpointInterval = 60;
+}
+
+/// checks that the format has a single %d (optionally, with a width like %04d), and no other conversions
+static bool isFrameNumberFormat(const char* format)
+{
+	int numbers = 0;
+	for (const char* p = strchr(format, '%'); p; p = strchr(p, '%')) {
+		p++;
+		while (isdigit(*p)) p++;
+		if (*p != 'd') return false;
+		numbers++;
+	}
+	return numbers == 1;
 }
 
 void GlobalSettings::fillProperties(ParsedBlock& pb)
@@ -811,6 +1608,25 @@ void GlobalSettings::fillProperties(ParsedBlock& pb)
 	pb.getIntProp("numThreads", &numThreads);
 	pb.getBoolProp("interactive", &interactive);
 	pb.getBoolProp("fullscreen", &fullscreen);
+	pb.getDoubleProp("targetFrameTime", &targetFrameTime, 0);
+	pb.getIntProp("maxPixelStep", &maxPixelStep, 1, 16);
+	pb.getBoolProp("reprojection", &reprojection);
+	pb.getDoubleProp("reprojectionRefresh", &reprojectionRefresh, 0.001, 1);
+	pb.getBoolProp("environmentLighting", &environmentLighting);
+	pb.getIntProp("aoSamples", &aoSamples, 0);
+	pb.getDoubleProp("aoDistance", &aoDistance, 0);
+	pb.getIntProp("textureCacheSize", &textureCacheSize, 0);
+	if (pb.getStringProp("textureCacheDir", textureCacheDir) && !fileExists(textureCacheDir))
+		pb.signalError("textureCacheDir does not exist");
+	pb.getBoolProp("collectStats", &collectStats);
+	pb.getStringProp("statsFile", statsFile);
+	pb.getStringProp("statsHeatmap", statsHeatmap);
+	pb.getIntProp("animationStart", &animationStart, 0);
+	pb.getIntProp("animationEnd", &animationEnd);
+	if (pb.getStringProp("outputFile", outputFile) && !isFrameNumberFormat(outputFile))
+		pb.signalError("outputFile should contain a single %%d (or e.g. %%04d) for the frame number");
+	pb.getStringProp("checkpointFile", checkpointFile);
+	pb.getDoubleProp("checkpointInterval", &checkpointInterval, 1);
 }
 
 bool GlobalSettings::needAApass()
@@ -837,6 +1653,7 @@ SceneElement* DefaultSceneParser::newSceneElement(const char* className)
 	if (!strcmp(className, "Fresnel")) return new FresnelTexture;
 	if (!strcmp(className, "Node")) return new Node;
 	if (!strcmp(className, "CubemapEnvironment")) return new CubemapEnvironment;
+	if (!strcmp(className, "LatLongEnvironment")) return new LatLongEnvironment;
 	if (!strcmp(className, "Camera")) return new Camera;
 	if (!strcmp(className, "Mesh")) return new Mesh;
 	if (!strcmp(className, "BumpTexture")) return new BumpTexture;
@@ -25,7 +25,9 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include <limits.h>
+#include <stdint.h>
 #include "color.h"
 #include "vector.h"
 
@@ -53,15 +55,29 @@ class Light;
 struct Transform;
 
 class ParsedBlock;
+struct GlobalSettings;
 
 /// An abstract base class for each element of the scene (Camera, Geometries,...)
 /// i.e, anything, that could be described using our scene definition language
 class SceneElement {
 public:
 	char name[64]; //!< A name of this element (a string like "sphere01", "myCamera", etc)
+	char className[32]; //!< The class of this element, as written in the scene file (e.g. "Sphere", "Lambert")
+	
+	// change tracking (see Scene::beginFrame()):
+	unsigned generation;                     //!< incremented by markChanged()
+	unsigned preparedStamp, frameStamp;      //!< the upstream generation at the last beginRender() and beginFrame()
+	std::vector<SceneElement*> dependencies; //!< the elements, which this one references (filled by the parser)
+	uint64_t sourceHash;                     //!< a hash of the properties, as parsed (to find the unchanged elements on reload)
+	bool usesSettings;                       //!< it read the GlobalSettings while parsed (see SceneParser::getSettings())
+	
 	SceneElement(); //!< A constructor. It sets the name to the empty string.
 	virtual ~SceneElement() {} //!< a virtual destructor
 	
+	/// call this after changing any of the element's properties (after parsing is done)
+	void markChanged() { generation++; }
+	void addDependency(SceneElement* element); //!< this element uses `element' (duplicates are ignored)
+	
 	virtual ElementType getElementType() const = 0; //!< Gets the element type
 	
 	/**
@@ -116,7 +132,9 @@ public:
 	 *
 	 * The order of calling beginFrame within the same group is undefined.
 	 *
-	 * All these callbacks are called by the Scene::beginRender() function.
+	 * All these callbacks are called by the Scene::beginRender() function. If the element, or anything it
+	 * depends on, is changed later (see markChanged()), beginRender() is called again before the next frame, so
+	 * it should be safe to call it more than once.
 	 */
 	virtual void beginRender();
 	
@@ -125,7 +143,9 @@ public:
 	 *
 	 * the difference between beginRender() and beginFrame() is that beginRender() is only
 	 * called once, after parsing is done, whereas beginFrame is called before every frame
-	 * (e.g., when rendering an animation).
+	 * (e.g., when rendering an animation), in which the element, or anything it depends on, has changed.
+	 * It isn't called for the frames, in which nothing it depends on changed, so it should only compute
+	 * things from the element's properties (and the elements it depends on), not per-frame state.
 	 */
 	virtual void beginFrame();
 	
@@ -178,9 +198,13 @@ public:
 	virtual bool getBitmapFileProp(const char* name, Bitmap& value) = 0;
 	
 	// Gets a transform from the parsed block. Namely, it searches for all properties named
-	// "scale", "rotate" and "translate" and applies them to T.
+	// "scale", "rotate" and "translate" and sets T to them (applied in the order they are written).
 	virtual void getTransformProp(Transform& T) = 0;
 	
+	// With motion blur: gets the transform (as above) at the given time within the camera's shutter interval
+	// (0 = when it opens, 1 = when it closes). Returns false, if the block isn't animated (so it doesn't move).
+	virtual bool getMotionTransformProp(double time, Transform& T) = 0;
+	
 	virtual void requiredProp(const char* name) = 0; // signal an error (missing property of the given name)
 	
 	virtual void signalError(const char* msg) = 0; // signal an error with a specified message
@@ -201,6 +225,10 @@ public:
 	virtual Geometry* findGeometryByName(const char* name) = 0;
 	virtual Node* findNodeByName(const char* name) = 0;
 	
+	/// the settings of the scene being parsed (which, on a reload, isn't the global `scene'). The element, which
+	/// calls it, isn't reused on a reload, which changes the GlobalSettings
+	virtual const GlobalSettings& getSettings() = 0;
+	
 	
 	/**
 	 * resolveFullPath() tries to find a file (or folder), by appending the given path to the directory, where
@@ -217,7 +245,7 @@ public:
 };
 
 struct SyntaxError {
-	char msg[128];
+	char msg[256];
 	int line;
 	SyntaxError();
 	SyntaxError(int line, const char* format, ...);
@@ -269,6 +297,30 @@ struct GlobalSettings: public SceneElement {
 	int numThreads;              //!< # of threads for rendering; 0 = autodetect. 1 = single-threaded
 	bool interactive;            //!< interactive render
 	bool fullscreen;             //!< whether we should switch to fullscreen in interactive mode
+	double targetFrameTime;      //!< interactive mode: while the camera moves, lower the resolution if a frame takes longer (seconds; 0 = never)
+	int maxPixelStep;            //!< interactive mode: the lowest resolution is 1/maxPixelStep of the full one
+	bool reprojection;           //!< interactive mode: reuse the pixels of the previous frame (see reprojection.h)
+	double reprojectionRefresh;  //!< with reprojection: the fraction of pixels, which are traced anew in each frame anyway
+	
+	bool environmentLighting;    //!< use the environment's (preconvolved) irradiance instead of ambientLight (when not in GI mode)
+	int aoSamples;               //!< ambient occlusion rays per shading point, with environmentLighting (0 = no occlusion)
+	double aoDistance;           //!< occluders farther than this don't count for ambient occlusion
+	
+	int textureCacheSize;        //!< memory budget (in MB) for paging bitmap textures from disk; 0 = load them whole
+	char textureCacheDir[256];   //!< where to store the tiled textures (empty = next to the originals)
+	
+	bool collectStats;           //!< gather ray counts and timings while rendering (see render_stats.h)
+	char statsFile[256];         //!< with collectStats: also write the statistics here, as JSON (empty = don't)
+	char statsHeatmap[256];      //!< with collectStats: save the time per pixel here, e.g. as an .exr (empty = don't)
+	
+	// Animation (see Scene::setFrame()):
+	int animationStart;          //!< the first frame. The keyed properties get their values for it when parsed
+	int animationEnd;            //!< the last frame; if it's before animationStart, a single frame is rendered as usual
+	char outputFile[256];        //!< where to save the frames of an animation, with a %d for the frame number
+	
+	// Checkpoints (see checkpoint.h):
+	char checkpointFile[256];    //!< save the progress of a (non-interactive) render here, to resume it later (empty = don't)
+	double checkpointInterval;   //!< how often to save it (seconds)
 		
 	GlobalSettings();
 	void fillProperties(ParsedBlock& pb);
@@ -277,23 +329,42 @@ struct GlobalSettings: public SceneElement {
 	bool needAApass();
 };
 
+struct AnimatedElement;
+
 struct Scene {
 	std::vector<Geometry*> geometries;
 	std::vector<Shader*> shaders;
 	std::vector<Node*> nodes;
-	std::vector<Node*> superNodes; // also Nodes, but without a shader attached; don't represent an scene object directly
+	std::vector<Node*> superNodes; // also Nodes, but without a shader attached, or in a referenced sub-scene; don't represent an scene object directly
 	std::vector<Texture*> textures;
 	std::vector<Light*> lights;
 	Environment* environment;
 	Camera* camera;
 	GlobalSettings settings;
+	std::vector<std::string> sourceFiles; //!< the scene file, and the files it includes or references
+	std::vector<AnimatedElement*> animated; //!< the elements with keyed properties
 	
 	Scene();
 	~Scene();
 	
 	bool parseScene(const char* sceneFile); //!< Parses a scene file and loads the scene from it. Returns true on success.
+	/// Parses the scene file again, reusing the elements, whose class, name, properties and everything they reference
+	/// are unchanged (they keep their state, e.g. loaded meshes and textures). On failure, the scene is unchanged
+	bool reloadScene(const char* sceneFile);
+	/// removes the given elements from the scene, without deleting them
+	void forgetElements(const std::vector<SceneElement*>& elements);
 	void beginRender(); //!< Notifies the scene so that a render is about to begin. It calls the beginRender() method of all scene elements
-	void beginFrame(); //!< Notifies the scene so that a new frame is about to begin. It calls the beginFrame() method of all scene elements
+	/// Notifies the scene so that a new frame is about to begin. The elements, which changed (or depend on a changed
+	/// one) since their last beginRender() get it again; then, the ones changed since their last beginFrame() get that.
+	/// @returns true if anything besides the camera changed since the last frame
+	bool beginFrame();
+	/// Sets the keyed properties (like "pos@24 (1, 2, 3)") of the animated elements to their values at the given frame,
+	/// interpolating between the keys. Only the elements, whose values change, are refilled (and marked as changed)
+	void setFrame(double frame);
+	std::vector<SceneElement*> getAllElements(); //!< all elements, in the order of initialization (see beginRender())
+	/// identifies the scene's contents, as parsed (e.g. to check that another process, or a saved checkpoint, has the
+	/// same scene)
+	uint64_t getContentsHash();
 };
 
 extern Scene scene;
@@ -24,9 +24,11 @@
  */
 #include <SDL/SDL.h>
 #include <stdio.h>
+#include <string.h>
 #include "sdl.h"
 #include "bitmap.h"
 #include <algorithm>
+#include <vector>
 using namespace std;
 
 SDL_Surface* screen = NULL;
@@ -34,6 +36,30 @@ volatile bool rendering; // used in main/worker thread synchronization
 SDL_Thread *render_thread;
 SDL_mutex *render_lock;
 bool render_async, wantToQuit = false;
+static int headlessWidth = 0, headlessHeight = 0;
+
+// the asynchronous display (see displayVFBAsync()):
+static SDL_Thread* displayThread = NULL;
+static SDL_mutex* displayMutex = NULL;
+static SDL_cond* displayCond = NULL;
+static bool displayPending = false, displayQuit = false;
+static bool convertedPending = false; //!< convertedFrame holds a frame, which isn't on the screen yet
+static vector<Color> frontBuffer; //!< a copy of the last finished frame (frameWidth() * frameHeight())
+static vector<Uint32> convertedFrame; //!< the front buffer, converted to the screen format by the display thread
+
+class MutexRAII {
+	SDL_mutex* mutex;
+public:
+	MutexRAII(SDL_mutex* _mutex)
+	{
+		mutex = _mutex;
+		SDL_mutexP(mutex);
+	}
+	~MutexRAII()
+	{
+		SDL_mutexV(mutex);
+	}
+};
 
 /// try to create a frame window with the given dimensions
 bool initGraphics(int frameWidth, int frameHeight, bool fullscren)
@@ -50,18 +76,37 @@ bool initGraphics(int frameWidth, int frameHeight, bool fullscren)
 		printf("Cannot set video mode %dx%d - %s\n", frameWidth, frameHeight, SDL_GetError());
 		return false;
 	}
+	render_lock = SDL_CreateMutex();
 	return true;
 }
 
+/// no window; the drawing functions do nothing
+void initHeadless(int frameWidth, int frameHeight)
+{
+	headlessWidth = frameWidth;
+	headlessHeight = frameHeight;
+}
+
 /// closes SDL graphics
 void closeGraphics(void)
 {
+	if (displayThread) {
+		SDL_mutexP(displayMutex);
+		displayQuit = true;
+		SDL_CondBroadcast(displayCond);
+		SDL_mutexV(displayMutex);
+		SDL_WaitThread(displayThread, NULL);
+		displayThread = NULL;
+		SDL_DestroyCond(displayCond);
+		SDL_DestroyMutex(displayMutex);
+	}
 	SDL_Quit();
 }
 
 /// displays a VFB (virtual frame buffer) to the real framebuffer, with the necessary color clipping
 void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 {
+	if (!screen) return;
 	int rs = screen->format->Rshift;
 	int gs = screen->format->Gshift;
 	int bs = screen->format->Bshift;
@@ -73,22 +118,100 @@ void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 	SDL_Flip(screen);
 }
 
+/**
+ * converts the front buffer to the screen format, whenever displayVFBAsync() hands it a new frame. It only writes
+ * to its own buffer: the render threads draw on the screen, too, and SDL wants the flip on the main thread, so
+ * presentConvertedFrame() puts it on the screen later
+ */
+static int displayThreadProc(void* /*unused*/)
+{
+	int rs = screen->format->Rshift;
+	int gs = screen->format->Gshift;
+	int bs = screen->format->Bshift;
+	SDL_mutexP(displayMutex);
+	while (true) {
+		while ((!displayPending || convertedPending) && !displayQuit) SDL_CondWait(displayCond, displayMutex);
+		if (displayQuit) break;
+		SDL_mutexV(displayMutex);
+		// (the front buffer and the converted frame aren't touched by anyone else, until the flags are changed)
+		const Color* src = &frontBuffer[0];
+		Uint32* dest = &convertedFrame[0];
+		for (int i = 0; i < screen->w * screen->h; i++)
+			*dest++ = (src++)->toRGB32(rs, gs, bs);
+		SDL_mutexP(displayMutex);
+		displayPending = false;
+		convertedPending = true;
+		SDL_CondBroadcast(displayCond);
+	}
+	SDL_mutexV(displayMutex);
+	return 0;
+}
+
+/// copies the last frame, converted by the display thread, to the screen, and flips. Only on the main thread
+static void presentConvertedFrame()
+{
+	if (!displayThread) return;
+	SDL_mutexP(displayMutex);
+	if (convertedPending) {
+		MutexRAII raii(render_lock);
+		for (int y = 0; y < screen->h; y++)
+			memcpy((Uint8*) screen->pixels + y * screen->pitch, &convertedFrame[y * screen->w],
+			       screen->w * sizeof(Uint32));
+		SDL_Flip(screen);
+		convertedPending = false;
+		SDL_CondBroadcast(displayCond);
+	}
+	SDL_mutexV(displayMutex);
+}
+
+void displayVFBAsync(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+{
+	if (!screen) return;
+	if (!displayThread) {
+		frontBuffer.resize(screen->w * screen->h);
+		convertedFrame.resize(screen->w * screen->h);
+		displayMutex = SDL_CreateMutex();
+		displayCond = SDL_CreateCond();
+		displayThread = SDL_CreateThread(displayThreadProc, NULL);
+		if (!displayThread) {
+			displayVFB(vfb);
+			return;
+		}
+	}
+	presentConvertedFrame();
+	SDL_mutexP(displayMutex);
+	while (displayPending) SDL_CondWait(displayCond, displayMutex); // still converting the previous frame?
+	for (int y = 0; y < screen->h; y++)
+		memcpy(&frontBuffer[y * screen->w], vfb[y], screen->w * sizeof(Color));
+	displayPending = true;
+	SDL_CondBroadcast(displayCond);
+	SDL_mutexV(displayMutex);
+}
+
+int pollEvent(SDL_Event* ev)
+{
+	presentConvertedFrame(); // (a frame, converted in the meantime)
+	MutexRAII raii(render_lock);
+	return SDL_PollEvent(ev);
+}
+
 /// returns the frame width
 int frameWidth(void)
 {
 	if (screen) return screen->w;
-	return 0;
+	return headlessWidth;
 }
 
 /// returns the frame height
 int frameHeight(void)
 {
 	if (screen) return screen->h;
-	return 0;
+	return headlessHeight;
 }
 
 void setWindowCaption(const char* msg, float renderTime)
 {
+	if (!screen) return;
 	if (renderTime >= 0) {
 		char message[128];
 		sprintf(message, msg, renderTime);
@@ -119,7 +242,7 @@ static void findUnusedFN(char fn[], const char* suffix)
 
 bool takeScreenshot(const char* filename)
 {
-	extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; // from main.cpp
+	extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; // from render.cpp
 	
 	Bitmap bmp;
 	bmp.generateEmptyImage(frameWidth(), frameHeight());
@@ -177,27 +300,29 @@ static void handleEvent(SDL_Event& ev)
 
 /// waits the user to indicate he wants to close the application (by either clicking on the "X" of the window,
 /// or by pressing ESC)
-void waitForUserExit(void)
+void waitForUserExit(bool (*stopWaiting)(void))
 {
 	SDL_Event ev;
-	while (!wantToQuit && SDL_WaitEvent(&ev)) {
-		handleEvent(ev);
+	if (!stopWaiting) {
+		while (!wantToQuit && SDL_WaitEvent(&ev)) {
+			handleEvent(ev);
+		}
+		return;
+	}
+	while (!wantToQuit && !stopWaiting()) {
+		while (!wantToQuit && SDL_PollEvent(&ev)) {
+			handleEvent(ev);
+		}
+		SDL_Delay(100);
 	}
 }
 
-class MutexRAII {
-	SDL_mutex* mutex;
-public:
-	MutexRAII(SDL_mutex* _mutex)
-	{
-		mutex = _mutex;
-		SDL_mutexP(mutex);
-	}
-	~MutexRAII()
-	{
-		SDL_mutexV(mutex);
-	}
-};
+void handlePendingEvents(void)
+{
+	SDL_Event ev;
+	while (!wantToQuit && pollEvent(&ev))
+		handleEvent(ev);
+}
 
 bool renderScene_threaded(void)
 {
@@ -266,6 +391,7 @@ bool drawRect(Rect r, const Color& c)
 	MutexRAII raii(render_lock);
 	
 	if (render_async && !rendering) return false;
+	if (!screen) return true;
 	
 	r.clip(frameWidth(), frameHeight());
 	
@@ -289,6 +415,7 @@ bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 	MutexRAII raii(render_lock);
 
 	if (render_async && !rendering) return false;
+	if (!screen) return true;
 	
 	r.clip(frameWidth(), frameHeight());
 	int rs = screen->format->Rshift;
@@ -309,6 +436,7 @@ bool markRegion(Rect r, const Color& bracketColor)
 	MutexRAII raii(render_lock);
 
 	if (render_async && !rendering) return false;
+	if (!screen) return true;
 	
 	r.clip(frameWidth(), frameHeight());
 	const int L = 8;
@@ -27,19 +27,32 @@
 #include "color.h"
 #include "constants.h"
 
+union SDL_Event;
+
 extern volatile bool rendering; // used in main/worker thread synchronization
 extern bool wantToQuit;
 
 bool initGraphics(int frameWidth, int frameHeight, bool fullscreen);
+void initHeadless(int frameWidth, int frameHeight); //!< render without a window (e.g. for benchmarks)
 void closeGraphics(void);
 void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]); //!< displays the VFB (Virtual framebuffer) to the real one.
-void waitForUserExit(void); //!< Pause. Wait until the user closes the application
+/// same as displayVFB(), but only copies the VFB, and returns; the conversion is done in a separate thread, so the
+/// next frame may be rendered into the VFB meanwhile. The converted frame is put on the screen (and flipped) by the
+/// main thread, in the next handlePendingEvents()/pollEvent() or displayVFBAsync(). Waits if the previous frame is
+/// still being converted
+void displayVFBAsync(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]);
+int pollEvent(SDL_Event* ev); //!< SDL_PollEvent(), synchronized with the asynchronous display
+/// Pause. Wait until the user closes the application, or until `stopWaiting' (if given; it's polled a few times a
+/// second) returns true
+void waitForUserExit(bool (*stopWaiting)(void) = nullptr);
+void handlePendingEvents(void); //!< handles the events since the last call (e.g. closing the window), without waiting
 int frameWidth(void); //!< returns the frame width (pixels)
 int frameHeight(void); //!< returns the frame height (pixels)
 /// sets the caption of the display window. If renderTime >= 0, the
 /// msg is interpreted as a format string, and must contain '%f'
 void setWindowCaption(const char* msg, float renderTime = -1.0f);
 bool renderScene_threaded();
+bool takeScreenshot(const char* filename); //!< saves the vfb to a file (the format is detected from the extension)
 
 struct Rect {
 	int x0, y0, x1, y1, w, h;
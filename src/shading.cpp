@@ -27,6 +27,7 @@
 #include "main.h"
 #include "random_generator.h"
 #include "lights.h"
+#include "texture_cache.h"
 #include <string.h>
 #include <algorithm>
 using namespace std;
@@ -49,7 +50,7 @@ Color Lambert::shade(const Ray& ray, const IntersectionInfo& info)
 {
 	Color diffuseColor = color;
 	if (diffuseTex) diffuseColor *= diffuseTex->sample(ray, info);
-	Color shadeResult = diffuseColor * scene.settings.ambientLight;
+	Color shadeResult = diffuseColor * getAmbientLight(ray, info);
 	
 	for (auto light: scene.lights) {
 		int numLightSamples = 0;
@@ -71,7 +72,7 @@ Color Lambert::shade(const Ray& ray, const IntersectionInfo& info)
 			
 			lambertTerm = max(0.0f, lambertTerm);
 			
-			if (visible(info.ip + n * 1e-6, lightPos))
+			if (visible(info.ip + n * 1e-6, lightPos, ray.time))
 				sum += diffuseColor * lightColor * lambertTerm;
 		}
 		shadeResult += sum / numLightSamples;
@@ -93,6 +94,7 @@ void Lambert::spawnRay(const IntersectionInfo& x, const Ray& w_in, Ray& w_out, C
 	w_out.start = x.ip + x.norm * 1e-6;
 	w_out.dir = hemisphereSample(x);
 	w_out.flags |= RF_DIFFUSE;
+	w_out.flags &= ~RF_DIFFERENTIALS; // no sensible footprint after a diffuse bounce
 	float cosTerm = max(0.0, dot(x.norm, w_out.dir));
 	brdfColor = color * (cosTerm / PI);
 	pdf = 1 / (2 * PI);
@@ -102,7 +104,7 @@ Color Phong::shade(const Ray& ray, const IntersectionInfo& info)
 {
 	Color diffuseColor = color;
 	if (diffuseTex) diffuseColor *= diffuseTex->sample(ray, info);
-	Color shadeResult = diffuseColor * scene.settings.ambientLight;
+	Color shadeResult = diffuseColor * getAmbientLight(ray, info);
 
 	for (auto light: scene.lights) {	
 		int numLightSamples = 0;
@@ -124,7 +126,7 @@ Color Phong::shade(const Ray& ray, const IntersectionInfo& info)
 			
 			lambertTerm = max(0.0f, lambertTerm);
 			
-			if (visible(info.ip + n * 1e-6, lightPos)) {
+			if (visible(info.ip + n * 1e-6, lightPos, ray.time)) {
 				Color result = diffuseColor * lightColor * lambertTerm;
 				
 				Vector fromLight = -toLight;
@@ -144,17 +146,50 @@ Color Phong::shade(const Ray& ray, const IntersectionInfo& info)
 }
 
 
+void getTextureFilterProp(ParsedBlock& pb, TextureFilter& filter)
+{
+	char filterName[256];
+	if (pb.getStringProp("filter", filterName) && !parseTextureFilter(filterName, filter))
+		pb.signalError("Unknown texture filter; expected one of `nearest', `bilinear', `trilinear' or `anisotropic'");
+}
+
+void BitmapTexture::fillProperties(ParsedBlock& pb)
+{
+	double scale = 1;
+	pb.getDoubleProp("scaling", &scale);
+	scaling = 1/scale;
+	getTextureFilterProp(pb, filter);
+	const GlobalSettings& settings = pb.getParser().getSettings(); // (on a reload, not the current scene's)
+	if (settings.textureCacheSize > 0) {
+		char filename[256];
+		if (!pb.getFilenameProp("file", filename))
+			pb.requiredProp("file");
+		tiledImage = textureCache.openImage(filename, settings.textureCacheDir);
+		if (!tiledImage) {
+			char msg[320];
+			snprintf(msg, sizeof(msg), "Cannot load texture `%s' into the texture cache", filename);
+			pb.signalError(msg);
+		}
+	} else {
+		if (!pb.getBitmapFileProp("file", bmp))
+			pb.requiredProp("file");
+	}
+}
+
+void BitmapTexture::beginRender()
+{
+	if (tiledImage) {
+		image = tiledImage;
+	} else {
+		mipmap.build(bmp);
+		image = &mipmap;
+	}
+}
+
 Color BitmapTexture::sample(const Ray& ray, const IntersectionInfo& info)
 {
-	int int_x = int(floor(info.u * scaling * bmp.getWidth()));
-	int int_y = int(floor(info.v * scaling * bmp.getHeight()));
-	
-	int_x %= bmp.getWidth();
-	int_y %= bmp.getHeight();
-	if (int_x < 0) int_x += bmp.getWidth();
-	if (int_y < 0) int_y += bmp.getHeight();
-	
-	return bmp.getPixel(int_x, int_y);
+	return image->sample(filter, info.u * scaling, info.v * scaling,
+	                     info.dudx * scaling, info.dvdx * scaling, info.dudy * scaling, info.dvdy * scaling);
 }
 
 Color Reflection::shade(const Ray& ray, const IntersectionInfo& info)
@@ -166,6 +201,7 @@ Color Reflection::shade(const Ray& ray, const IntersectionInfo& info)
 		newRay.start = info.ip + n * 1e-6;
 		newRay.dir = reflect(ray.dir, n);
 		newRay.depth = ray.depth + 1;
+		reflectRayDifferentials(ray, info, n, newRay);
 		
 		return raytrace(newRay) * mult;
 	} else {
@@ -196,6 +232,7 @@ Color Reflection::shade(const Ray& ray, const IntersectionInfo& info)
 			newRay.start = info.ip + n * 1e-6;
 			newRay.dir = reflected;
 			newRay.depth = ray.depth + 1;
+			reflectRayDifferentials(ray, info, n, newRay);
 			
 			sum += raytrace(newRay) * mult;
 		}
@@ -219,6 +256,7 @@ void Reflection::spawnRay(const IntersectionInfo& x, const Ray& w_in, Ray& w_out
 	w_out.depth++;
 	w_out.start = x.ip + n * 1e-6;
 	w_out.dir = reflect(w_in.dir, x.norm);
+	reflectRayDifferentials(w_in, x, n, w_out);
 	w_out.flags &= ~RF_DIFFUSE;
 	float MY_INFINITY = 1e9;
 	brdfColor = mult * MY_INFINITY;
@@ -256,6 +294,7 @@ Color Refraction::shade(const Ray& ray, const IntersectionInfo& info)
 		newRay.start = info.ip - n * 1e-6;
 		newRay.dir = refracted;
 		newRay.depth = ray.depth + 1;
+		refractRayDifferentials(ray, info, n, myIor, newRay);
 		return raytrace(newRay) * mult;
 	} else {
 		return Color(0, 0, 0); // total infernal refraction
@@ -288,6 +327,7 @@ void Refraction::spawnRay(const IntersectionInfo& x, const Ray& w_in, Ray& w_out
 		w_out.start = x.ip - n * 1e-6;
 		w_out.dir = refracted;
 		w_out.depth = w_in.depth + 1;
+		refractRayDifferentials(w_in, x, n, myIor, w_out);
 		w_out.flags &= ~RF_DIFFUSE;
 		float MY_INFINITY = 1e9;
 		brdfColor = mult * MY_INFINITY;
@@ -315,6 +355,7 @@ void Layered::fillProperties(ParsedBlock& pb)
 	char name[128];
 	char value[256];
 	int srcLine;
+	numLayers = 0; // (the properties may be filled again, e.g. for a new animation frame)
 	for (int i = 0; i < pb.getBlockLines(); i++) {
 		// fetch and parse all lines like "layer <shader>, <color>[, <texture>]"
 		pb.getBlockLine(i, srcLine, name, value);
@@ -349,6 +390,8 @@ void Layered::fillProperties(ParsedBlock& pb)
 			if (err) throw SyntaxError(srcLine, "Expected a line like `layer <shader>, <color>[, <texture>]'");
 			double x, y, z;
 			get3Doubles(srcLine, value, x, y, z);
+			addDependency(shader);
+			if (texture) addDependency(texture);
 			addLayer(shader, Color((float) x, (float) y, (float) z), texture);
 		}
 	}
@@ -386,7 +429,11 @@ Color FresnelTexture::sample(const Ray& ray, const IntersectionInfo& info)
 
 void BumpTexture::beginRender()
 {
-	bumpTex.differentiate();
+	if (!differentiated) {
+		bumpTex.differentiate();
+		differentiated = true;
+	}
+	mipmap.build(bumpTex);
 }
 
 Color BumpTexture::sample(const Ray& ray, const IntersectionInfo& info)
@@ -396,15 +443,8 @@ Color BumpTexture::sample(const Ray& ray, const IntersectionInfo& info)
 
 void BumpTexture::getDeflection(const IntersectionInfo& info, float& dx, float& dy)
 {
-	int int_x = int(floor(info.u * scaling * bumpTex.getWidth()));
-	int int_y = int(floor(info.v * scaling * bumpTex.getHeight()));
-	
-	int_x %= bumpTex.getWidth();
-	int_y %= bumpTex.getHeight();
-	if (int_x < 0) int_x += bumpTex.getWidth();
-	if (int_y < 0) int_y += bumpTex.getHeight();
-	
-	Color t = bumpTex.getPixel(int_x, int_y);
+	Color t = mipmap.sample(filter, info.u * scaling, info.v * scaling,
+	                        info.dudx * scaling, info.dvdx * scaling, info.dudy * scaling, info.dvdy * scaling);
 	dx = t.r * bumpIntensity;
 	dy = t.g * bumpIntensity;
 }
@@ -27,6 +27,7 @@
 #include "color.h"
 #include "geometry.h"
 #include "bitmap.h"
+#include "mipmap.h"
 #include "scene.h"
 
 
@@ -57,18 +58,21 @@ public:
 	Color sample(const Ray& ray, const IntersectionInfo& info) override;
 };
 
+/// parses the optional "filter" property of bitmap-based textures (see TextureFilter)
+void getTextureFilterProp(ParsedBlock& pb, TextureFilter& filter);
+
+class TiledImage;
 class BitmapTexture: public Texture {
 	Bitmap bmp;
+	MipMap mipmap;
+	TiledImage* tiledImage = nullptr; //!< if the texture cache is on, the image is paged from here (and `bmp' is unused)
+	const MipMapBase* image = nullptr;
 public:
 	double scaling = 1;
-	void fillProperties(ParsedBlock& pb)
-	{
-		pb.getDoubleProp("scaling", &scaling);
-		scaling = 1/scaling;
-		if (!pb.getBitmapFileProp("file", bmp))
-			pb.requiredProp("file");
-	}
+	TextureFilter filter = FILTER_ANISOTROPIC;
+	void fillProperties(ParsedBlock& pb);
 	
+	void beginRender() override;
 	Color sample(const Ray& ray, const IntersectionInfo& info) override;
 };
 
@@ -82,9 +86,12 @@ struct BumpMapperInterface {
 
 class BumpTexture: public Texture, public BumpMapperInterface {
 	Bitmap bumpTex;
+	bool differentiated = false; //!< bumpTex already holds the derivatives (beginRender() may be called again)
+	MipMap mipmap;
 public:
 	double scaling = 1;
 	double bumpIntensity = 10.0f;
+	TextureFilter filter = FILTER_ANISOTROPIC;
 
 	void fillProperties(ParsedBlock& pb)
 	{
@@ -92,6 +99,8 @@ public:
 		pb.getDoubleProp("scaling", &scaling);
 		if (!pb.getBitmapFileProp("file", bumpTex))
 			pb.requiredProp("file");
+		differentiated = false;
+		getTextureFilterProp(pb, filter);
 	}
 
 	void* getInterface(int id)
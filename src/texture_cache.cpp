@@ -0,0 +1,326 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File texture_cache.cpp
+ * @Brief A cache of tiled, mip-mapped textures, which are paged in from disk on demand
+ */
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#	include <io.h>
+#else
+#	include <unistd.h>
+#endif
+#include "texture_cache.h"
+#include "bitmap.h"
+using namespace std;
+
+TextureCache textureCache;
+
+static const char TILED_MAGIC[4] = { 'F', 'T', 'X', '1' };
+
+/// the header of a tiled image file. It's followed by the tiles of all levels (level 0 first),
+/// each stored as TEXTURE_TILE_SIZE^2 Colors, in row-major order. The edge tiles are padded with black.
+struct TiledFileHeader {
+	char magic[4];
+	int tileSize;
+	int numLevels;
+	int levelWidth[MAX_MIP_LEVELS], levelHeight[MAX_MIP_LEVELS];
+	long long sourceSize, sourceTime; //!< to detect changes in the original image
+};
+
+static const long long TILE_BYTES = sizeof(TextureTile);
+
+/// reads `size' bytes at the given offset, without moving a shared file position (so it's safe to call from
+/// several threads at once)
+static bool readAt(FILE* fp, long long offset, void* data, size_t size)
+{
+#ifdef _WIN32
+	HANDLE handle = (HANDLE) _get_osfhandle(_fileno(fp));
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+	DWORD bytesRead = 0;
+	return ReadFile(handle, data, (DWORD) size, &bytesRead, &overlapped) && bytesRead == size;
+#else
+	char* dest = (char*) data;
+	while (size > 0) {
+		ssize_t n = pread(fileno(fp), dest, size, (off_t) offset);
+		if (n <= 0) return false;
+		dest += n;
+		offset += n;
+		size -= n;
+	}
+	return true;
+#endif
+}
+
+static inline uint64_t tileKey(int imageId, int level, int tx, int ty)
+{
+	return ((uint64_t) imageId << 47) | ((uint64_t) level << 42) | ((uint64_t) ty << 21) | (uint64_t) tx;
+}
+
+static inline int shardOf(uint64_t key)
+{
+	key ^= key >> 29;
+	key *= 0xbf58476d1ce4e5b9ull;
+	key ^= key >> 32;
+	return (int) (key & 15);
+}
+
+/// Each render thread remembers the last few tiles it used. Most texel lookups hit one of them,
+/// and are then served without touching the (locked) shared cache.
+struct RecentTiles {
+	static const int SIZE = 4;
+	struct Slot {
+		uint64_t key = ~0ull;
+		shared_ptr<TextureTile> tile;
+	} slots[SIZE];
+	int next = 0;
+	long long hits = 0; //!< not yet reported to the TextureCache
+};
+
+static thread_local RecentTiles recentTiles;
+
+TiledImage::~TiledImage()
+{
+	if (fp) fclose(fp);
+}
+
+bool TiledImage::open(const char* filename, long long sourceSize, long long sourceTime)
+{
+	fp = fopen(filename, "rb");
+	if (!fp) return false;
+	TiledFileHeader header;
+	if (fread(&header, sizeof(header), 1, fp) != 1
+	    || memcmp(header.magic, TILED_MAGIC, 4)
+	    || header.tileSize != TEXTURE_TILE_SIZE
+	    || header.numLevels < 1 || header.numLevels > MAX_MIP_LEVELS
+	    || header.sourceSize != sourceSize || header.sourceTime != sourceTime) {
+		fclose(fp);
+		fp = nullptr;
+		return false;
+	}
+	numLevels = header.numLevels;
+	long long tileCount = 0;
+	for (int i = 0; i < numLevels; i++) {
+		levelWidth[i] = header.levelWidth[i];
+		levelHeight[i] = header.levelHeight[i];
+		tilesX[i] = (levelWidth[i] + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		tilesY[i] = (levelHeight[i] + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		firstTile[i] = tileCount;
+		tileCount += (long long) tilesX[i] * tilesY[i];
+	}
+	dataOffset = sizeof(header);
+	return true;
+}
+
+bool TiledImage::readTile(int level, int tx, int ty, TextureTile& tile) const
+{
+	long long offset = dataOffset + (firstTile[level] + (long long) ty * tilesX[level] + tx) * TILE_BYTES;
+	return readAt(fp, offset, &tile, sizeof(tile));
+}
+
+Color TiledImage::fetchTexel(int level, int x, int y) const
+{
+	int tx = x / TEXTURE_TILE_SIZE, ty = y / TEXTURE_TILE_SIZE;
+	int texelIdx = (y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + (x % TEXTURE_TILE_SIZE);
+	uint64_t key = tileKey(id, level, tx, ty);
+	RecentTiles& recent = recentTiles;
+	for (int i = 0; i < RecentTiles::SIZE; i++)
+		if (recent.slots[i].key == key) {
+			recent.hits++;
+			return recent.slots[i].tile->texels[texelIdx];
+		}
+	shared_ptr<TextureTile> tile = textureCache.getTile(this, level, tx, ty, recent.hits);
+	recent.hits = 0;
+	RecentTiles::Slot& slot = recent.slots[recent.next];
+	recent.next = (recent.next + 1) % RecentTiles::SIZE;
+	slot.key = key;
+	slot.tile = tile;
+	return tile->texels[texelIdx];
+}
+
+TextureCache::~TextureCache()
+{
+	for (auto image: images) delete image;
+	images.clear();
+}
+
+void TextureCache::setBudget(int megabytes)
+{
+	budgetMB = megabytes;
+	long long totalTiles = (long long) megabytes * 1024 * 1024 / TILE_BYTES;
+	maxTilesPerShard = max(1, (int) min(totalTiles / NUM_SHARDS, (long long) INT_MAX));
+}
+
+static string tiledFileName(const char* sourceFile, const char* cacheDir)
+{
+	if (!cacheDir || !cacheDir[0]) return string(sourceFile) + ".ftx";
+	// put all tiled files in one directory; a hash of the full path keeps same-named images apart:
+	const char* baseName = sourceFile;
+	for (const char* p = sourceFile; *p; p++)
+		if (*p == '/' || *p == '\\') baseName = p + 1;
+	unsigned hash = 2166136261u;
+	for (const char* p = sourceFile; *p; p++) hash = (hash ^ (unsigned char) *p) * 16777619u;
+	char suffix[32];
+	sprintf(suffix, ".%08x.ftx", hash);
+	string dir = cacheDir;
+	if (dir.back() != '/' && dir.back() != '\\') dir += '/';
+	return dir + baseName + suffix;
+}
+
+bool TextureCache::convertImage(const char* sourceFile, const char* tiledFile, long long sourceSize, long long sourceTime)
+{
+	Bitmap bmp;
+	if (!bmp.loadImage(sourceFile)) return false;
+	printf("Converting texture `%s' to tiled format (`%s')...\n", sourceFile, tiledFile);
+	MipMap mipmap;
+	mipmap.build(bmp);
+	
+	TiledFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILED_MAGIC, 4);
+	header.tileSize = TEXTURE_TILE_SIZE;
+	header.numLevels = mipmap.getNumLevels();
+	for (int i = 0; i < header.numLevels; i++) {
+		header.levelWidth[i] = mipmap.getLevel(i).getWidth();
+		header.levelHeight[i] = mipmap.getLevel(i).getHeight();
+	}
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	
+	// write to a temporary file first, so that an interrupted conversion doesn't leave a broken tiled file:
+	string tempFile = string(tiledFile) + ".tmp";
+	FILE* fp = fopen(tempFile.c_str(), "wb");
+	if (!fp) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	TextureTile tile;
+	for (int level = 0; ok && level < header.numLevels; level++) {
+		const Bitmap& src = mipmap.getLevel(level);
+		int w = src.getWidth(), h = src.getHeight();
+		for (int ty = 0; ok && ty * TEXTURE_TILE_SIZE < h; ty++)
+			for (int tx = 0; ok && tx * TEXTURE_TILE_SIZE < w; tx++) {
+				for (int y = 0; y < TEXTURE_TILE_SIZE; y++)
+					for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+						int sx = tx * TEXTURE_TILE_SIZE + x, sy = ty * TEXTURE_TILE_SIZE + y;
+						tile.texels[y * TEXTURE_TILE_SIZE + x] = (sx < w && sy < h) ? src.getPixel(sx, sy) : Color(0, 0, 0);
+					}
+				ok = fwrite(&tile, sizeof(tile), 1, fp) == 1;
+			}
+	}
+	if (fclose(fp) != 0) ok = false;
+	remove(tiledFile);
+	if (!ok || rename(tempFile.c_str(), tiledFile) != 0) {
+		remove(tempFile.c_str());
+		return false;
+	}
+	return true;
+}
+
+TiledImage* TextureCache::openImage(const char* filename, const char* cacheDir)
+{
+	for (auto image: images)
+		if (image->sourceFile == filename) return image;
+	
+	struct stat st;
+	if (stat(filename, &st) != 0) return nullptr;
+	long long sourceSize = st.st_size, sourceTime = st.st_mtime;
+	
+	string tiledFile = tiledFileName(filename, cacheDir);
+	TiledImage* image = new TiledImage;
+	if (!image->open(tiledFile.c_str(), sourceSize, sourceTime)) {
+		if (!convertImage(filename, tiledFile.c_str(), sourceSize, sourceTime)
+		    || !image->open(tiledFile.c_str(), sourceSize, sourceTime)) {
+			delete image;
+			return nullptr;
+		}
+	}
+	image->sourceFile = filename;
+	image->id = (int) images.size();
+	images.push_back(image);
+	return image;
+}
+
+shared_ptr<TextureTile> TextureCache::getTile(const TiledImage* image, int level, int tx, int ty, long long localHits)
+{
+	uint64_t key = tileKey(image->id, level, tx, ty);
+	Shard& shard = shards[shardOf(key)];
+	shard.mutex.enter();
+	shard.hits += localHits;
+	auto it = shard.index.find(key);
+	if (it != shard.index.end()) {
+		shard.hits++;
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		shared_ptr<TextureTile> tile = it->second->tile;
+		shard.mutex.leave();
+		return tile;
+	}
+	shard.misses++;
+	shard.mutex.leave();
+	
+	// read the tile without holding the shard's lock, so that other threads aren't blocked on the disk:
+	shared_ptr<TextureTile> tile = make_shared<TextureTile>();
+	if (!image->readTile(level, tx, ty, *tile)) {
+		fprintf(stderr, "Error reading tile (%d, %d) of level %d of texture `%s'\n", tx, ty, level, image->sourceFile.c_str());
+		for (auto& c: tile->texels) c.makeZero();
+	}
+	
+	shard.mutex.enter();
+	it = shard.index.find(key);
+	if (it != shard.index.end()) {
+		// another thread was faster:
+		tile = it->second->tile;
+	} else {
+		shard.lru.push_front(Entry { key, tile });
+		shard.index[key] = shard.lru.begin();
+		while ((int) shard.lru.size() > maxTilesPerShard) {
+			shard.index.erase(shard.lru.back().key);
+			shard.lru.pop_back();
+			shard.evictions++;
+		}
+	}
+	shard.mutex.leave();
+	return tile;
+}
+
+void TextureCache::printStats()
+{
+	if (images.empty()) return;
+	long long hits = 0, misses = 0, evictions = 0, residentTiles = 0;
+	for (auto& shard: shards) {
+		shard.mutex.enter();
+		hits += shard.hits;
+		misses += shard.misses;
+		evictions += shard.evictions;
+		residentTiles += shard.lru.size();
+		shard.mutex.leave();
+	}
+	long long lookups = hits + misses;
+	printf("Texture cache: %lld lookups, %.2f%% hits, %lld misses (%.1f MB read), %lld evictions; %.1f of %d MB in use\n",
+		lookups, lookups ? 100.0 * hits / lookups : 0.0, misses,
+		misses * TILE_BYTES / (1024.0 * 1024.0), evictions,
+		residentTiles * TILE_BYTES / (1024.0 * 1024.0), budgetMB);
+}
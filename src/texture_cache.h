@@ -0,0 +1,117 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2018 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File texture_cache.h
+ * @Brief A cache of tiled, mip-mapped textures, which are paged in from disk on demand
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "color.h"
+#include "mipmap.h"
+#include "cxxptl-sdl.h"
+
+#define TEXTURE_TILE_SIZE 64 //!< the tiles are TEXTURE_TILE_SIZE x TEXTURE_TILE_SIZE texels
+
+/// a single tile of a TiledImage
+struct TextureTile {
+	Color texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+};
+
+/**
+ * @brief a mip-mapped image, which is stored as tiles in a file on disk (*.ftx)
+ *
+ * Nothing but the file header is kept in memory; the tiles are loaded through the texture cache,
+ * when some texel in them is needed. The files are created from ordinary BMP/EXR images by
+ * TextureCache::openImage().
+ */
+class TiledImage: public MipMapBase {
+	friend class TextureCache;
+	std::string sourceFile;  //!< the original image
+	FILE* fp = nullptr;      //!< only read with positioned reads (see readTile()), so it needs no lock
+	int id = 0;              //!< a unique id of the image, used in the keys of the cache
+	int tilesX[MAX_MIP_LEVELS], tilesY[MAX_MIP_LEVELS];
+	long long firstTile[MAX_MIP_LEVELS]; //!< index of the first tile of each level in the file
+	long long dataOffset = 0;
+	
+	bool open(const char* filename, long long sourceSize, long long sourceTime);
+	bool readTile(int level, int tx, int ty, TextureTile& tile) const; //!< thread-safe
+protected:
+	Color fetchTexel(int level, int x, int y) const override;
+public:
+	TiledImage() {}
+	~TiledImage();
+	TiledImage(const TiledImage&) = delete;
+	TiledImage& operator = (const TiledImage&) = delete;
+};
+
+/**
+ * @brief caches the recently used tiles of all TiledImages, within a given memory budget
+ *
+ * The cache is safe to use from any thread. It's split into several independently locked shards,
+ * each with its own LRU list, so that the render threads rarely wait on each other.
+ */
+class TextureCache {
+	struct Entry {
+		uint64_t key;
+		std::shared_ptr<TextureTile> tile;
+	};
+	struct Shard {
+		Mutex mutex;
+		std::list<Entry> lru; //!< most recently used tiles first
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+		long long hits = 0, misses = 0, evictions = 0;
+	};
+	static const int NUM_SHARDS = 16;
+	Shard shards[NUM_SHARDS];
+	int maxTilesPerShard = 1;
+	int budgetMB = 0;
+	std::vector<TiledImage*> images;
+	
+	bool convertImage(const char* sourceFile, const char* tiledFile, long long sourceSize, long long sourceTime);
+public:
+	~TextureCache();
+	
+	/// sets the maximum memory (in megabytes) for all cached tiles
+	void setBudget(int megabytes);
+	
+	/// Opens an image through the cache. The first time an image is used, it's converted to a tiled file,
+	/// which is stored in `cacheDir' (or next to the image, if cacheDir is empty). Subsequent runs reuse
+	/// that file, unless the original image changes.
+	/// Not thread-safe; intended to be called while parsing the scene.
+	/// @returns nullptr on error (e.g. the image can't be loaded, or the tiled file can't be written)
+	TiledImage* openImage(const char* filename, const char* cacheDir);
+	
+	/// gets a tile, loading it from disk if it's not cached. `localHits' is the number of texel lookups, which
+	/// the calling thread served on its own since its last call (only used for the statistics).
+	std::shared_ptr<TextureTile> getTile(const TiledImage* image, int level, int tx, int ty, long long localHits);
+	
+	/// prints the hit/miss statistics (if the cache was used at all)
+	void printStats();
+};
+
+extern TextureCache textureCache;
@@ -30,7 +30,7 @@ inline double det(const Vector& a, const Vector& b, const Vector& c)
 	return (a^b) * c;
 }
 
-bool Triangle::intersect(Ray ray, const Vector& A, const Vector& B, const Vector& C, double& minDist,
+bool Triangle::intersect(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& minDist,
 						 double& l2, double& l3)
 {
 	Vector AB = B - A;
@@ -63,7 +63,7 @@ bool Triangle::intersect(Ray ray, const Vector& A, const Vector& B, const Vector
 	return true;
 }
 
-bool Triangle::intersectFast(Ray ray, const Vector& A, double& minDist, double& l2, double& l3) const
+bool Triangle::intersectFast(const Ray& ray, const Vector& A, double& minDist, double& l2, double& l3) const
 {
 	Vector D = -ray.dir;
 	
@@ -33,9 +33,10 @@ struct Triangle {
 	int t[3]; //!< holds indices to the three texture coordinates of the triangle (indexes in the `uvs' array)
 	Vector gnormal; //!< The geometric normal of the mesh (AB ^ AC, normalized)
 	Vector dNdx, dNdy; //!< tangent and binormal vectors for this triangle
+	Vector dpdu, dpdv; //!< same as dNdx, dNdy, but not normalized (derivatives of the position w.r.t. the UVs)
 	Vector AB, AC, ABcrossAC;
 
-	static bool intersect(Ray ray, const Vector& A, const Vector& B, const Vector& C, double& minDist,
+	static bool intersect(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& minDist,
 						  double& l2, double& l3);
-	bool intersectFast(Ray ray, const Vector& A, double& minDist, double& l2, double& l3) const;
+	bool intersectFast(const Ray& ray, const Vector& A, double& minDist, double& l2, double& l3) const;
 };
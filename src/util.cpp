@@ -101,3 +101,8 @@ static const chrono::time_point<ClockType> programStart = ClockType::now();
 long long getTicks() {
 	return chrono::duration_cast<chrono::milliseconds>(ClockType::now() - programStart).count();
 }
+
+double getPreciseTime()
+{
+	return chrono::duration<double>(ClockType::now() - programStart).count();
+}
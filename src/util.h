@@ -45,6 +45,7 @@ std::vector<std::string> tokenize(std::string s);
 std::vector<std::string> split(std::string s, char separator);
 
 long long getTicks(); //!< returns the current ticks, measured in ms
+double getPreciseTime(); //!< returns the time since the program start, in seconds (with sub-microsecond resolution)
 
 /// a simple RAII class for FILE* pointers.
 class FileRAII {
@@ -216,6 +216,8 @@ enum {
 	RF_DEBUG = 1,
 	
 	RF_DIFFUSE = 2,
+	
+	RF_DIFFERENTIALS = 4, // the ray carries valid ray differentials (see below)
 };
 
 /// @class Ray
@@ -224,6 +226,12 @@ struct Ray {
 	Vector dir; // unit vector!
 	int depth = 0;
 	unsigned flags = 0;
+	double time = 0; //!< with motion blur: when the ray is traced (0 = as the shutter opens, 1 = as it closes)
+	
+	// ray differentials: how the start and the direction of the ray change, if we shift its pixel one unit to the
+	// right (dPdx, dDdx) or one unit down (dPdy, dDdy). Only valid if (flags & RF_DIFFERENTIALS).
+	Vector dPdx, dPdy;
+	Vector dDdx, dDdy;
 	
 	Ray() {}
 	Ray(const Vector& start, const Vector& dir): start(start), dir(dir) {}